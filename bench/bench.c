@@ -0,0 +1,357 @@
+/***
+ * bench.c
+ * End-to-end load generator: drives `received_im` from a number of fake
+ * conversations at once and reports throughput, reply latency, fork rate and
+ * peak memory use.
+ *
+ * With --tokenizer or --fuzz it exercises the argument tokenizer on its own
+ * instead (see tokenize.c).
+ *
+ * Each conversation keeps one message in flight and sends its next one when
+ * the reply arrives, so every entry in the mix should be answered with a
+ * single message (keep command output under [valet] output_max_bytes, and
+ * concurrency within [valet] max_running).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "bench.h"
+#include "context.h"
+#include "defines.h"
+#include "response.h"
+#include "executor.h"
+#include "metrics.h"
+
+#define DEFAULT_BENCH_CONFIG "bench/bench.conf"
+#define DEFAULT_MESSAGES 2000
+#define DEFAULT_CONCURRENCY 16
+#define DEFAULT_TIMEOUT_SEC 60
+
+typedef struct {
+  guint weight;
+  gchar *message;
+} MixEntry;
+
+typedef struct {
+  PurpleConversation *conv;
+  gchar *sender;
+  gint64 sent; /* When the outstanding message went out, or 0 */
+} Conversation;
+
+static gchar *config_path = NULL;
+static gchar **mix_specs = NULL;
+static gchar *redis_address = NULL;
+static gchar *executor = NULL;
+static gint total_messages = DEFAULT_MESSAGES;
+static gint concurrency = DEFAULT_CONCURRENCY;
+static gint timeout_sec = DEFAULT_TIMEOUT_SEC;
+static gint tokenizer_iterations = 0;
+static gint fuzz_iterations = 0;
+static gint fuzz_seed = 0;
+
+static GOptionEntry options[] = {
+  { "config", 'c', 0, G_OPTION_ARG_STRING, &config_path,
+    "Configuration file (default " DEFAULT_BENCH_CONFIG ")", "PATH" },
+  { "messages", 'n', 0, G_OPTION_ARG_INT, &total_messages,
+    "Messages to send in total", "N" },
+  { "concurrency", 'j', 0, G_OPTION_ARG_INT, &concurrency,
+    "Conversations sending at once", "N" },
+  { "mix", 'm', 0, G_OPTION_ARG_STRING_ARRAY, &mix_specs,
+    "A weighted message, eg \"4:fast hello\"; may be repeated", "W:MSG" },
+  { "redis", 'r', 0, G_OPTION_ARG_STRING, &redis_address,
+    "Use the redis server at HOST:PORT for the kvstore", "HOST:PORT" },
+  { "executor", 'e', 0, G_OPTION_ARG_STRING, &executor,
+    "spawn or zygote, overriding the configuration", "MODE" },
+  { "timeout", 't', 0, G_OPTION_ARG_INT, &timeout_sec,
+    "Give up after this many seconds", "SEC" },
+  { "tokenizer", 0, 0, G_OPTION_ARG_INT, &tokenizer_iterations,
+    "Only time the tokenizer against the old regex split", "N" },
+  { "fuzz", 0, 0, G_OPTION_ARG_INT, &fuzz_iterations,
+    "Only fuzz the tokenizer with this many messages", "N" },
+  { "seed", 0, 0, G_OPTION_ARG_INT, &fuzz_seed,
+    "Seed for --fuzz", "N" },
+  { NULL }
+};
+
+/* Used when no --mix is given. */
+static const gchar *default_mix[] = {
+  "6:fast hello",
+  "2:chatty",
+  "1:slow",
+  "2:cached weather",
+  "2:#set bench value",
+  "2:#get bench",
+  NULL
+};
+
+static GMainLoop *loop;
+static Context *context;
+static PurpleAccount account;
+static GArray *mix; /* MixEntry */
+static guint mix_total;
+static GRand *dice;
+static GHashTable *conversations; /* PurpleConvIm -> Conversation */
+static GArray *latencies; /* gint64 microseconds */
+static guint issued = 0;
+static guint answered = 0;
+static guint unsolicited = 0;
+
+static gboolean
+parse_mix (gchar **specs, GError **error) {
+  MixEntry entry;
+  gchar *colon, *end;
+  guint64 weight;
+
+  mix = g_array_new (FALSE, FALSE, sizeof (MixEntry));
+  for (; NULL != *specs; specs++) {
+    colon = strchr (*specs, ':');
+    weight = NULL == colon ? 0 : g_ascii_strtoull (*specs, &end, 10);
+    if (0 == weight || end != colon || '\0' == colon[1]) {
+      g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                   "Bad mix entry \"%s\"; expected WEIGHT:MESSAGE", *specs);
+      return FALSE;
+    }
+    entry.weight = weight;
+    entry.message = g_strdup (colon + 1);
+    g_array_append_val (mix, entry);
+    mix_total += entry.weight;
+  }
+  return TRUE;
+}
+
+static const gchar *
+pick_message (void) {
+  guint i, roll;
+  MixEntry *entry;
+
+  roll = g_rand_int_range (dice, 0, mix_total);
+  for (i = 0; i + 1 < mix->len; i++) {
+    entry = &g_array_index (mix, MixEntry, i);
+    if (roll < entry->weight) {
+      break;
+    }
+    roll -= entry->weight;
+  }
+  return g_array_index (mix, MixEntry, i).message;
+}
+
+static void
+conversation_send (Conversation *conversation) {
+  gchar *message;
+
+  if (issued >= (guint) total_messages) {
+    return;
+  }
+  issued++;
+
+  /* libpurple hands received_im a buffer of its own. */
+  message = g_strdup (pick_message ());
+  conversation->sent = g_get_monotonic_time ();
+  received_im (&account, conversation->sender, message,
+               conversation->conv, 0, context);
+  g_free (message);
+}
+
+static gboolean
+conversation_next (gpointer data) {
+  conversation_send (data);
+  return FALSE;
+}
+
+void
+bench_reply (PurpleConvIm *im, const char *message) {
+  Conversation *conversation;
+  gint64 latency;
+
+  conversation = g_hash_table_lookup (conversations, im);
+  if (NULL == conversation || 0 == conversation->sent) {
+    unsolicited++;
+    return;
+  }
+
+  latency = g_get_monotonic_time () - conversation->sent;
+  g_array_append_val (latencies, latency);
+  conversation->sent = 0;
+  answered++;
+
+  if (answered >= (guint) total_messages) {
+    g_main_loop_quit (loop);
+    return;
+  }
+  /* Builtins answer from inside received_im; do not recurse into it. */
+  g_idle_add (conversation_next, conversation);
+}
+
+static gboolean
+bench_timeout (gpointer data) {
+  g_warning ("Timed out with %u of %d messages answered.",
+             answered, total_messages);
+  g_main_loop_quit (loop);
+  return FALSE;
+}
+
+static gint
+compare_latency (gconstpointer a, gconstpointer b) {
+  gint64 x = *(const gint64 *) a, y = *(const gint64 *) b;
+  return x < y ? -1 : x > y;
+}
+
+static gdouble
+percentile (gdouble p) {
+  guint i;
+
+  if (0 == latencies->len) {
+    return 0;
+  }
+  i = MIN (latencies->len - 1, (guint) (p * latencies->len));
+  return g_array_index (latencies, gint64, i) / 1000.0;
+}
+
+/**
+ * Commands spawned so far, as counted by the metrics module.
+ */
+static guint64
+count_forks (void) {
+  const gchar *name = "valet_command_spawn_latency_seconds_count{";
+  gchar *metrics, **lines, **line, *value;
+  guint64 forks = 0;
+
+  metrics = valet_metrics_render ();
+  lines = g_strsplit (metrics, "\n", -1);
+  for (line = lines; NULL != *line; line++) {
+    if (g_str_has_prefix (*line, name)
+        && NULL != (value = strrchr (*line, ' '))) {
+      forks += g_ascii_strtoull (value + 1, NULL, 10);
+    }
+  }
+  g_strfreev (lines);
+  g_free (metrics);
+  return forks;
+}
+
+static void
+report (gdouble elapsed) {
+  struct rusage usage;
+  guint64 forks;
+
+  g_array_sort (latencies, compare_latency);
+  forks = count_forks ();
+  getrusage (RUSAGE_SELF, &usage);
+
+  printf ("messages   %u of %d answered in %.2fs (%.1f msgs/sec)\n",
+          answered, total_messages, elapsed, answered / elapsed);
+  printf ("latency    p50 %.2fms  p99 %.2fms  max %.2fms\n",
+          percentile (0.50), percentile (0.99), percentile (1.0));
+  printf ("forks      %" G_GUINT64_FORMAT " (%.1f/sec)\n",
+          forks, forks / elapsed);
+  printf ("peak RSS   %ld KiB\n", usage.ru_maxrss);
+  if (unsolicited > 0) {
+    printf ("warning    %u replies arrived with nothing outstanding; "
+            "some mix entries answer with more than one message\n",
+            unsolicited);
+  }
+}
+
+/**
+ * Point the kvstore at redis, or at a scratch directory so runs start empty.
+ */
+static gboolean
+configure_kvstore (GError **error) {
+  gchar **parts;
+
+  if (NULL == redis_address) {
+    g_free (context->store_path);
+    context->store_path = g_dir_make_tmp ("valet-bench-XXXXXX", error);
+    return NULL != context->store_path;
+  }
+
+  parts = g_strsplit (redis_address, ":", 2);
+  context->redis_host = g_strdup (parts[0]);
+  context->redis_port = NULL != parts[1] ? atoi (parts[1]) : 6379;
+  context->kvstore_size = DEFAULT_KVSTORE_LOCAL_CACHE;
+  context->redis_max_pending = DEFAULT_REDIS_MAX_PENDING;
+  g_strfreev (parts);
+  return TRUE;
+}
+
+int
+main (int argc, char *argv[]) {
+  GOptionContext *option_context;
+  GError *error = NULL;
+  Conversation *conversation;
+  gint64 start;
+  gint i;
+
+  option_context = g_option_context_new
+    ("- load test valet's message handling");
+  g_option_context_add_main_entries (option_context, options, NULL);
+  if (!g_option_context_parse (option_context, &argc, &argv, &error)
+      || !parse_mix (mix_specs ? mix_specs : (gchar **) default_mix, &error)) {
+    g_printerr ("%s\n", error->message);
+    return 1;
+  }
+  if (tokenizer_iterations > 0 || fuzz_iterations > 0) {
+    if (tokenizer_iterations > 0) {
+      bench_tokenizer (tokenizer_iterations);
+    }
+    return fuzz_iterations > 0 && !bench_fuzz (fuzz_iterations, fuzz_seed);
+  }
+  if (total_messages <= 0 || concurrency <= 0) {
+    g_printerr ("--messages and --concurrency must be positive\n");
+    return 1;
+  }
+
+  context = get_context (config_path ? config_path : DEFAULT_BENCH_CONFIG,
+                         &error);
+  if (NULL == context) {
+    g_printerr ("Cannot load configuration: %s\n", error->message);
+    return 1;
+  }
+  if (0 == g_strcmp0 (executor, "zygote")) {
+    context->executor = VALET_EXECUTOR_ZYGOTE;
+  }
+  else if (0 == g_strcmp0 (executor, "spawn")) {
+    context->executor = VALET_EXECUTOR_SPAWN;
+  }
+  if ((guint) concurrency > context->max_running) {
+    /* "Busy" notices would be taken for replies and skew the latencies. */
+    g_printerr ("--concurrency must not exceed [valet] max_running (%u)\n",
+                context->max_running);
+    return 1;
+  }
+  if (!configure_kvstore (&error)) {
+    g_printerr ("Cannot set up the kvstore: %s\n", error->message);
+    return 1;
+  }
+
+  valet_executor_start (context->executor);
+  loop = g_main_loop_new (NULL, FALSE);
+  valet_kvstore_connect (context);
+  initialize_responses (context);
+
+  dice = g_rand_new_with_seed (0);
+  latencies = g_array_sized_new (FALSE, FALSE, sizeof (gint64),
+                                 total_messages);
+  conversations = g_hash_table_new (g_direct_hash, g_direct_equal);
+  account.username = "valet@bench";
+  account.protocol_id = "prpl-bench";
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < concurrency; i++) {
+    conversation = g_new0 (Conversation, 1);
+    conversation->sender = g_strdup_printf ("sender%d@bench", i);
+    conversation->conv = bench_conversation_new
+      (&account, conversation->sender);
+    g_hash_table_insert (conversations, conversation->conv->u.im,
+                         conversation);
+    g_idle_add (conversation_next, conversation);
+  }
+  g_timeout_add_seconds (timeout_sec, bench_timeout, NULL);
+
+  g_main_loop_run (loop);
+  report ((g_get_monotonic_time () - start) / (gdouble) G_USEC_PER_SEC);
+  return answered == (guint) total_messages ? 0 : 1;
+}
@@ -0,0 +1,22 @@
+#ifndef __VALET_BENCH_H
+#define __VALET_BENCH_H
+
+#include "purple.h"
+#include <glib.h>
+
+/**
+ * Called by the fake libpurple whenever valet sends a message.
+ */
+void
+bench_reply (PurpleConvIm *, const char *);
+
+PurpleConversation *
+bench_conversation_new (PurpleAccount *, const char *);
+
+void
+bench_tokenizer (guint);
+
+gboolean
+bench_fuzz (guint, guint32);
+
+#endif /* __VALET_BENCH_H */
@@ -0,0 +1,71 @@
+/***
+ * purple.c
+ * Just enough of libpurple's conversation API for valet's message handling
+ * to run without an XMPP account. Sent messages are handed to the benchmark
+ * instead of the network.
+ */
+
+#include "bench.h"
+
+static PurpleBuddy *buddy = NULL;
+
+PurpleConversation *
+bench_conversation_new (PurpleAccount *account, const char *name) {
+  PurpleConversation *conv;
+
+  conv = g_new0 (PurpleConversation, 1);
+  conv->type = PURPLE_CONV_TYPE_IM;
+  conv->account = account;
+  conv->name = g_strdup (name);
+  conv->u.im = g_new0 (PurpleConvIm, 1);
+  conv->u.im->conv = conv;
+  return conv;
+}
+
+PurpleConversation *
+purple_conversation_new (PurpleConversationType type,
+                         PurpleAccount *account,
+                         const char *name) {
+  return bench_conversation_new (account, name);
+}
+
+PurpleConvIm *
+purple_conversation_get_im_data (const PurpleConversation *conv) {
+  return conv->u.im;
+}
+
+PurpleConversation *
+purple_conv_im_get_conversation (const PurpleConvIm *im) {
+  return im->conv;
+}
+
+PurpleAccount *
+purple_conversation_get_account (const PurpleConversation *conv) {
+  return conv->account;
+}
+
+const char *
+purple_conversation_get_name (const PurpleConversation *conv) {
+  return conv->name;
+}
+
+void
+purple_conv_im_send (PurpleConvIm *im, const char *message) {
+  bench_reply (im, message);
+}
+
+/**
+ * Every sender is a buddy; the benchmark is not about rejecting strangers.
+ */
+PurpleBuddy *
+purple_find_buddy (PurpleAccount *account, const char *name) {
+  if (NULL == buddy) {
+    buddy = g_malloc0 (sizeof (PurpleBuddy));
+  }
+  return buddy;
+}
+
+const char *
+purple_normalize (const PurpleAccount *account, const char *str) {
+  return str;
+}
@@ -0,0 +1,257 @@
+/***
+ * tokenize.c
+ * Microbenchmark and fuzzer for the argument tokenizer.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bench.h"
+#include "tokenize.h"
+
+/* Longest message the fuzzer makes up. */
+#define FUZZ_MAX_LENGTH 256
+
+/* Messages the way they arrive: plain XMPP bodies come escaped, Bonjour
+ * wraps everything in <font>, XHTML-IM has real markup. */
+static const gchar *corpus[] = {
+  "fast hello",
+  "weather &quot;New York&quot; --units metric",
+  "<font>uptime</font>",
+  "<body><p>grep -i &apos;needle in&apos; haystack.txt</p></body>",
+  "echo a&lt;b c&amp;d  e   f\tg",
+  NULL
+};
+
+static GRegex *font_regex;
+
+/**
+ * What valet did before it had a tokenizer: strip Bonjour's <font> with one
+ * regex and split on another. Returns the number of arguments.
+ */
+static guint
+tokenize_regex (const gchar *message) {
+  GMatchInfo *match_info;
+  gchar *text = NULL, **args;
+  guint argc;
+
+  if (g_str_has_prefix (message, "<font>")) {
+    if (g_regex_match (font_regex, message, 0, &match_info)) {
+      text = g_match_info_fetch (match_info, 1);
+    }
+    g_match_info_free (match_info);
+  }
+  if (NULL == text) {
+    text = g_strdup (message);
+  }
+
+  args = g_regex_split_simple ("[\\s+]", text, 0, 0);
+  argc = g_strv_length (args);
+  g_strfreev (args);
+  g_free (text);
+  return argc;
+}
+
+static guint
+tokenize_arena (const gchar *message) {
+  Arena *arena;
+  gsize length;
+  guint argc;
+
+  length = strlen (message);
+  arena = valet_arena_new (2 * length + 256);
+  argc = g_strv_length
+    (valet_tokenize (arena, message, length, VALET_TOKENIZE_MARKUP, NULL));
+  valet_arena_free (arena);
+  return argc;
+}
+
+static gdouble
+time_per_message (guint (*tokenize) (const gchar *),
+                  const gchar **messages,
+                  guint iterations) {
+  volatile guint argc = 0;
+  guint i, n;
+  gint64 start;
+
+  n = g_strv_length ((gchar **) messages);
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++) {
+    argc += tokenize (messages[i % n]);
+  }
+  return (g_get_monotonic_time () - start) * 1000.0 / MAX (iterations, 1);
+}
+
+/**
+ * Time both tokenizers over a small corpus plus one large paste, and print
+ * nanoseconds per message.
+ */
+void
+bench_tokenizer (guint iterations) {
+  const gchar *paste[2] = { NULL, NULL };
+  GString *large;
+  gdouble before, after;
+
+  font_regex = g_regex_new
+    ("^<font>(.*)</font>", G_REGEX_OPTIMIZE | G_REGEX_DOTALL, 0, NULL);
+  before = time_per_message (tokenize_regex, corpus, iterations);
+  after = time_per_message (tokenize_arena, corpus, iterations);
+  printf ("tokenizer (corpus):  regex %.0f ns  arena %.0f ns  (%.1fx)\n",
+          before, after, before / after);
+
+  large = g_string_new ("paste");
+  while (large->len < 64 * 1024) {
+    g_string_append (large, " lorem ipsum dolor sit amet");
+  }
+  paste[0] = large->str;
+  iterations = MAX (iterations / 1000, 1);
+  before = time_per_message (tokenize_regex, paste, iterations);
+  after = time_per_message (tokenize_arena, paste, iterations);
+  printf ("tokenizer (64KiB):   regex %.0f ns  arena %.0f ns  (%.1fx)\n",
+          before, after, before / after);
+  g_string_free (large, TRUE);
+  g_regex_unref (font_regex);
+}
+
+/**
+ * Quote every argument so that a shell, or the tokenizer, reads it back
+ * unchanged.
+ */
+static gchar *
+quote_all (gchar **args) {
+  GString *quoted;
+  gchar **arg, *p;
+
+  quoted = g_string_new (NULL);
+  for (arg = args; NULL != *arg; arg++) {
+    g_string_append (quoted, 0 == quoted->len ? "'" : " '");
+    for (p = *arg; '\0' != *p; p++) {
+      if ('\'' == *p) {
+        g_string_append (quoted, "'\\''");
+      }
+      else {
+        g_string_append_c (quoted, *p);
+      }
+    }
+    g_string_append_c (quoted, '\'');
+  }
+  return g_string_free (quoted, FALSE);
+}
+
+static gboolean
+same_args (gchar **a, gchar **b) {
+  for (; NULL != *a && NULL != *b; a++, b++) {
+    if (0 != strcmp (*a, *b)) {
+      return FALSE;
+    }
+  }
+  return NULL == *a && NULL == *b;
+}
+
+/**
+ * Make up a message out of the characters the tokenizer cares about, some
+ * markup and the odd arbitrary byte.
+ */
+static gsize
+fuzz_message (GRand *dice, gchar *message) {
+  static const gchar *pieces[] = {
+    " ", "  ", "\t", "\n", "\r\n", "'", "\"", "\\", "<", ">", "&", ";",
+    "a", "bc", "<<", "<br>", "<BR/>", "</p>", "<div>", "<font>", "</font>",
+    "&lt;", "&amp;", "&quot;", "&apos;", "&nbsp;", "&#65;", "&#x263A;",
+    "&#0;", "&#x110000;", "&# 5;", "&bogus;", "\xc3\xa9", NULL
+  };
+  const gchar *piece;
+  gsize length = 0, size;
+
+  while (length < FUZZ_MAX_LENGTH - 16 && g_rand_int_range (dice, 0, 24)) {
+    if (0 == g_rand_int_range (dice, 0, 16)) {
+      message[length++] = g_rand_int_range (dice, 0, 256);
+      continue;
+    }
+    piece = pieces[g_rand_int_range
+                   (dice, 0, g_strv_length ((gchar **) pieces))];
+    size = strlen (piece);
+    memcpy (message + length, piece, size);
+    length += size;
+  }
+  return length;
+}
+
+/**
+ * Tokenize `iterations` made-up messages, checking that:
+ * - nothing is written past the space reserved for it,
+ * - the first line and the rest add up to the message,
+ * - tokenizing markup equals tokenizing the text it strips to, and
+ * - quoting the arguments and tokenizing them again gives them back.
+ * Returns FALSE and prints the offending message otherwise.
+ */
+gboolean
+bench_fuzz (guint iterations, guint32 seed) {
+  GRand *dice;
+  Arena *arena;
+  gchar message[FUZZ_MAX_LENGTH], **markup_args, **text_args, **again;
+  gchar **first, *text, *quoted, *escaped;
+  const gchar *rest, *failure;
+  gsize length, used;
+  guint i;
+  gchar **arg;
+
+  dice = g_rand_new_with_seed (seed);
+  for (i = 0; i < iterations; i++) {
+    length = fuzz_message (dice, message);
+    arena = valet_arena_new (0);
+    failure = NULL;
+
+    markup_args = valet_tokenize
+      (arena, message, length, VALET_TOKENIZE_MARKUP, NULL);
+    used = 0;
+    for (arg = markup_args; NULL != *arg; arg++) {
+      used += strlen (*arg) + 1;
+    }
+    if (used > length + 1) {
+      failure = "arguments overflow their buffer";
+    }
+
+    first = valet_tokenize
+      (arena, message, length,
+       VALET_TOKENIZE_MARKUP | VALET_TOKENIZE_FIRST_LINE, &rest);
+    if (NULL == failure && NULL != rest
+        && (rest <= message || rest > message + length)) {
+      failure = "rest of message out of bounds";
+    }
+    if (NULL == failure && NULL == rest && !same_args (first, markup_args)) {
+      failure = "single line splits differently";
+    }
+
+    text = valet_markup_strip (message, length);
+    text_args = valet_tokenize (arena, text, strlen (text), 0, NULL);
+    if (NULL == failure && !same_args (markup_args, text_args)) {
+      failure = "markup and stripped text split differently";
+    }
+
+    quoted = quote_all (text_args);
+    again = valet_tokenize (arena, quoted, strlen (quoted), 0, NULL);
+    if (NULL == failure && !same_args (text_args, again)) {
+      failure = "quoted arguments do not survive";
+    }
+
+    if (NULL != failure) {
+      escaped = g_strescape (text, NULL);
+      g_printerr ("fuzz: %s (seed %u, case %u)\n  text: \"%s\"\n",
+                  failure, seed, i, escaped);
+      g_free (escaped);
+    }
+    g_free (quoted);
+    g_free (text);
+    valet_arena_free (arena);
+    if (NULL != failure) {
+      g_rand_free (dice);
+      return FALSE;
+    }
+  }
+
+  printf ("fuzz: %u messages tokenized cleanly (seed %u)\n",
+          iterations, seed);
+  g_rand_free (dice);
+  return TRUE;
+}
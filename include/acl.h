@@ -0,0 +1,29 @@
+#ifndef __VALET_ACL_H
+#define __VALET_ACL_H
+
+#include <glib.h>
+
+typedef enum {
+  VALET_ACL_ALLOW,
+  VALET_ACL_DENY, /* The sender may run something, but not this */
+  VALET_ACL_UNKNOWN /* The sender is in no group at all */
+} ValetAclResult;
+
+/**
+ * An Acl says which commands and builtins each JID may run. It is loaded
+ * from [acl.<group>] groups, each listing its members and what they may
+ * run, and flattened into one table keyed by JID so that checking a
+ * message costs two hash lookups however many groups there are.
+ */
+typedef struct _Acl Acl;
+
+Acl *
+valet_acl_load (GKeyFile *);
+
+void
+valet_acl_free (Acl *);
+
+ValetAclResult
+valet_acl_check (Acl *, const gchar *, const gchar *, gsize);
+
+#endif /* __VALET_ACL_H */
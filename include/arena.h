@@ -0,0 +1,28 @@
+#ifndef __VALET_ARENA_H
+#define __VALET_ARENA_H
+
+#include <glib.h>
+
+/**
+ * An Arena hands out memory from a few large blocks and gives it all back
+ * at once, so that everything belonging to one command costs a handful of
+ * allocations and a single free.
+ */
+typedef struct _Arena Arena;
+
+Arena *
+valet_arena_new (gsize);
+
+void
+valet_arena_free (Arena *);
+
+gpointer
+valet_arena_alloc (Arena *, gsize);
+
+gchar *
+valet_arena_strndup (Arena *, const gchar *, gsize);
+
+gchar *
+valet_arena_strdup (Arena *, const gchar *);
+
+#endif /* __VALET_ARENA_H */
@@ -0,0 +1,34 @@
+#ifndef __VALET_CACHE_H
+#define __VALET_CACHE_H
+
+#include <glib.h>
+
+/**
+ * A Cache maps strings to strings, with an optional time-to-live per entry
+ * and a bound on the number of entries. When full, the least recently used
+ * entry is evicted.
+ */
+typedef struct _Cache Cache;
+
+Cache *
+valet_cache_new (guint);
+
+void
+valet_cache_free (Cache *);
+
+const gchar *
+valet_cache_lookup (Cache *, const gchar *);
+
+void
+valet_cache_insert (Cache *, const gchar *, const gchar *, guint);
+
+void
+valet_cache_remove (Cache *, const gchar *);
+
+void
+valet_cache_clear (Cache *);
+
+guint
+valet_cache_size (Cache *);
+
+#endif /* __VALET_CACHE_H */
@@ -18,4 +18,7 @@
 void
 initialize_libpurple (Context *);
 
+void
+valet_chat_set_credentials (Context *, const gchar *, const gchar *);
+
 #endif /* __VALET_CHAT_H */
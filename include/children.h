@@ -0,0 +1,40 @@
+#ifndef __VALET_CHILDREN_H
+#define __VALET_CHILDREN_H
+
+#include <glib.h>
+
+typedef void (*ValetExitFunc) (GPid, gint, gpointer);
+
+/**
+ * Valet keeps track of every command process it starts. Where the kernel
+ * has pidfds, each process we are the parent of is watched through its own
+ * pidfd as a main loop source and reaped as soon as it exits, so there is
+ * no SIGCHLD handler and nothing for libpurple's helpers to trip over.
+ * Signals go through the pidfd too, so they cannot reach a process that has
+ * taken over a recycled pid.
+ *
+ * Processes the zygote started are tracked the same way, except that the
+ * zygote reaps them and reports how they exited.
+ */
+void
+valet_children_start (void);
+
+void
+valet_child_track (GPid, gboolean);
+
+void
+valet_child_watch (GPid, ValetExitFunc, gpointer);
+
+void
+valet_child_exited (GPid, gint);
+
+void
+valet_child_kill (GPid, gint);
+
+void
+valet_children_lost (gint);
+
+guint
+valet_children_count (void);
+
+#endif /* __VALET_CHILDREN_H */
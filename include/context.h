@@ -7,6 +7,9 @@
 
 #include <gmodule.h>
 
+#include "executor.h"
+#include "resources.h"
+
 /**
  * A Context is essentially global data for the program.
  *
@@ -23,13 +26,87 @@ typedef struct {
   char *purple_data; /* Path to store purple account data */
   char *lurch_path; /* Location of the lurch.so file */
   char *commands_path; /* Path where commands are located */
+  char *plugins_path; /* Directory of shared-object commands, if any */
+  guint plugin_threads; /* Plugin invocations allowed to run at once */
+  ValetExecutorMode executor; /* How command processes are started */
   gboolean bonjour_enabled;
-  GHashTable *kvstore;
-  redisAsyncContext *redisCtx;
+  guint workers; /* Worker processes to supervise; 1 runs just one valet */
+  guint heartbeat_interval; /* Seconds between worker heartbeats */
+  gint worker; /* Which worker this is, or -1 if not one */
+  gsize output_max_bytes; /* Largest message built from command output */
+  guint output_flush_ms; /* How long output may wait to be batched */
+  gsize output_cap_bytes; /* Output kept from one command */
+  gsize read_buffer_bytes; /* Per stream; longer lines are split */
+  gdouble outbox_rate; /* Messages per second to one conversation */
+  guint outbox_burst;
+  gdouble outbox_account_rate; /* Messages per second from one account */
+  guint outbox_account_burst;
+  guint outbox_max_queued; /* Messages waiting for one conversation */
+  guint max_running; /* Commands allowed to run at once */
+  guint max_per_sender; /* Commands one sender may run at once */
+  guint max_sessions; /* Sessions allowed to be open at once */
+  guint session_idle_timeout; /* Seconds before an unused session closes */
+  gsize session_max_input; /* Bytes a session may leave unread */
+  guint cache_max_entries; /* Results kept in the output cache */
+  gsize cache_max_entry_bytes; /* Larger results are not cached */
+  ValetLimits limits; /* Defaults for every command */
+  char *cgroup_path; /* Delegated cgroup v2 directory for commands, if any */
+  GHashTable *cache_ttls; /* Command name -> seconds its output stays fresh */
+  struct _Acl *acl; /* Who may run what, or NULL for every buddy anything */
+  struct _Cache *kvstore; /* Local copy of recently used redis keys */
+  guint kvstore_size;
+  gboolean kvstore_coherent; /* Whether redis is telling us about changes */
+  guint64 kvstore_generation; /* Bumped whenever a key may have changed */
+  char *redis_host;
+  int redis_port;
+  guint redis_max_pending; /* Commands held while redis is unreachable */
+  struct _Redis *redis;
+  char *store_path; /* Where the kvstore lives when there is no redis */
+  gsize store_compact_bytes; /* Log growth that triggers a new snapshot */
+  struct _Store *store;
+  char *metrics_socket; /* Unix socket serving metrics, if any */
+  int metrics_port; /* Loopback TCP port serving metrics, or 0 */
+  struct _Dispatcher *dispatcher; /* Routes messages to builtins */
+  struct _Scheduler *scheduler; /* Admits commands within the limits above */
+  struct _Cache *output_cache; /* Results of commands with a cache TTL */
+  GHashTable *in_flight; /* Argument vector -> Command, for shared runs */
+  struct _CommandIndex *commands; /* Executables found in commands_path */
+  struct _Plugins *plugins; /* Shared objects loaded from plugins_path */
+  struct _Sessions *sessions; /* Long-lived commands, one per conversation */
+  gchar **remote_commands; /* Run by valet-worker; "*" for any unknown */
+  char *remote_prefix; /* What the job queue's redis keys start with */
+  struct _Remote *remote; /* Hands jobs to valet-worker processes */
 } Context;
 
+/**
+ * How a kvstore request went. A store that cannot be reached is not the
+ * same as a key that is not set, and users are told which it was.
+ */
+typedef enum {
+  VALET_KV_OK,
+  VALET_KV_NONE, /* No kvstore is configured */
+  VALET_KV_UNREACHABLE /* The request was dropped, failed or went unanswered */
+} ValetKvStatus;
+
+/**
+ * Receives a value from the kvstore (NULL if the key is not set, or if the
+ * status is not VALET_KV_OK).
+ */
+typedef void (*ValetValueFunc) (const gchar *, const gchar *, ValetKvStatus,
+                                gpointer);
+
+/**
+ * Receives a batch of key names, and whether it is the last batch.
+ */
+typedef void (*ValetKeysFunc) (const gchar **, gboolean, gpointer);
+
 Context *get_context (char *, GError **);
-gboolean valet_set_key (Context *, const gchar *, const gchar *);
-gboolean valet_get_key (Context *, const gchar *, gpointer);
+void valet_context_reload (Context *, Context *);
+void valet_kvstore_connect (Context *);
+ValetKvStatus valet_set_key (Context *, const gchar *, const gchar *);
+ValetKvStatus valet_set_keys (Context *, gchar **);
+gboolean valet_get_key (Context *, const gchar *, ValetValueFunc, gpointer);
+gboolean valet_get_keys (Context *, gchar **, ValetValueFunc, gpointer);
+gboolean valet_scan_keys (Context *, const gchar *, ValetKeysFunc, gpointer);
 
 #endif /* __VALET_CONTEXT_H */
@@ -7,5 +7,55 @@
 #define PLUGIN_SAVE_PREF       "/purple/valet/plugins/saved"
 #define UI_ID                  "valet"
 
+/* Output batching, overridable in the [valet] group */
+#define DEFAULT_OUTPUT_MAX_BYTES 4096
+#define DEFAULT_OUTPUT_FLUSH_MS  250
+#define DEFAULT_OUTPUT_CAP_BYTES (1 << 20)
+#define DEFAULT_READ_BUFFER_BYTES 4096
+
+/* Admission control, overridable in the [valet] group */
+#define DEFAULT_MAX_RUNNING      32
+#define DEFAULT_MAX_PER_SENDER   4
+#define DEFAULT_PLUGIN_THREADS   4
+
+/* Interactive sessions, overridable in the [session] group */
+#define DEFAULT_MAX_SESSIONS         8
+#define DEFAULT_SESSION_IDLE_TIMEOUT 600
+#define DEFAULT_SESSION_MAX_INPUT    65536
+
+/* Outgoing message budgets, overridable in the [outbox] group */
+#define DEFAULT_OUTBOX_RATE           1.0
+#define DEFAULT_OUTBOX_BURST          5
+#define DEFAULT_OUTBOX_ACCOUNT_RATE   5.0
+#define DEFAULT_OUTBOX_ACCOUNT_BURST  20
+#define DEFAULT_OUTBOX_MAX_QUEUED     200
+
+/* Supervisor mode, overridable in the [supervisor] group */
+#define DEFAULT_HEARTBEAT_INTERVAL 5
+
+/* Command limits, overridable in the [limits] group and in sidecars */
+#define DEFAULT_COMMAND_TIMEOUT  60
+#define DEFAULT_KILL_GRACE       5
+
+/* Command output cache, overridable in the [cache] group */
+#define DEFAULT_CACHE_MAX_ENTRIES     256
+#define DEFAULT_CACHE_MAX_ENTRY_BYTES 65536
+
+/* Keys kept in front of redis, overridable in the [redis] group */
+#define DEFAULT_KVSTORE_LOCAL_CACHE   1024
+#define DEFAULT_REDIS_MAX_PENDING     1024
+
+/* Remote workers, overridable in the [remote] group */
+#define DEFAULT_REMOTE_PREFIX      "valet"
+#define DEFAULT_REMOTE_CONCURRENCY 4
+#define DEFAULT_REMOTE_HEARTBEAT   5
+
+/* Embedded kvstore used without redis, overridable in the [store] group */
+#define DEFAULT_STORE_PATH            "kvstore"
+#define DEFAULT_STORE_COMPACT_BYTES   (1 << 20)
+
+/* Keys requested per SCAN round trip when listing the kvstore */
+#define SCAN_BATCH_SIZE "500"
+
 
 #endif /* __VALET_DEFINES_H */
@@ -0,0 +1,39 @@
+#ifndef __VALET_DISPATCH_H
+#define __VALET_DISPATCH_H
+
+#include "purple.h"
+#include <glib.h>
+
+#include "context.h"
+
+/**
+ * A builtin is a command handled inside valet rather than by spawning an
+ * executable. It receives the match of its (precompiled) pattern against the
+ * incoming message.
+ */
+typedef void (*ValetBuiltinFunc) (Context *, PurpleConvIm *, GMatchInfo *);
+
+/**
+ * The Dispatcher routes a message to a builtin in one hash lookup keyed on the
+ * message's first token. Every pattern is compiled once, at registration.
+ */
+typedef struct _Dispatcher Dispatcher;
+
+Dispatcher *
+valet_dispatcher_new (void);
+
+void
+valet_dispatcher_free (Dispatcher *);
+
+gboolean
+valet_dispatcher_register (Dispatcher *, const gchar *, const gchar *,
+                           const gchar *, ValetBuiltinFunc, GError **);
+
+gboolean
+valet_dispatcher_command (Dispatcher *, const gchar *, const gchar **,
+                          gsize *);
+
+gboolean
+valet_dispatch (Dispatcher *, Context *, PurpleConvIm *, const gchar *);
+
+#endif /* __VALET_DISPATCH_H */
@@ -0,0 +1,28 @@
+#ifndef __VALET_EXECUTOR_H
+#define __VALET_EXECUTOR_H
+
+#include <glib.h>
+
+#include "resources.h"
+#include "children.h"
+
+/**
+ * How command processes are started.
+ *
+ * SPAWN forks valet itself for every command. ZYGOTE hands the work to a small
+ * helper forked before libpurple is loaded, so each spawn only has to copy
+ * the helper's address space rather than the whole bot's.
+ */
+typedef enum {
+  VALET_EXECUTOR_SPAWN,
+  VALET_EXECUTOR_ZYGOTE
+} ValetExecutorMode;
+
+gboolean
+valet_executor_start (ValetExecutorMode);
+
+gboolean
+valet_executor_spawn (const gchar *, gchar **, const ValetLimits *,
+                      const gchar *, GPid *, gint *, gint *, gint *, GError **);
+
+#endif /* __VALET_EXECUTOR_H */
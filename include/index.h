@@ -0,0 +1,37 @@
+#ifndef __VALET_INDEX_H
+#define __VALET_INDEX_H
+
+#include <glib.h>
+
+#include "resources.h"
+
+/**
+ * An executable in the commands directory, along with anything its sidecar
+ * file (`<name>.meta`, a key file with a [command] group) says about it.
+ */
+typedef struct {
+  gchar *name;
+  gchar *path; /* Absolute path handed to the executor */
+  guint cache_ttl; /* Seconds its output may be reused, 0 if not cacheable */
+  ValetLimits limits; /* Overrides for the [limits] defaults */
+  gboolean takes_input; /* Lines after the first go to stdin, not argv */
+  gboolean dedup; /* Identical requests may share one run and its output */
+} CommandEntry;
+
+/**
+ * The CommandIndex is an in-memory view of the commands directory. It is
+ * built once at startup and kept current with inotify where available, so
+ * unknown commands can be turned away without forking.
+ */
+typedef struct _CommandIndex CommandIndex;
+
+CommandIndex *
+valet_index_new (const gchar *);
+
+void
+valet_index_free (CommandIndex *);
+
+const CommandEntry *
+valet_index_lookup (CommandIndex *, const gchar *);
+
+#endif /* __VALET_INDEX_H */
@@ -0,0 +1,53 @@
+#ifndef __VALET_METRICS_H
+#define __VALET_METRICS_H
+
+#include <glib.h>
+
+/**
+ * Per-command distributions. Durations are recorded in microseconds and
+ * exported in seconds; sizes are recorded and exported as they are.
+ */
+typedef enum {
+  VALET_HISTOGRAM_REPLY_LATENCY, /* Message received to first reply */
+  VALET_HISTOGRAM_SPAWN_LATENCY, /* Time taken to start the process */
+  VALET_HISTOGRAM_RUNTIME, /* Process start to exit */
+  VALET_HISTOGRAM_OUTPUT_BYTES,
+  VALET_HISTOGRAM_OUTPUT_LINES,
+  VALET_N_HISTOGRAMS
+} ValetHistogram;
+
+typedef enum {
+  VALET_COUNTER_MESSAGES_RECEIVED,
+  VALET_COUNTER_MESSAGES_SENT,
+  VALET_COUNTER_COMMANDS_KILLED,
+  VALET_COUNTER_WORKER_RESTARTS,
+  VALET_COUNTER_MESSAGES_DENIED,
+  VALET_COUNTER_COMMANDS_SHARED,
+  VALET_COUNTER_OUTBOX_DROPPED,
+  VALET_N_COUNTERS
+} ValetCounter;
+
+/**
+ * Reads the current value of a gauge when the metrics are scraped.
+ */
+typedef gdouble (*ValetGaugeFunc) (gpointer);
+
+void
+valet_metrics_observe (const gchar *, ValetHistogram, guint64);
+
+void
+valet_metrics_exit (const gchar *, gint);
+
+void
+valet_metrics_count (ValetCounter);
+
+void
+valet_metrics_gauge (const gchar *, const gchar *, ValetGaugeFunc, gpointer);
+
+gchar *
+valet_metrics_render (void);
+
+gboolean
+valet_metrics_listen (const gchar *, gint, GError **);
+
+#endif /* __VALET_METRICS_H */
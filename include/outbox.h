@@ -0,0 +1,46 @@
+#ifndef __VALET_OUTBOX_H
+#define __VALET_OUTBOX_H
+
+#include "purple.h"
+#include <glib.h>
+
+/**
+ * Replies to the user, eg from builtins, go ahead of bulk command output.
+ */
+typedef enum {
+  VALET_SEND_INTERACTIVE,
+  VALET_SEND_BULK
+} ValetSendPriority;
+
+/**
+ * The outbox sits between valet and libpurple. Each account and each
+ * conversation has a token bucket (a sustained rate in messages per second
+ * and a burst size); a message leaves only when both buckets allow it.
+ * Conversations with waiting messages are served round-robin, interactive
+ * messages first, so one chatty command cannot hold up everyone else.
+ * Each conversation's queue is capped; past the cap, bulk messages go
+ * first. Whatever holds on to a conversation for later sends registers
+ * with valet_outbox_hold, and is cleared when libpurple frees it.
+ */
+void
+valet_outbox_start (gdouble, guint, gdouble, guint, guint);
+
+void
+valet_send (PurpleConvIm *, const gchar *, ValetSendPriority);
+
+void
+valet_outbox_hold (PurpleConvIm **);
+
+void
+valet_outbox_release (PurpleConvIm **);
+
+void
+valet_outbox_forget (PurpleConvIm *);
+
+guint
+valet_outbox_queued (void);
+
+gchar *
+valet_outbox_describe (void);
+
+#endif /* __VALET_OUTBOX_H */
@@ -0,0 +1,35 @@
+#ifndef __VALET_OUTPUT_H
+#define __VALET_OUTPUT_H
+
+#include "purple.h"
+#include <glib.h>
+
+#include "outbox.h"
+
+/**
+ * An OutputBuffer coalesces the lines a command prints into as few messages
+ * as possible. Lines are sent in the order they are appended; the buffer is
+ * flushed when it would exceed its size limit, when its time window closes,
+ * or when it is freed.
+ */
+typedef struct _OutputBuffer OutputBuffer;
+
+OutputBuffer *
+valet_output_new (PurpleConvIm *, gsize, guint);
+
+void
+valet_output_append (OutputBuffer *, const gchar *, gsize);
+
+void
+valet_output_flush (OutputBuffer *);
+
+void
+valet_output_set_priority (OutputBuffer *, ValetSendPriority);
+
+gint64
+valet_output_first_sent (OutputBuffer *);
+
+void
+valet_output_free (OutputBuffer *);
+
+#endif /* __VALET_OUTPUT_H */
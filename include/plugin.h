@@ -0,0 +1,43 @@
+#ifndef __VALET_PLUGIN_H
+#define __VALET_PLUGIN_H
+
+#include <glib.h>
+
+/**
+ * The interface between valet and in-process commands.
+ *
+ * A plugin is a shared object in the plugins directory which exports a
+ * ValetPlugin named `valet_plugin`. It is built against this header alone,
+ * eg:
+ *
+ *   gcc -shared -fPIC $(pkg-config --cflags glib-2.0) -I include \
+ *     -o echo.so echo.c
+ *
+ * `handle` runs on valet's worker threads, possibly several times at once,
+ * so it must be thread safe. It gets the command's arguments (the command
+ * name first, as for executables), its input or NULL, and a function to
+ * write output lines with, which may be called from the worker thread. It
+ * returns what would be the exit code of an executable. Unlike executables,
+ * plugins cannot be stopped once started, so they should not block for long.
+ *
+ * `init` (optional) is called once when the plugin is loaded; returning
+ * FALSE keeps the plugin from being used. `shutdown` (optional) is called
+ * once valet no longer needs it.
+ */
+
+/* Bumped whenever ValetPlugin or the functions it takes change */
+#define VALET_PLUGIN_ABI 1
+
+#define VALET_PLUGIN_SYMBOL "valet_plugin"
+
+typedef void (*ValetPluginWriteFunc) (const gchar *, gsize, gpointer);
+
+typedef struct {
+  guint abi; /* Always VALET_PLUGIN_ABI */
+  const gchar *name; /* What users type to run it */
+  gboolean (*init) (GError **);
+  gint (*handle) (gchar **, const gchar *, ValetPluginWriteFunc, gpointer);
+  void (*shutdown) (void);
+} ValetPlugin;
+
+#endif /* __VALET_PLUGIN_H */
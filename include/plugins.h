@@ -0,0 +1,34 @@
+#ifndef __VALET_PLUGINS_H
+#define __VALET_PLUGINS_H
+
+#include <glib.h>
+
+#include "plugin.h"
+#include "reader.h"
+
+/**
+ * Called on the main loop once a plugin has returned, with its exit code.
+ */
+typedef void (*ValetPluginDoneFunc) (gint, gpointer);
+
+/**
+ * Plugins are the loaded shared-object commands, and the bounded pool of
+ * threads that runs them. Whatever a plugin writes is handed back to the
+ * main loop, so callers only ever see output from there.
+ */
+typedef struct _Plugins Plugins;
+
+Plugins *
+valet_plugins_new (const gchar *, guint);
+
+void
+valet_plugins_free (Plugins *);
+
+const ValetPlugin *
+valet_plugins_lookup (Plugins *, const gchar *);
+
+void
+valet_plugins_run (Plugins *, const ValetPlugin *, gchar **, gchar *, gsize,
+                   ValetLineFunc, ValetPluginDoneFunc, gpointer);
+
+#endif /* __VALET_PLUGINS_H */
@@ -0,0 +1,31 @@
+#ifndef __VALET_READER_H
+#define __VALET_READER_H
+
+#include <glib.h>
+
+/**
+ * Receives one line, without its line terminator. The line is not
+ * NUL-terminated and is only valid during the call.
+ */
+typedef void (*ValetLineFunc) (const gchar *, gsize, gpointer);
+
+typedef void (*ValetEofFunc) (gpointer);
+
+/**
+ * A LineReader splits what a child writes to a pipe into lines, using one
+ * buffer allocated up front. Lines longer than the buffer are delivered in
+ * buffer-sized pieces, so a reader never holds more than its capacity no
+ * matter what the child writes.
+ */
+typedef struct _LineReader LineReader;
+
+LineReader *
+valet_reader_new (gint, gsize, ValetLineFunc, ValetEofFunc, gpointer);
+
+void
+valet_reader_close (LineReader *);
+
+void
+valet_reader_free (LineReader *);
+
+#endif /* __VALET_READER_H */
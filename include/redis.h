@@ -0,0 +1,54 @@
+#ifndef __VALET_REDIS_H
+#define __VALET_REDIS_H
+
+#include <hiredis.h>
+#include <async.h>
+#include <glib.h>
+
+/**
+ * Called with the reply to a command, or with NULL if the command failed
+ * because the connection went away.
+ */
+typedef void (*ValetRedisFunc) (redisReply *, gpointer);
+
+/**
+ * Redis is valet's connection to a redis server: one connection for commands
+ * and one for subscriptions, both driven by the GLib main loop.
+ *
+ * Commands are binary safe (every argument is sent with its length) and are
+ * pipelined: everything queued during one main loop iteration is handed to
+ * hiredis together and leaves in a single write.
+ *
+ * Lost connections are retried with jittered exponential backoff. Meanwhile
+ * commands wait in a bounded queue, and subscriptions are renewed once the
+ * server is back.
+ */
+typedef struct _Redis Redis;
+
+Redis *
+valet_redis_new (const gchar *, gint, guint);
+
+void
+valet_redis_retarget (Redis *, const gchar *, gint);
+
+gboolean
+valet_redis_command_argv (Redis *, ValetRedisFunc, gpointer,
+                          gint, const gchar **, const gsize *);
+
+gboolean
+valet_redis_command (Redis *, ValetRedisFunc, gpointer, ...)
+  G_GNUC_NULL_TERMINATED;
+
+void
+valet_redis_psubscribe (Redis *, const gchar *, ValetRedisFunc, gpointer);
+
+gboolean
+valet_redis_connected (Redis *);
+
+guint
+valet_redis_queued (Redis *);
+
+guint
+valet_redis_in_flight (Redis *);
+
+#endif /* __VALET_REDIS_H */
@@ -0,0 +1,62 @@
+#ifndef __VALET_REMOTE_H
+#define __VALET_REMOTE_H
+
+#include <glib.h>
+
+#include "reader.h"
+#include "redis.h"
+
+/* Keys and channels, all below a configurable prefix */
+#define VALET_REMOTE_QUEUE      "%s:jobs"          /* List of waiting jobs */
+#define VALET_REMOTE_CHANNEL    "%s:job:%s"        /* Output of one job */
+#define VALET_REMOTE_WORKERS    "%s:workers"       /* Set of worker ids */
+#define VALET_REMOTE_PROCESSING "%s:worker:%s:jobs" /* Jobs a worker took */
+#define VALET_REMOTE_ALIVE      "%s:worker:%s:alive" /* Expiring heartbeat */
+
+/* The first byte of every message on a job's channel says what it is. */
+#define VALET_REMOTE_STARTED 's' /* A worker took the job; then its id */
+#define VALET_REMOTE_LINE    'o' /* One line of output */
+#define VALET_REMOTE_EXIT    'x' /* The wait status, in decimal; the end */
+
+/**
+ * Called once a remote job is over, with a wait status.
+ */
+typedef void (*ValetRemoteDoneFunc) (gint, gpointer);
+
+/**
+ * Remote hands commands to valet-worker processes on other machines. Each
+ * job is pushed onto a redis list; a worker moves it to a list of its own
+ * while it runs, so that the job can be put back if the worker stops
+ * sending heartbeats, and publishes the output on the job's channel. One
+ * pattern subscription covers the channels of every job.
+ */
+typedef struct _Remote Remote;
+typedef struct _RemoteJob RemoteJob;
+
+Remote *
+valet_remote_new (Redis *, const gchar *, gchar **);
+
+void
+valet_remote_set_commands (Remote *, gchar **);
+
+gboolean
+valet_remote_wants (Remote *, const gchar *, gboolean);
+
+RemoteJob *
+valet_remote_run (Remote *, gchar **, const gchar *, guint64,
+                  ValetLineFunc, ValetRemoteDoneFunc, gpointer);
+
+void
+valet_remote_cancel (Remote *, RemoteJob *);
+
+guint
+valet_remote_jobs (Remote *);
+
+gchar *
+valet_remote_job_encode (const gchar *, gint64, const gchar *, gchar **,
+                         gsize *);
+
+gchar **
+valet_remote_job_decode (const gchar *, gsize, gchar **, gint64 *, gchar **);
+
+#endif /* __VALET_REMOTE_H */
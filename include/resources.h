@@ -0,0 +1,44 @@
+#ifndef __VALET_RESOURCES_H
+#define __VALET_RESOURCES_H
+
+#include <glib.h>
+
+/**
+ * What a command may use. 0 means unlimited, both in the [limits] group and
+ * in a command's sidecar; a limit the sidecar leaves out is
+ * VALET_LIMIT_INHERIT, so the one in [limits] applies.
+ */
+typedef struct {
+  guint64 timeout; /* Wall-clock seconds before SIGTERM */
+  guint64 kill_grace; /* Seconds between SIGTERM and SIGKILL */
+  guint64 cpu; /* RLIMIT_CPU, seconds */
+  guint64 address_space; /* RLIMIT_AS, bytes */
+  guint64 nofile; /* RLIMIT_NOFILE */
+  guint64 memory_max; /* cgroup memory.max, bytes */
+  guint64 cpu_max; /* cgroup cpu.max, percent of one CPU */
+} ValetLimits;
+
+#define VALET_LIMIT_INHERIT G_MAXUINT64
+
+void
+valet_limits_inherit (ValetLimits *);
+
+void
+valet_limits_load (ValetLimits *, GKeyFile *, const gchar *);
+
+void
+valet_limits_merge (ValetLimits *, const ValetLimits *);
+
+void
+valet_limits_apply (const ValetLimits *);
+
+gchar *
+valet_cgroup_new (const gchar *, const ValetLimits *, GError **);
+
+void
+valet_cgroup_kill (const gchar *);
+
+void
+valet_cgroup_free (gchar *);
+
+#endif /* __VALET_RESOURCES_H */
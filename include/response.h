@@ -5,6 +5,11 @@
 #include "purple.h"
 #include <glib.h>
 
+#include "context.h"
+
+void
+initialize_responses (Context *);
+
 void
 received_im(PurpleAccount *, char *, char *, PurpleConversation *,
             PurpleMessageFlags, void *);
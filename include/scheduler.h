@@ -0,0 +1,38 @@
+#ifndef __VALET_SCHEDULER_H
+#define __VALET_SCHEDULER_H
+
+#include <glib.h>
+
+/**
+ * Start a queued item. Returns FALSE if it could not be started, in which
+ * case its slot is given back immediately. Either way the item now belongs
+ * to the callee.
+ */
+typedef gboolean (*ValetRunFunc) (gpointer, gpointer);
+
+/**
+ * The Scheduler limits how many commands run at once, both overall and per
+ * sender. Work beyond those limits waits in per-sender queues which are
+ * drained round-robin, so one busy sender cannot starve the others.
+ */
+typedef struct _Scheduler Scheduler;
+
+Scheduler *
+valet_scheduler_new (guint, guint, ValetRunFunc, gpointer);
+
+void
+valet_scheduler_free (Scheduler *);
+
+guint
+valet_scheduler_submit (Scheduler *, const gchar *, gpointer);
+
+void
+valet_scheduler_release (Scheduler *, const gchar *);
+
+guint
+valet_scheduler_running (Scheduler *);
+
+guint
+valet_scheduler_queued (Scheduler *);
+
+#endif /* __VALET_SCHEDULER_H */
@@ -0,0 +1,39 @@
+#ifndef __VALET_SESSION_H
+#define __VALET_SESSION_H
+
+#include "purple.h"
+#include <glib.h>
+
+#include "context.h"
+
+/**
+ * Sessions keep one long-lived command per conversation. Every message sent
+ * there while the session is open becomes a line on the command's stdin,
+ * and whatever it prints is sent back as it comes. A session ends when the
+ * command exits, when it is closed, or after sitting idle for too long.
+ */
+typedef struct _Sessions Sessions;
+
+Sessions *
+valet_sessions_new (Context *, guint, guint);
+
+gboolean
+valet_session_open (Sessions *, PurpleConvIm *, const gchar *, gchar **,
+                    const ValetLimits *, GError **);
+
+gboolean
+valet_session_exists (Sessions *, PurpleConvIm *);
+
+gboolean
+valet_session_send (Sessions *, PurpleConvIm *, const gchar *);
+
+gboolean
+valet_session_close (Sessions *, PurpleConvIm *);
+
+gboolean
+valet_sessions_full (Sessions *);
+
+guint
+valet_sessions_count (Sessions *);
+
+#endif /* __VALET_SESSION_H */
@@ -0,0 +1,33 @@
+#ifndef __VALET_STORE_H
+#define __VALET_STORE_H
+
+#include <glib.h>
+
+/**
+ * A Store is a small persistent key-value store kept in a directory: a
+ * snapshot of every key plus an append-only log of changes made since. All
+ * of it is held in memory; the log is folded into a new snapshot once it
+ * outgrows the snapshot, so opening a store reads at most about twice the
+ * live data.
+ */
+typedef struct _Store Store;
+
+Store *
+valet_store_open (const gchar *, gsize, GError **);
+
+void
+valet_store_close (Store *);
+
+gboolean
+valet_store_set (Store *, const gchar *, const gchar *);
+
+const gchar *
+valet_store_get (Store *, const gchar *);
+
+const gchar **
+valet_store_keys (Store *, const gchar *);
+
+gboolean
+valet_store_compact (Store *, GError **);
+
+#endif /* __VALET_STORE_H */
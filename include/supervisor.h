@@ -0,0 +1,29 @@
+#ifndef __VALET_SUPERVISOR_H
+#define __VALET_SUPERVISOR_H
+
+#include <glib.h>
+
+#include "context.h"
+
+/**
+ * In supervisor mode one valet process starts `workers` copies of itself,
+ * each running its own libpurple on its own XMPP account, and does nothing
+ * else: it restarts workers that die or stop sending heartbeats, and serves
+ * their combined health as metrics.
+ *
+ * Every worker needs an account of its own, and buddies are split between
+ * workers by which account they talk to. Resources of one shared account
+ * would not do: a server may deliver a message sent to the bare JID to only
+ * one of them. Shared state stays coherent only through redis; without it
+ * every worker keeps a kvstore of its own.
+ */
+int
+valet_supervise (Context *, const gchar *, const gchar *, GMainLoop *);
+
+void
+valet_worker_configure (Context *, const gchar *, guint);
+
+void
+valet_worker_heartbeat (Context *);
+
+#endif /* __VALET_SUPERVISOR_H */
@@ -0,0 +1,34 @@
+#ifndef __VALET_TOKENIZE_H
+#define __VALET_TOKENIZE_H
+
+#include <glib.h>
+
+#include "arena.h"
+
+typedef enum {
+  /* The text is IM markup: tags are dropped, line breaks become newlines
+   * and character entities are decoded. */
+  VALET_TOKENIZE_MARKUP = 1 << 0,
+  /* Stop at the first unquoted newline. */
+  VALET_TOKENIZE_FIRST_LINE = 1 << 1
+} ValetTokenizeFlags;
+
+/**
+ * Split a message into arguments in one pass, the way a shell would:
+ * arguments are separated by runs of whitespace, 'single quotes' keep
+ * everything literally, "double quotes" allow \" and \\, and a backslash
+ * outside quotes escapes the next character. Quotes may produce empty
+ * arguments; nothing else does.
+ *
+ * The vector and its strings are allocated from the arena. With
+ * VALET_TOKENIZE_FIRST_LINE, the last argument points just past the newline
+ * in the original text, or is set to NULL if there was none.
+ */
+gchar **
+valet_tokenize (Arena *, const gchar *, gsize, ValetTokenizeFlags,
+                const gchar **);
+
+gchar *
+valet_markup_strip (const gchar *, gsize);
+
+#endif /* __VALET_TOKENIZE_H */
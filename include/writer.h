@@ -0,0 +1,34 @@
+#ifndef __VALET_WRITER_H
+#define __VALET_WRITER_H
+
+#include <glib.h>
+
+/**
+ * A PipeWriter feeds a buffer to a child's stdin from the main loop, as fast
+ * as the child reads it, and closes the pipe once everything is written or
+ * the child stops listening. The child sees end of input either way.
+ *
+ * A writer made with valet_writer_stream instead keeps the pipe open for
+ * whatever is appended later, until valet_writer_close.
+ */
+typedef struct _PipeWriter PipeWriter;
+
+PipeWriter *
+valet_writer_new (gint, gchar *, gsize);
+
+PipeWriter *
+valet_writer_stream (gint);
+
+gboolean
+valet_writer_append (PipeWriter *, const gchar *, gsize);
+
+gsize
+valet_writer_pending (PipeWriter *);
+
+void
+valet_writer_close (PipeWriter *);
+
+void
+valet_writer_free (PipeWriter *);
+
+#endif /* __VALET_WRITER_H */
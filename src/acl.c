@@ -0,0 +1,148 @@
+/***
+ * acl.c
+ * Per-command access control, checked before a message is parsed.
+ */
+
+#include <string.h>
+
+#include "acl.h"
+
+#define ACL_GROUP_PREFIX "acl."
+
+/* Allows every command and builtin. */
+#define ACL_ANY "*"
+
+/* Longest command name worth looking up; longer ones need ACL_ANY. */
+#define NAME_MAX_LENGTH 64
+
+/**
+ * What one JID may run, merged from every group it is in.
+ */
+typedef struct {
+  gboolean any;
+  GHashTable *commands; /* Set of names */
+} Grant;
+
+struct _Acl {
+  GHashTable *grants; /* JID -> Grant */
+};
+
+static void
+grant_free (gpointer data) {
+  Grant *grant = data;
+  g_hash_table_destroy (grant->commands);
+  g_free (grant);
+}
+
+static Grant *
+acl_grant (Acl *acl, const gchar *member) {
+  Grant *grant;
+  gchar *jid;
+
+  /* JIDs are compared the way libpurple normalizes senders. */
+  jid = g_utf8_strdown (member, -1);
+  grant = g_hash_table_lookup (acl->grants, jid);
+  if (NULL == grant) {
+    grant = g_new0 (Grant, 1);
+    grant->commands = g_hash_table_new_full
+      (g_str_hash, g_str_equal, g_free, NULL);
+    g_hash_table_insert (acl->grants, jid, grant);
+  }
+  else {
+    g_free (jid);
+  }
+  return grant;
+}
+
+/**
+ * Read every [acl.<group>] group, eg
+ *   [acl.friends]
+ *   members=alice@example.org;bob@example.org
+ *   commands=weather;uptime;#get
+ * Returns NULL if there are none, in which case every buddy may run
+ * everything.
+ */
+Acl *
+valet_acl_load (GKeyFile *keyfile) {
+  Acl *acl = NULL;
+  Grant *grant;
+  gchar **groups, **group, **members, **member, **commands, **command;
+
+  groups = g_key_file_get_groups (keyfile, NULL);
+  for (group = groups; NULL != *group; group++) {
+    if (!g_str_has_prefix (*group, ACL_GROUP_PREFIX)) {
+      continue;
+    }
+    if (NULL == acl) {
+      acl = g_new0 (Acl, 1);
+      acl->grants = g_hash_table_new_full
+        (g_str_hash, g_str_equal, g_free, grant_free);
+    }
+
+    members = g_key_file_get_string_list
+      (keyfile, *group, "members", NULL, NULL);
+    commands = g_key_file_get_string_list
+      (keyfile, *group, "commands", NULL, NULL);
+    if (NULL == members || NULL == commands) {
+      g_warning ("[%s] needs both members and commands; ignoring it.",
+                 *group);
+    }
+    else {
+      for (member = members; NULL != *member; member++) {
+        grant = acl_grant (acl, g_strstrip (*member));
+        for (command = commands; NULL != *command; command++) {
+          g_strstrip (*command);
+          if (0 == strcmp (*command, ACL_ANY)) {
+            grant->any = TRUE;
+          }
+          else {
+            g_hash_table_add (grant->commands, g_strdup (*command));
+          }
+        }
+      }
+    }
+    g_strfreev (members);
+    g_strfreev (commands);
+  }
+  g_strfreev (groups);
+  return acl;
+}
+
+void
+valet_acl_free (Acl *acl) {
+  g_hash_table_destroy (acl->grants);
+  g_free (acl);
+}
+
+/**
+ * May `jid` run the command or builtin called `name`, of which `length`
+ * bytes count? Everyone may run everything when there is no ACL.
+ */
+ValetAclResult
+valet_acl_check (Acl *acl,
+                 const gchar *jid,
+                 const gchar *name,
+                 gsize length) {
+  gchar key[NAME_MAX_LENGTH + 1];
+  Grant *grant;
+
+  if (NULL == acl) {
+    return VALET_ACL_ALLOW;
+  }
+
+  grant = g_hash_table_lookup (acl->grants, jid);
+  if (NULL == grant) {
+    return VALET_ACL_UNKNOWN;
+  }
+  if (grant->any) {
+    return VALET_ACL_ALLOW;
+  }
+  if (0 == length || length > NAME_MAX_LENGTH) {
+    return VALET_ACL_DENY;
+  }
+
+  memcpy (key, name, length);
+  key[length] = '\0';
+  return g_hash_table_contains (grant->commands, key)
+    ? VALET_ACL_ALLOW : VALET_ACL_DENY;
+}
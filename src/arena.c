@@ -0,0 +1,105 @@
+/***
+ * arena.c
+ * A bump allocator for memory that is freed all together.
+ */
+
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN (2 * sizeof (gpointer))
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+typedef struct _Block Block;
+
+struct _Block {
+  Block *next;
+  gsize size;
+  gsize used;
+};
+
+struct _Arena {
+  Block *blocks; /* The one being filled first */
+  gsize block_size;
+};
+
+static Block *
+arena_block (Arena *arena, gsize size) {
+  Block *block;
+
+  block = g_malloc (ARENA_ROUND (sizeof (Block)) + size);
+  block->size = size;
+  block->used = 0;
+  block->next = arena->blocks;
+  arena->blocks = block;
+  return block;
+}
+
+/**
+ * Create an arena whose first block holds `size` bytes; later blocks are
+ * at least as large.
+ */
+Arena *
+valet_arena_new (gsize size) {
+  Arena *arena;
+
+  arena = g_new0 (Arena, 1);
+  arena->block_size = ARENA_ROUND (MAX (size, 256));
+  arena_block (arena, arena->block_size);
+  return arena;
+}
+
+void
+valet_arena_free (Arena *arena) {
+  Block *block, *next;
+
+  for (block = arena->blocks; NULL != block; block = next) {
+    next = block->next;
+    g_free (block);
+  }
+  g_free (arena);
+}
+
+/**
+ * Allocate `size` bytes, suitably aligned for any type. The memory is not
+ * cleared.
+ */
+gpointer
+valet_arena_alloc (Arena *arena, gsize size) {
+  Block *block = arena->blocks;
+  gpointer memory;
+
+  size = ARENA_ROUND (MAX (size, 1));
+  if (block->size - block->used < size) {
+    if (size > arena->block_size / 2) {
+      /* Too big to share a block; keep filling the current one. */
+      block = arena_block (arena, size);
+      arena->blocks = block->next;
+      block->next = arena->blocks->next;
+      arena->blocks->next = block;
+    }
+    else {
+      block = arena_block (arena, arena->block_size);
+    }
+  }
+
+  memory = (gchar *) block + ARENA_ROUND (sizeof (Block)) + block->used;
+  block->used += size;
+  return memory;
+}
+
+gchar *
+valet_arena_strndup (Arena *arena, const gchar *string, gsize length) {
+  gchar *copy;
+
+  copy = valet_arena_alloc (arena, length + 1);
+  memcpy (copy, string, length);
+  copy[length] = '\0';
+  return copy;
+}
+
+gchar *
+valet_arena_strdup (Arena *arena, const gchar *string) {
+  return NULL == string
+    ? NULL : valet_arena_strndup (arena, string, strlen (string));
+}
@@ -0,0 +1,122 @@
+/***
+ * cache.c
+ * A size-bounded LRU cache of strings with per-entry expiry.
+ */
+
+#include "cache.h"
+
+typedef struct {
+  gchar *key;
+  gchar *value;
+  gint64 expires; /* Monotonic time in microseconds, or 0 for never */
+  GList link; /* Position in the recency queue */
+} Entry;
+
+struct _Cache {
+  guint max_entries;
+  GHashTable *entries; /* key -> Entry */
+  GQueue recency; /* Most recently used at the head */
+};
+
+static void
+entry_free (gpointer data) {
+  Entry *entry = data;
+  g_free (entry->key);
+  g_free (entry->value);
+  g_free (entry);
+}
+
+Cache *
+valet_cache_new (guint max_entries) {
+  Cache *cache;
+
+  cache = g_new0 (Cache, 1);
+  cache->max_entries = MAX (max_entries, 1);
+  cache->entries = g_hash_table_new_full
+    (g_str_hash, g_str_equal, NULL, entry_free);
+  g_queue_init (&cache->recency);
+  return cache;
+}
+
+void
+valet_cache_free (Cache *cache) {
+  g_hash_table_destroy (cache->entries);
+  g_free (cache);
+}
+
+static void
+cache_evict (Cache *cache, Entry *entry) {
+  g_queue_unlink (&cache->recency, &entry->link);
+  g_hash_table_remove (cache->entries, entry->key);
+}
+
+/**
+ * Look up `key`. Returns NULL if it is absent or has expired. The returned
+ * string belongs to the cache and is only valid until the next insertion.
+ */
+const gchar *
+valet_cache_lookup (Cache *cache, const gchar *key) {
+  Entry *entry;
+
+  entry = g_hash_table_lookup (cache->entries, key);
+  if (NULL == entry) {
+    return NULL;
+  }
+
+  if (0 != entry->expires && g_get_monotonic_time () >= entry->expires) {
+    cache_evict (cache, entry);
+    return NULL;
+  }
+
+  g_queue_unlink (&cache->recency, &entry->link);
+  g_queue_push_head_link (&cache->recency, &entry->link);
+  return entry->value;
+}
+
+/**
+ * Store `value` under `key` for `ttl` seconds (0 means until evicted).
+ */
+void
+valet_cache_insert (Cache *cache,
+                    const gchar *key,
+                    const gchar *value,
+                    guint ttl) {
+  Entry *entry;
+
+  valet_cache_remove (cache, key);
+
+  entry = g_new0 (Entry, 1);
+  entry->key = g_strdup (key);
+  entry->value = g_strdup (value);
+  entry->expires = 0 == ttl
+    ? 0 : g_get_monotonic_time () + (gint64) ttl * G_USEC_PER_SEC;
+  entry->link.data = entry;
+
+  g_hash_table_insert (cache->entries, entry->key, entry);
+  g_queue_push_head_link (&cache->recency, &entry->link);
+
+  while (cache->recency.length > cache->max_entries) {
+    cache_evict (cache, cache->recency.tail->data);
+  }
+}
+
+void
+valet_cache_remove (Cache *cache, const gchar *key) {
+  Entry *entry;
+
+  entry = g_hash_table_lookup (cache->entries, key);
+  if (NULL != entry) {
+    cache_evict (cache, entry);
+  }
+}
+
+void
+valet_cache_clear (Cache *cache) {
+  g_queue_init (&cache->recency);
+  g_hash_table_remove_all (cache->entries);
+}
+
+guint
+valet_cache_size (Cache *cache) {
+  return g_hash_table_size (cache->entries);
+}
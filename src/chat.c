@@ -6,6 +6,9 @@
 
 #include "chat.h"
 #include "response.h"
+#include "metrics.h"
+#include "outbox.h"
+#include "session.h"
 
 /*** The first part of this code stolen shamelessly from the libpurple example
      `nullclient` ***/
@@ -222,10 +225,37 @@ signed_on(PurpleConnection *gc, gpointer null) {
              account->username, account->protocol_id);
 }
 
+static void
+sent_im (PurpleAccount *account, const char *receiver, const char *message) {
+  valet_metrics_count (VALET_COUNTER_MESSAGES_SENT);
+}
+
+/**
+ * libpurple is about to free `conv`; nothing may be sent through it after
+ * this. A session open in it is ended, and everything else still holding
+ * it is cleared.
+ */
+static void
+deleting_conversation (PurpleConversation *conv, gpointer data) {
+  Context *context = data;
+  PurpleConvIm *im;
+
+  if (PURPLE_CONV_TYPE_IM != purple_conversation_get_type (conv)) {
+    return;
+  }
+  im = purple_conversation_get_im_data (conv);
+  if (NULL != context->sessions) {
+    valet_session_close (context->sessions, im);
+  }
+  valet_outbox_forget (im);
+}
+
 static void
 connect_to_signals (Context *context) {
   static int signed_on_handle;
   static int received_im_msg_handle;
+  static int sent_im_msg_handle;
+  static int deleting_conversation_handle;
 
   /*    static int conversation_created_handle; */
   purple_signal_connect (purple_connections_get_handle (),
@@ -235,6 +265,15 @@ connect_to_signals (Context *context) {
   purple_signal_connect (purple_conversations_get_handle (),
                          "received-im-msg", &received_im_msg_handle,
                          PURPLE_CALLBACK(received_im), context);
+
+  purple_signal_connect (purple_conversations_get_handle (),
+                         "sent-im-msg", &sent_im_msg_handle,
+                         PURPLE_CALLBACK(sent_im), NULL);
+
+  purple_signal_connect (purple_conversations_get_handle (),
+                         "deleting-conversation",
+                         &deleting_conversation_handle,
+                         PURPLE_CALLBACK(deleting_conversation), context);
 }
 
 /**
@@ -289,3 +328,40 @@ initialize_libpurple (Context *context) {
 
   initialize_omemo (context->lurch_path);
 }
+
+/**
+ * Switch the XMPP account to new credentials. Nothing is touched unless they
+ * differ from the ones in use: a new password is kept for the next time the
+ * account connects, and a new username replaces the account altogether.
+ */
+void
+valet_chat_set_credentials (Context *context,
+                            const gchar *username,
+                            const gchar *password) {
+  PurpleAccount *account;
+
+  if (0 == g_strcmp0 (username, context->username)
+      && 0 == g_strcmp0 (password, context->password)) {
+    return;
+  }
+
+  if (NULL != context->username
+      && 0 != g_strcmp0 (username, context->username)) {
+    account = purple_accounts_find (context->username, "prpl-jabber");
+    if (NULL != account) {
+      g_message ("Signing out of %s", context->username);
+      purple_account_set_enabled (account, UI_ID, FALSE);
+    }
+  }
+
+  if (NULL != username) {
+    account = purple_account_new (username, "prpl-jabber");
+    purple_account_set_password (account, password);
+    purple_account_set_enabled (account, UI_ID, TRUE);
+  }
+
+  g_free (context->username);
+  context->username = g_strdup (username);
+  g_free (context->password);
+  context->password = g_strdup (password);
+}
@@ -0,0 +1,255 @@
+/***
+ * children.c
+ * Tracks command processes through pidfds, and reaps whatever else exits.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <glib-unix.h>
+
+#include "children.h"
+
+/* Seconds between sweeps for children nobody is tracking. */
+#define STRAY_REAP_INTERVAL 5
+
+/* Reported when a child's exit status could not be had. */
+#define CHILD_LOST_STATUS -1
+
+typedef struct {
+  GPid pid;
+  gint pidfd; /* -1 without pidfd support */
+  guint source; /* Readable pidfd, for children we reap */
+  guint child_watch; /* GLib's watch, without pidfd support */
+  gboolean reap; /* Whether we are the parent, rather than the zygote */
+  ValetExitFunc func;
+  gpointer data;
+  gboolean exited;
+  gint status;
+} Child;
+
+static GHashTable *children = NULL; /* pid -> Child */
+
+static gint
+pidfd_open_compat (GPid pid) {
+#ifdef SYS_pidfd_open
+  return syscall (SYS_pidfd_open, pid, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+static gint
+pidfd_send_signal_compat (gint pidfd, gint signum) {
+#ifdef SYS_pidfd_send_signal
+  return syscall (SYS_pidfd_send_signal, pidfd, signum, NULL, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+static void
+child_free (Child *child) {
+  if (0 != child->source) {
+    g_source_remove (child->source);
+  }
+  if (-1 != child->pidfd) {
+    close (child->pidfd);
+  }
+  g_free (child);
+}
+
+/**
+ * Tell whoever is waiting how the child exited, and forget about it.
+ */
+static void
+child_fire (Child *child) {
+  g_hash_table_steal (children, GINT_TO_POINTER (child->pid));
+  child->func (child->pid, child->status, child->data);
+  child_free (child);
+}
+
+static gboolean
+child_fire_idle (gpointer data) {
+  child_fire (data);
+  return FALSE;
+}
+
+static void
+child_set_exited (Child *child, gint status) {
+  child->exited = TRUE;
+  child->status = status;
+  if (0 != child->source) {
+    g_source_remove (child->source);
+    child->source = 0;
+  }
+  if (NULL != child->func) {
+    child_fire (child);
+  }
+}
+
+/**
+ * The pidfd of a child we are the parent of became readable: it has exited.
+ */
+static gboolean
+child_ready (gint fd, GIOCondition cond, gpointer data) {
+  Child *child = data;
+  gint status;
+  GPid pid;
+
+  do {
+    pid = waitpid (child->pid, &status, WNOHANG);
+  } while (pid < 0 && EINTR == errno);
+
+  if (0 == pid) {
+    return TRUE;
+  }
+  child->source = 0;
+  child_set_exited (child, pid < 0 ? CHILD_LOST_STATUS : status);
+  return FALSE;
+}
+
+/**
+ * Without pidfds, fall back to GLib's SIGCHLD handling.
+ */
+static void
+child_watch_exited (GPid pid, gint status, gpointer data) {
+  Child *child = data;
+
+  child->child_watch = 0;
+  child_set_exited (child, status);
+}
+
+/**
+ * Reap children nobody is tracking, such as libpurple's DNS helpers, which
+ * are left for the UI to clean up. Every command we start leads a process
+ * group of its own, so only strays are left in ours, and waiting on our
+ * group never takes the exit status of a tracked child from its watcher.
+ */
+static gboolean
+children_sweep (gpointer data G_GNUC_UNUSED) {
+  gint status;
+  GPid pid;
+
+  while ((pid = waitpid (-getpgrp (), &status, WNOHANG)) > 0) {
+    g_debug ("Reaped stray child %d", pid);
+  }
+  return TRUE;
+}
+
+void
+valet_children_start (void) {
+  children = g_hash_table_new (g_direct_hash, g_direct_equal);
+  g_timeout_add_seconds (STRAY_REAP_INTERVAL, children_sweep, NULL);
+}
+
+/**
+ * Start tracking `pid`, just after it was started. With `reap` we are its
+ * parent and reap it ourselves; otherwise its exit is reported with
+ * valet_child_exited.
+ */
+void
+valet_child_track (GPid pid, gboolean reap) {
+  Child *child;
+
+  child = g_new0 (Child, 1);
+  child->pid = pid;
+  child->reap = reap;
+  child->pidfd = pidfd_open_compat (pid);
+
+  if (reap && -1 != child->pidfd) {
+    child->source = g_unix_fd_add
+      (child->pidfd, G_IO_IN, child_ready, child);
+  }
+  else if (reap) {
+    child->child_watch = g_child_watch_add
+      (pid, child_watch_exited, child);
+  }
+  g_hash_table_insert (children, GINT_TO_POINTER (pid), child);
+}
+
+/**
+ * Call `func` once the tracked process `pid` exits, with its wait status.
+ */
+void
+valet_child_watch (GPid pid, ValetExitFunc func, gpointer data) {
+  Child *child;
+
+  child = g_hash_table_lookup (children, GINT_TO_POINTER (pid));
+  if (NULL == child) {
+    g_warning ("Asked to watch untracked child %d", pid);
+    return;
+  }
+
+  child->func = func;
+  child->data = data;
+  if (child->exited) {
+    g_idle_add (child_fire_idle, child);
+  }
+}
+
+/**
+ * The zygote says how one of its children exited.
+ */
+void
+valet_child_exited (GPid pid, gint status) {
+  Child *child;
+
+  child = g_hash_table_lookup (children, GINT_TO_POINTER (pid));
+  if (NULL != child && !child->reap) {
+    child_set_exited (child, status);
+  }
+}
+
+/**
+ * Send `signum` to the process group led by `pid`, while that is still
+ * the tracked child: once it has been reaped its pid, and so the group id,
+ * may be someone else's. What is left of the group is then for the cgroup
+ * to kill, if there is one; callers stop reading its output either way.
+ * The pidfd reaches the leader even if it has left its group.
+ */
+void
+valet_child_kill (GPid pid, gint signum) {
+  Child *child;
+
+  child = g_hash_table_lookup (children, GINT_TO_POINTER (pid));
+  if (NULL == child || child->exited) {
+    return;
+  }
+  if (-1 != child->pidfd) {
+    pidfd_send_signal_compat (child->pidfd, signum);
+  }
+  kill (-pid, signum);
+}
+
+/**
+ * Settle up with everyone waiting on a child that is not ours to reap: the
+ * zygote that was is gone.
+ */
+void
+valet_children_lost (gint status) {
+  GList *pids, *iter;
+  Child *child;
+
+  pids = g_hash_table_get_keys (children);
+  for (iter = pids; NULL != iter; iter = iter->next) {
+    child = g_hash_table_lookup (children, iter->data);
+    if (NULL != child && !child->reap && !child->exited) {
+      child_set_exited (child, status);
+    }
+  }
+  g_list_free (pids);
+}
+
+/**
+ * Processes being tracked, running or waiting to be reported.
+ */
+guint
+valet_children_count (void) {
+  return g_hash_table_size (children);
+}
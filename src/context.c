@@ -6,8 +6,62 @@
 
 #include "context.h"
 #include "defines.h"
+#include "cache.h"
+#include "redis.h"
+#include "store.h"
+#include "index.h"
+#include "acl.h"
+#include "remote.h"
 
-#include "purple.h"
+/**
+ * Read an optional positive integer setting, falling back to a default.
+ */
+static gint
+get_positive_integer (GKeyFile *keyfile,
+                      const gchar *group,
+                      const gchar *key,
+                      gint fallback) {
+  gint value = g_key_file_get_integer (keyfile, group, key, NULL);
+  return value > 0 ? value : fallback;
+}
+
+/**
+ * Read an optional positive rate setting, falling back to a default.
+ */
+static gdouble
+get_positive_double (GKeyFile *keyfile,
+                     const gchar *group,
+                     const gchar *key,
+                     gdouble fallback) {
+  gdouble value = g_key_file_get_double (keyfile, group, key, NULL);
+  return value > 0 ? value : fallback;
+}
+
+/**
+ * Read the [cache.ttl] group, which maps command names to the number of
+ * seconds their output may be reused for.
+ */
+static GHashTable *
+get_cache_ttls (GKeyFile *keyfile) {
+  GHashTable *ttls;
+  gchar **keys, **key;
+  gint ttl;
+
+  ttls = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  keys = g_key_file_get_keys (keyfile, "cache.ttl", NULL, NULL);
+  if (NULL == keys) {
+    return ttls;
+  }
+
+  for (key = keys; NULL != *key; key++) {
+    ttl = g_key_file_get_integer (keyfile, "cache.ttl", *key, NULL);
+    if (ttl > 0) {
+      g_hash_table_insert (ttls, g_strdup (*key), GUINT_TO_POINTER (ttl));
+    }
+  }
+  g_strfreev (keys);
+  return ttls;
+}
 
 Context *
 get_context (char *config_path, GError **caller_error) {
@@ -15,6 +69,7 @@ get_context (char *config_path, GError **caller_error) {
   GKeyFile *keyfile;
   GKeyFileFlags flags;
   GError *error;
+  gchar *executor, *cwd, *path;
 
   error = NULL;
 
@@ -30,6 +85,15 @@ get_context (char *config_path, GError **caller_error) {
     return NULL;
   }
 
+  /* Everything else has a default; where commands live does not. */
+  if (!g_key_file_has_key (keyfile, "valet", "commands", NULL)) {
+    g_set_error (caller_error, G_KEY_FILE_ERROR,
+                 G_KEY_FILE_ERROR_KEY_NOT_FOUND,
+                 "%s sets no commands directory in [valet]", config_path);
+    g_key_file_free (keyfile);
+    return NULL;
+  }
+
   context = g_slice_new (Context);
   context->username = g_key_file_get_string
     (keyfile, "credentials", "username", NULL);
@@ -40,6 +104,14 @@ get_context (char *config_path, GError **caller_error) {
   context->bonjour_enabled = g_key_file_get_boolean
     (keyfile, "valet", "bonjour", NULL);
 
+  context->workers = get_positive_integer
+    (keyfile, "supervisor", "workers", 1);
+
+  context->heartbeat_interval = get_positive_integer
+    (keyfile, "supervisor", "heartbeat", DEFAULT_HEARTBEAT_INTERVAL);
+
+  context->worker = -1;
+
   context->purple_data = g_key_file_get_string
     (keyfile, "valet", "libpurpledata", NULL);
 
@@ -48,68 +120,701 @@ get_context (char *config_path, GError **caller_error) {
 
   context->commands_path = g_key_file_get_string
     (keyfile, "valet", "commands", NULL);
+  /* Commands run there, so it must not depend on where anything else is. */
+  if (NULL != context->commands_path
+      && !g_path_is_absolute (context->commands_path)) {
+    cwd = g_get_current_dir ();
+    path = g_build_filename (cwd, context->commands_path, NULL);
+    g_free (context->commands_path);
+    context->commands_path = path;
+    g_free (cwd);
+  }
+
+  context->plugins_path = g_key_file_get_string
+    (keyfile, "valet", "plugins", NULL);
+
+  context->plugin_threads = get_positive_integer
+    (keyfile, "valet", "plugin_threads", DEFAULT_PLUGIN_THREADS);
+
+  executor = g_key_file_get_string (keyfile, "valet", "executor", NULL);
+  if (NULL == executor || 0 == g_strcmp0 (executor, "spawn")) {
+    context->executor = VALET_EXECUTOR_SPAWN;
+  }
+  else if (0 == g_strcmp0 (executor, "zygote")) {
+    context->executor = VALET_EXECUTOR_ZYGOTE;
+  }
+  else {
+    g_warning ("Unknown executor \"%s\"; spawning commands directly.",
+               executor);
+    context->executor = VALET_EXECUTOR_SPAWN;
+  }
+  g_free (executor);
+
+  context->output_max_bytes = get_positive_integer
+    (keyfile, "valet", "output_max_bytes", DEFAULT_OUTPUT_MAX_BYTES);
+
+  context->output_flush_ms = get_positive_integer
+    (keyfile, "valet", "output_flush_ms", DEFAULT_OUTPUT_FLUSH_MS);
+
+  context->outbox_rate = get_positive_double
+    (keyfile, "outbox", "rate", DEFAULT_OUTBOX_RATE);
+
+  context->outbox_burst = get_positive_integer
+    (keyfile, "outbox", "burst", DEFAULT_OUTBOX_BURST);
+
+  context->outbox_account_rate = get_positive_double
+    (keyfile, "outbox", "account_rate", DEFAULT_OUTBOX_ACCOUNT_RATE);
+
+  context->outbox_account_burst = get_positive_integer
+    (keyfile, "outbox", "account_burst", DEFAULT_OUTBOX_ACCOUNT_BURST);
+
+  context->outbox_max_queued = get_positive_integer
+    (keyfile, "outbox", "max_queued", DEFAULT_OUTBOX_MAX_QUEUED);
+
+  context->output_cap_bytes = get_positive_integer
+    (keyfile, "valet", "output_cap_bytes", DEFAULT_OUTPUT_CAP_BYTES);
+
+  context->read_buffer_bytes = get_positive_integer
+    (keyfile, "valet", "read_buffer_bytes", DEFAULT_READ_BUFFER_BYTES);
+
+  context->max_running = get_positive_integer
+    (keyfile, "valet", "max_running", DEFAULT_MAX_RUNNING);
+
+  context->max_per_sender = get_positive_integer
+    (keyfile, "valet", "max_per_sender", DEFAULT_MAX_PER_SENDER);
+
+  context->max_sessions = get_positive_integer
+    (keyfile, "session", "max", DEFAULT_MAX_SESSIONS);
+
+  context->session_idle_timeout = get_positive_integer
+    (keyfile, "session", "idle_timeout", DEFAULT_SESSION_IDLE_TIMEOUT);
+
+  context->session_max_input = get_positive_integer
+    (keyfile, "session", "max_input", DEFAULT_SESSION_MAX_INPUT);
+
+  context->cache_max_entries = get_positive_integer
+    (keyfile, "cache", "max_entries", DEFAULT_CACHE_MAX_ENTRIES);
+
+  context->cache_max_entry_bytes = get_positive_integer
+    (keyfile, "cache", "max_entry_bytes", DEFAULT_CACHE_MAX_ENTRY_BYTES);
+
+  context->cache_ttls = get_cache_ttls (keyfile);
+
+  context->acl = valet_acl_load (keyfile);
+
+  context->remote_commands = g_key_file_get_string_list
+    (keyfile, "remote", "commands", NULL, NULL);
+
+  context->remote_prefix = g_key_file_get_string
+    (keyfile, "remote", "prefix", NULL);
+  if (NULL == context->remote_prefix) {
+    context->remote_prefix = g_strdup (DEFAULT_REMOTE_PREFIX);
+  }
+
+  memset (&context->limits, 0, sizeof (ValetLimits));
+  context->limits.timeout = DEFAULT_COMMAND_TIMEOUT;
+  context->limits.kill_grace = DEFAULT_KILL_GRACE;
+  valet_limits_load (&context->limits, keyfile, "limits");
 
-  context->kvstore = g_hash_table_new (g_str_hash, g_str_equal);
+  context->cgroup_path = g_key_file_get_string
+    (keyfile, "limits", "cgroup", NULL);
+
+  context->metrics_socket = g_key_file_get_string
+    (keyfile, "metrics", "socket", NULL);
+
+  context->metrics_port = get_positive_integer
+    (keyfile, "metrics", "port", 0);
+
+  context->kvstore = NULL;
+  context->kvstore_coherent = FALSE;
+  context->kvstore_generation = 0;
+  context->dispatcher = NULL;
+  context->scheduler = NULL;
+  context->output_cache = NULL;
+  context->in_flight = NULL;
+  context->commands = NULL;
+  context->plugins = NULL;
+  context->sessions = NULL;
+  context->remote = NULL;
+  context->redis = NULL;
+  context->redis_host = NULL;
+  context->redis_port = 0;
+  context->store = NULL;
+  context->store_path = NULL;
 
   if (g_key_file_has_group (keyfile, "redis")) {
-    gchar *redis_host = g_key_file_get_string (keyfile, "redis", "host", NULL);
-    gint redis_port = g_key_file_get_integer (keyfile, "redis", "port", NULL);
-    g_debug ("redis group exists: %s : %d", redis_host, redis_port);
-    context->redisCtx = redisAsyncConnect (redis_host, redis_port);
-    if (context->redisCtx->err) {
-      g_debug ("redis error");
-      g_printerr ("redis error: %s\n",context->redisCtx->errstr);
-      context->redisCtx = NULL;
-    }
+    context->redis_host = g_key_file_get_string
+      (keyfile, "redis", "host", NULL);
+    context->redis_port = g_key_file_get_integer
+      (keyfile, "redis", "port", NULL);
+    context->kvstore_size = get_positive_integer
+      (keyfile, "redis", "local_cache", DEFAULT_KVSTORE_LOCAL_CACHE);
+    context->redis_max_pending = get_positive_integer
+      (keyfile, "redis", "max_pending", DEFAULT_REDIS_MAX_PENDING);
+    g_debug ("redis group exists: %s : %d",
+             context->redis_host, context->redis_port);
   }
   else {
-    context->redisCtx = NULL;
+    context->store_path = g_key_file_get_string
+      (keyfile, "store", "path", NULL);
+    if (NULL == context->store_path) {
+      context->store_path = g_strdup (DEFAULT_STORE_PATH);
+    }
   }
 
+  context->store_compact_bytes = get_positive_integer
+    (keyfile, "store", "compact_bytes", DEFAULT_STORE_COMPACT_BYTES);
+
   g_key_file_free (keyfile);
   return context;
 }
 
+#define SWAP(a, b) G_STMT_START {             \
+    gpointer swap_tmp = (gpointer) (a);       \
+    (a) = (b);                                \
+    (b) = swap_tmp;                           \
+  } G_STMT_END
+
+/**
+ * Free a context that was only read to be compared with the one in use.
+ */
 static void
-set_key_cb (redisAsyncContext *ac,
-            gpointer r,
-            gpointer user_data G_GNUC_UNUSED) {
-  redisReply *reply = r;
-  if (reply) {
-    g_message ("REPLY: %s", reply->str);
+context_discard (Context *context) {
+  g_free (context->username);
+  g_free (context->password);
+  g_free (context->purple_data);
+  g_free (context->lurch_path);
+  g_free (context->commands_path);
+  g_free (context->plugins_path);
+  g_free (context->cgroup_path);
+  g_hash_table_destroy (context->cache_ttls);
+  if (NULL != context->acl) {
+    valet_acl_free (context->acl);
+  }
+  g_strfreev (context->remote_commands);
+  g_free (context->remote_prefix);
+  g_free (context->redis_host);
+  g_free (context->store_path);
+  g_free (context->metrics_socket);
+  g_slice_free (Context, context);
+}
+
+/**
+ * Take on the settings from `fresh`, a newly read configuration, that can
+ * change while valet is running, and free it. Commands already started
+ * keep the settings they started with; everything else needs a restart.
+ * Credentials are left to valet_chat_set_credentials.
+ */
+void
+valet_context_reload (Context *context, Context *fresh) {
+  CommandIndex *index;
+
+  /* Rebuilding the index also picks up sidecars inotify may have missed. */
+  SWAP (context->commands_path, fresh->commands_path);
+  index = valet_index_new (context->commands_path);
+  if (NULL != context->commands) {
+    valet_index_free (context->commands);
+  }
+  context->commands = index;
+
+  context->limits = fresh->limits;
+  SWAP (context->cgroup_path, fresh->cgroup_path);
+  SWAP (context->acl, fresh->acl);
+
+  SWAP (context->remote_commands, fresh->remote_commands);
+  if (NULL != context->remote) {
+    valet_remote_set_commands (context->remote, context->remote_commands);
+  }
+
+  context->output_max_bytes = fresh->output_max_bytes;
+  context->output_flush_ms = fresh->output_flush_ms;
+  context->output_cap_bytes = fresh->output_cap_bytes;
+  context->read_buffer_bytes = fresh->read_buffer_bytes;
+  context->session_max_input = fresh->session_max_input;
+
+  SWAP (context->cache_ttls, fresh->cache_ttls);
+  context->cache_max_entry_bytes = fresh->cache_max_entry_bytes;
+  if (fresh->cache_max_entries != context->cache_max_entries) {
+    context->cache_max_entries = fresh->cache_max_entries;
+    if (NULL != context->output_cache) {
+      valet_cache_free (context->output_cache);
+      context->output_cache = valet_cache_new (context->cache_max_entries);
+    }
+  }
+
+  if (NULL != context->redis && NULL != fresh->redis_host) {
+    SWAP (context->redis_host, fresh->redis_host);
+    context->redis_port = fresh->redis_port;
+    valet_redis_retarget
+      (context->redis, context->redis_host, context->redis_port);
+  }
+  else if ((NULL == context->redis_host) != (NULL == fresh->redis_host)) {
+    g_warning ("Switching between [redis] and [store] needs a restart.");
   }
+
+  context_discard (fresh);
 }
 
+/**
+ * Keyspace notifications tell us when any client changes a key, so that the
+ * local copy in the kvstore can be dropped. The server must have
+ * notify-keyspace-events enabled (eg "K$gx").
+ */
 static void
-get_key_cb (redisAsyncContext *ac,
-            gpointer r,
-            gpointer i ) {
-  redisReply *reply = r;
-  if (reply) {
-    g_message ("REPLY: %s", reply->str);
-    purple_conv_im_send ((PurpleConvIm *)i, reply->str);
+keyspace_cb (redisReply *reply, gpointer data) {
+  Context *context = data;
+  const gchar *channel, *key;
+
+  if (NULL == reply) {
+    /* Without notifications we cannot trust anything we have kept. */
+    g_warning ("Lost redis keyspace notifications; reading through to redis.");
+    context->kvstore_coherent = FALSE;
+    context->kvstore_generation++;
+    valet_cache_clear (context->kvstore);
+    return;
+  }
+
+  if (REDIS_REPLY_ARRAY != reply->type || reply->elements < 3) {
+    return;
+  }
+
+  if (0 == g_strcmp0 (reply->element[0]->str, "psubscribe")) {
+    g_message ("Watching redis keyspace; serving reads locally.");
+    context->kvstore_coherent = TRUE;
+    return;
+  }
+
+  if (4 != reply->elements
+      || 0 != g_strcmp0 (reply->element[0]->str, "pmessage")) {
+    return;
+  }
+
+  /* Replies already on their way may predate this change. */
+  context->kvstore_generation++;
+
+  /* The channel is __keyspace@<db>__:<key> */
+  channel = reply->element[2]->str;
+  key = strchr (channel, ':');
+  if (NULL != key) {
+    valet_cache_remove (context->kvstore, key + 1);
   }
 }
 
-gboolean
+/**
+ * Connect to redis, or open the embedded store if redis is not configured.
+ * This is separate from get_context so that it can happen after the
+ * executor has forked.
+ */
+void
+valet_kvstore_connect (Context *context) {
+  GError *error = NULL;
+
+  if (NULL == context->redis_host) {
+    context->store = valet_store_open
+      (context->store_path, context->store_compact_bytes, &error);
+    if (NULL == context->store) {
+      g_warning ("No kvstore: %s", error->message);
+      g_error_free (error);
+    }
+    return;
+  }
+
+  context->redis = valet_redis_new
+    (context->redis_host, context->redis_port, context->redis_max_pending);
+  context->kvstore = valet_cache_new (context->kvstore_size);
+  valet_redis_psubscribe
+    (context->redis, "__keyspace@0__:*", keyspace_cb, context);
+}
+
+typedef struct {
+  Context *context;
+  gchar **keys; /* Keys and values, alternately, for writes */
+  guint64 generation; /* The kvstore's generation when this was sent */
+  ValetValueFunc func;
+  gpointer user_data;
+} KeyRequest;
+
+/**
+ * Start a request for `keys`, which it takes ownership of.
+ */
+static KeyRequest *
+key_request_new (Context *context,
+                 gchar **keys,
+                 ValetValueFunc func,
+                 gpointer user_data) {
+  KeyRequest *request;
+
+  request = g_new0 (KeyRequest, 1);
+  request->context = context;
+  request->keys = keys;
+  request->generation = context->kvstore_generation;
+  request->func = func;
+  request->user_data = user_data;
+  return request;
+}
+
+static void
+key_request_free (KeyRequest *request) {
+  g_strfreev (request->keys);
+  g_free (request);
+}
+
+/**
+ * Whether the reply to `request` may be kept locally. Keyspace
+ * notifications and replies come over different connections, so a reply
+ * can arrive after a notification that it is already out of date; it is
+ * only trusted if no notification came in while it was on its way.
+ */
+static gboolean
+key_request_fresh (KeyRequest *request) {
+  return request->context->kvstore_coherent
+    && request->generation == request->context->kvstore_generation;
+}
+
+/**
+ * Keep what was written once redis has taken it.
+ */
+static void
+set_keys_cb (redisReply *reply, gpointer data) {
+  KeyRequest *request = data;
+  Context *context = request->context;
+  guint i;
+
+  if (NULL == reply || REDIS_REPLY_STATUS != reply->type) {
+    g_warning ("Could not set %s: %s", request->keys[0],
+               NULL != reply ? reply->str : "redis went away");
+  }
+  else if (key_request_fresh (request)) {
+    for (i = 0; NULL != request->keys[i] && NULL != request->keys[i + 1];
+         i += 2) {
+      valet_cache_insert
+        (context->kvstore, request->keys[i], request->keys[i + 1], 0);
+    }
+  }
+  key_request_free (request);
+}
+
+/**
+ * Writes go through to redis. The local copy of the key is dropped at once,
+ * so that this instance reads its own write from redis until the write is
+ * acknowledged. Returns VALET_KV_UNREACHABLE if the write could not even be
+ * queued.
+ */
+ValetKvStatus
 valet_set_key (Context *context, const gchar *key, const gchar *value ) {
-  if (NULL == context->redisCtx) {
+  KeyRequest *request;
+  gchar **pair;
+
+  if (NULL != context->store) {
+    return valet_store_set (context->store, key, value)
+      ? VALET_KV_OK : VALET_KV_UNREACHABLE;
+  }
+  if (NULL == context->redis) {
+    return VALET_KV_NONE;
+  }
+  valet_cache_remove (context->kvstore, key);
+
+  pair = g_new0 (gchar *, 3);
+  pair[0] = g_strdup (key);
+  pair[1] = g_strdup (value);
+  request = key_request_new (context, pair, NULL, NULL);
+  return valet_redis_command
+    (context->redis, set_keys_cb, request, "SET", key, value, NULL)
+    ? VALET_KV_OK : VALET_KV_UNREACHABLE;
+}
+
+/**
+ * Set several keys in one round trip. `pairs` alternates keys and values.
+ */
+ValetKvStatus
+valet_set_keys (Context *context, gchar **pairs) {
+  KeyRequest *request;
+  GPtrArray *argv;
+  GArray *argvlen;
+  gboolean queued;
+  gsize length;
+  guint i;
+
+  if (NULL != context->store) {
+    for (i = 0; NULL != pairs[i] && NULL != pairs[i + 1]; i += 2) {
+      if (!valet_store_set (context->store, pairs[i], pairs[i + 1])) {
+        return VALET_KV_UNREACHABLE;
+      }
+    }
+    return VALET_KV_OK;
+  }
+  if (NULL == context->redis) {
+    return VALET_KV_NONE;
+  }
+
+  argv = g_ptr_array_new ();
+  argvlen = g_array_new (FALSE, FALSE, sizeof (gsize));
+  g_ptr_array_add (argv, "MSET");
+  length = 4;
+  g_array_append_val (argvlen, length);
+
+  for (i = 0; NULL != pairs[i] && NULL != pairs[i + 1]; i += 2) {
+    valet_cache_remove (context->kvstore, pairs[i]);
+    g_ptr_array_add (argv, pairs[i]);
+    length = strlen (pairs[i]);
+    g_array_append_val (argvlen, length);
+    g_ptr_array_add (argv, pairs[i + 1]);
+    length = strlen (pairs[i + 1]);
+    g_array_append_val (argvlen, length);
+  }
+
+  request = key_request_new (context, g_strdupv (pairs), NULL, NULL);
+  queued = valet_redis_command_argv
+    (context->redis, set_keys_cb, request, argv->len,
+     (const gchar **) argv->pdata, (const gsize *) argvlen->data);
+
+  g_ptr_array_free (argv, TRUE);
+  g_array_free (argvlen, TRUE);
+  return queued ? VALET_KV_OK : VALET_KV_UNREACHABLE;
+}
+
+static void
+get_keys_cb (redisReply *reply, gpointer data) {
+  KeyRequest *request = data;
+  Context *context = request->context;
+  redisReply *value;
+  ValetKvStatus status = VALET_KV_OK;
+  guint i;
+
+  if (NULL == reply || REDIS_REPLY_ARRAY != reply->type) {
+    status = VALET_KV_UNREACHABLE;
+  }
+  for (i = 0; NULL != request->keys[i]; i++) {
+    value = NULL;
+    if (VALET_KV_OK == status && i < reply->elements) {
+      value = reply->element[i];
+    }
+
+    if (NULL != value && REDIS_REPLY_STRING == value->type) {
+      if (key_request_fresh (request)) {
+        valet_cache_insert (context->kvstore, request->keys[i], value->str, 0);
+      }
+      request->func
+        (request->keys[i], value->str, status, request->user_data);
+    }
+    else {
+      request->func (request->keys[i], NULL, status, request->user_data);
+    }
+  }
+  request->func (NULL, NULL, status, request->user_data);
+  key_request_free (request);
+}
+
+/**
+ * Look up several keys in one round trip. `func` is called once per key, in
+ * order, with NULL for missing values, and finally once with a NULL key;
+ * every call has the same status.
+ *
+ * Reads are answered from the local kvstore when it is known to be coherent
+ * with redis and holds every key, and fill it otherwise.
+ */
+gboolean
+valet_get_keys (Context *context,
+                gchar **keys,
+                ValetValueFunc func,
+                gpointer user_data) {
+  KeyRequest *request;
+  GPtrArray *argv;
+  GArray *argvlen;
+  gsize length;
+  guint i;
+
+  if (NULL != context->store) {
+    for (i = 0; NULL != keys[i]; i++) {
+      func (keys[i], valet_store_get (context->store, keys[i]),
+            VALET_KV_OK, user_data);
+    }
+    func (NULL, NULL, VALET_KV_OK, user_data);
+    return TRUE;
+  }
+  if (NULL == context->redis) {
     return FALSE;
   }
-  redisAsyncCommand (context->redisCtx, set_key_cb, NULL,
-                     g_strdup_printf ("SET %s %s",
-                                      key,
-                                      value));
+
+  if (context->kvstore_coherent) {
+    for (i = 0; NULL != keys[i]; i++) {
+      if (NULL == valet_cache_lookup (context->kvstore, keys[i])) {
+        break;
+      }
+    }
+    if (NULL == keys[i]) {
+      for (i = 0; NULL != keys[i]; i++) {
+        func (keys[i], valet_cache_lookup (context->kvstore, keys[i]),
+              VALET_KV_OK, user_data);
+      }
+      func (NULL, NULL, VALET_KV_OK, user_data);
+      return TRUE;
+    }
+  }
+
+  request = key_request_new (context, g_strdupv (keys), func, user_data);
+
+  argv = g_ptr_array_new ();
+  argvlen = g_array_new (FALSE, FALSE, sizeof (gsize));
+  g_ptr_array_add (argv, "MGET");
+  length = 4;
+  g_array_append_val (argvlen, length);
+  for (i = 0; NULL != request->keys[i]; i++) {
+    g_ptr_array_add (argv, request->keys[i]);
+    length = strlen (request->keys[i]);
+    g_array_append_val (argvlen, length);
+  }
+
+  valet_redis_command_argv
+    (context->redis, get_keys_cb, request, argv->len,
+     (const gchar **) argv->pdata, (const gsize *) argvlen->data);
+
+  g_ptr_array_free (argv, TRUE);
+  g_array_free (argvlen, TRUE);
+  return TRUE;
+}
+
+static void
+get_key_cb (redisReply *reply, gpointer data) {
+  KeyRequest *request = data;
+  Context *context = request->context;
+  const gchar *value = NULL;
+  ValetKvStatus status = VALET_KV_OK;
+
+  if (NULL == reply || REDIS_REPLY_ERROR == reply->type) {
+    status = VALET_KV_UNREACHABLE;
+  }
+  else if (REDIS_REPLY_STRING == reply->type) {
+    value = reply->str;
+    if (key_request_fresh (request)) {
+      valet_cache_insert (context->kvstore, request->keys[0], value, 0);
+    }
+  }
+  request->func (request->keys[0], value, status, request->user_data);
+  key_request_free (request);
+}
+
+/**
+ * Look up a single key; `func` is called once, with NULL if it is missing
+ * or could not be had.
+ */
+gboolean
+valet_get_key (Context *context,
+               const gchar *key,
+               ValetValueFunc func,
+               gpointer user_data) {
+  KeyRequest *request;
+  const gchar *value;
+  gchar **keys;
+
+  if (NULL != context->store) {
+    func (key, valet_store_get (context->store, key), VALET_KV_OK, user_data);
+    return TRUE;
+  }
+  if (NULL == context->redis) {
+    return FALSE;
+  }
+
+  if (context->kvstore_coherent) {
+    value = valet_cache_lookup (context->kvstore, key);
+    if (NULL != value) {
+      func (key, value, VALET_KV_OK, user_data);
+      return TRUE;
+    }
+  }
+
+  keys = g_new0 (gchar *, 2);
+  keys[0] = g_strdup (key);
+  request = key_request_new (context, keys, func, user_data);
+  valet_redis_command
+    (context->redis, get_key_cb, request, "GET", key, NULL);
   return TRUE;
 }
 
+typedef struct {
+  Context *context;
+  gchar *match;
+  ValetKeysFunc func;
+  gpointer user_data;
+} ScanRequest;
+
+static void
+scan_cb (redisReply *reply, gpointer data) {
+  ScanRequest *request = data;
+  redisReply *keys;
+  gchar **batch;
+  gboolean done;
+  gsize i;
+
+  done = TRUE;
+  if (NULL != reply && REDIS_REPLY_ARRAY == reply->type
+      && 2 == reply->elements) {
+    keys = reply->element[1];
+    batch = g_new0 (gchar *, keys->elements + 1);
+    for (i = 0; i < keys->elements; i++) {
+      batch[i] = keys->element[i]->str;
+    }
+    done = 0 == g_strcmp0 (reply->element[0]->str, "0");
+    request->func ((const gchar **) batch, done, request->user_data);
+    g_free (batch);
+
+    if (!done) {
+      valet_redis_command
+        (request->context->redis, scan_cb, request,
+         "SCAN", reply->element[0]->str, "MATCH", request->match,
+         "COUNT", SCAN_BATCH_SIZE, NULL);
+      return;
+    }
+  }
+  else {
+    request->func (NULL, TRUE, request->user_data);
+  }
+
+  g_free (request->match);
+  g_free (request);
+}
+
+/**
+ * Stream every key starting with `prefix`. `func` is called once per SCAN
+ * batch; the last call has its `done` flag set.
+ */
 gboolean
-valet_get_key (Context *context, const gchar *key, gpointer user_data) {
-  if (NULL == context->redisCtx) {
+valet_scan_keys (Context *context,
+                 const gchar *prefix,
+                 ValetKeysFunc func,
+                 gpointer user_data) {
+  ScanRequest *request;
+  GString *match;
+  const gchar *c;
+  const gchar **keys;
+
+  if (NULL != context->store) {
+    keys = valet_store_keys (context->store, prefix);
+    func (keys, TRUE, user_data);
+    g_free (keys);
+    return TRUE;
+  }
+  if (NULL == context->redis) {
     return FALSE;
   }
 
-  redisAsyncCommand (context->redisCtx, get_key_cb, user_data,
-                     g_strdup_printf ("GET %s", key));
+  /* Escape glob characters so that the prefix is taken literally. */
+  match = g_string_new (NULL);
+  for (c = prefix; '\0' != *c; c++) {
+    if (NULL != strchr ("*?[]\\", *c)) {
+      g_string_append_c (match, '\\');
+    }
+    g_string_append_c (match, *c);
+  }
+  g_string_append_c (match, '*');
+
+  request = g_new0 (ScanRequest, 1);
+  request->context = context;
+  request->match = g_string_free (match, FALSE);
+  request->func = func;
+  request->user_data = user_data;
+  valet_redis_command
+    (context->redis, scan_cb, request,
+     "SCAN", "0", "MATCH", request->match, "COUNT", SCAN_BATCH_SIZE, NULL);
   return TRUE;
 }
@@ -0,0 +1,195 @@
+/***
+ * dispatch.c
+ * Routes incoming messages to builtins. Patterns are compiled once when a
+ * builtin is registered, so the per-message cost is one scan for the first
+ * token and one hash lookup. Only messages for a builtin are converted from
+ * markup to text here; the rest are left to the tokenizer.
+ */
+
+#include "dispatch.h"
+#include "outbox.h"
+#include "tokenize.h"
+
+/* Longest trigger we will bother copying onto the stack. */
+#define TRIGGER_MAX 32
+
+/* What ends a first word; markup may follow it directly. */
+#define WORD_END " \t\r\n<"
+
+typedef struct {
+  gchar *trigger;
+  gchar *usage;
+  GRegex *regex;
+  ValetBuiltinFunc func;
+} Builtin;
+
+struct _Dispatcher {
+  GHashTable *builtins; /* trigger -> Builtin */
+  gsize longest_trigger;
+};
+
+static void
+builtin_free (gpointer data) {
+  Builtin *builtin = data;
+  g_free (builtin->trigger);
+  g_free (builtin->usage);
+  g_regex_unref (builtin->regex);
+  g_free (builtin);
+}
+
+Dispatcher *
+valet_dispatcher_new (void) {
+  Dispatcher *dispatcher;
+
+  dispatcher = g_new0 (Dispatcher, 1);
+  dispatcher->builtins = g_hash_table_new_full
+    (g_str_hash, g_str_equal, NULL, builtin_free);
+  return dispatcher;
+}
+
+void
+valet_dispatcher_free (Dispatcher *dispatcher) {
+  g_hash_table_destroy (dispatcher->builtins);
+  g_free (dispatcher);
+}
+
+/**
+ * Register a builtin.
+ *
+ * `trigger` is either the exact first word of the message (eg "#set") or a
+ * scheme prefix ending in a colon (eg "geo:"). `pattern` is matched against
+ * the whole message and its match is handed to `func`; if it fails to match,
+ * `usage` (when given) is sent back instead.
+ */
+gboolean
+valet_dispatcher_register (Dispatcher *dispatcher,
+                           const gchar *trigger,
+                           const gchar *pattern,
+                           const gchar *usage,
+                           ValetBuiltinFunc func,
+                           GError **error) {
+  Builtin *builtin;
+  GRegex *regex;
+  gsize length;
+
+  length = strlen (trigger);
+  if (0 == length || length >= TRIGGER_MAX) {
+    g_set_error (error, G_REGEX_ERROR, G_REGEX_ERROR_COMPILE,
+                 "Invalid builtin trigger: %s", trigger);
+    return FALSE;
+  }
+
+  regex = g_regex_new (pattern, G_REGEX_OPTIMIZE | G_REGEX_DOTALL, 0, error);
+  if (NULL == regex) {
+    return FALSE;
+  }
+
+  builtin = g_new0 (Builtin, 1);
+  builtin->trigger = g_strdup (trigger);
+  builtin->usage = g_strdup (usage);
+  builtin->regex = regex;
+  builtin->func = func;
+
+  g_hash_table_replace (dispatcher->builtins, builtin->trigger, builtin);
+  dispatcher->longest_trigger = MAX (dispatcher->longest_trigger, length);
+  return TRUE;
+}
+
+/**
+ * Skip the tags a message may open with, eg Bonjour's <font>.
+ */
+static const gchar *
+skip_leading_tags (const gchar *message) {
+  const gchar *close;
+
+  while ('<' == *message && NULL != (close = strchr (message, '>'))) {
+    message = close + 1;
+  }
+  return message;
+}
+
+static Builtin *
+find_builtin (Dispatcher *dispatcher, const gchar *message) {
+  gchar trigger[TRIGGER_MAX];
+  Builtin *builtin;
+  gsize length;
+  const gchar *colon;
+
+  length = strcspn (message, WORD_END);
+  if (0 < length && length <= dispatcher->longest_trigger) {
+    memcpy (trigger, message, length);
+    trigger[length] = '\0';
+    builtin = g_hash_table_lookup (dispatcher->builtins, trigger);
+    if (NULL != builtin) {
+      return builtin;
+    }
+  }
+
+  /* Scheme prefixes such as "geo:" are followed directly by their payload. */
+  colon = memchr (message, ':', MIN (length, dispatcher->longest_trigger));
+  if (NULL == colon) {
+    return NULL;
+  }
+  length = colon - message + 1;
+  memcpy (trigger, message, length);
+  trigger[length] = '\0';
+  return g_hash_table_lookup (dispatcher->builtins, trigger);
+}
+
+/**
+ * Say what `markup` asks for without converting or matching it: the trigger
+ * of the builtin it addresses, in which case TRUE is returned, or else its
+ * first word as typed, which is normally the name of a command. `name` is
+ * set to either, and `length` to its length; a first word is not
+ * NUL-terminated.
+ */
+gboolean
+valet_dispatcher_command (Dispatcher *dispatcher,
+                          const gchar *markup,
+                          const gchar **name,
+                          gsize *length) {
+  Builtin *builtin;
+  const gchar *message;
+
+  message = skip_leading_tags (markup);
+  builtin = find_builtin (dispatcher, message);
+  if (NULL != builtin) {
+    *name = builtin->trigger;
+    *length = strlen (builtin->trigger);
+    return TRUE;
+  }
+  *name = message;
+  *length = strcspn (message, WORD_END);
+  return FALSE;
+}
+
+/**
+ * Run the builtin addressed by `markup`, a message as it was received, if
+ * there is one. Returns FALSE when the message should be treated as an
+ * external command.
+ */
+gboolean
+valet_dispatch (Dispatcher *dispatcher,
+                Context *context,
+                PurpleConvIm *im,
+                const gchar *markup) {
+  Builtin *builtin;
+  GMatchInfo *match_info;
+  gchar *message;
+
+  builtin = find_builtin (dispatcher, skip_leading_tags (markup));
+  if (NULL == builtin) {
+    return FALSE;
+  }
+
+  message = valet_markup_strip (markup, strlen (markup));
+  if (g_regex_match (builtin->regex, message, 0, &match_info)) {
+    builtin->func (context, im, match_info);
+  }
+  else if (NULL != builtin->usage) {
+    valet_send (im, builtin->usage, VALET_SEND_INTERACTIVE);
+  }
+  g_match_info_free (match_info);
+  g_free (message);
+  return TRUE;
+}
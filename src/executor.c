@@ -0,0 +1,656 @@
+/***
+ * executor.c
+ * Starts command processes. By default this is g_spawn_async_with_pipes, but
+ * valet can instead fork a small "zygote" helper at startup, before libpurple
+ * has grown the process image, and ask it to spawn commands on our behalf.
+ *
+ * The zygote talks to us over two SOCK_SEQPACKET socket pairs: one carries
+ * spawn requests and their replies (with the child's pipes attached as
+ * SCM_RIGHTS), the other carries exit statuses, since the zygote rather than
+ * valet is the parent of every command it spawns.
+ */
+
+#define _GNU_SOURCE /* prlimit */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <poll.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "executor.h"
+
+/* Requests larger than this are spawned directly instead. */
+#define ZYGOTE_REQUEST_MAX 65536
+
+/* How long we wait for the zygote to answer a spawn request. */
+#define ZYGOTE_REPLY_TIMEOUT_SEC 2
+
+/* Reported for children whose zygote died before telling us how they exited */
+#define ZYGOTE_LOST_STATUS -1
+
+extern char **environ;
+
+/* Leads every spawn request; 0 leaves a limit alone. */
+typedef struct {
+  guint64 cpu;
+  guint64 address_space;
+  guint64 nofile;
+} SpawnLimits;
+
+typedef struct {
+  gint32 pid;
+  gint32 error; /* errno from posix_spawn, or 0 */
+} SpawnReply;
+
+typedef struct {
+  gint32 pid;
+  gint32 status;
+} ExitEvent;
+
+typedef enum {
+  ZYGOTE_OK,
+  ZYGOTE_SPAWN_FAILED,
+  ZYGOTE_UNAVAILABLE
+} ZygoteResult;
+
+static GPid zygote_pid = -1;
+static int control_fd = -1; /* Requests out, replies in */
+static int events_fd = -1; /* Exit statuses in */
+
+/*** The zygote itself. Everything up to `valet_executor_start` runs in the
+     helper process and sticks to plain libc. ***/
+
+static int sigchld_pipe[2] = { -1, -1 };
+
+static void
+set_cloexec (int fd) {
+  fcntl (fd, F_SETFD, fcntl (fd, F_GETFD) | FD_CLOEXEC);
+}
+
+static void
+zygote_sigchld (int signum) {
+  int saved_errno = errno;
+  ssize_t written G_GNUC_UNUSED;
+
+  written = write (sigchld_pipe[1], "", 1);
+  errno = saved_errno;
+}
+
+/**
+ * Drop every descriptor the zygote inherited from valet (the Redis socket,
+ * for instance) except the ones it talks to us over.
+ */
+static void
+zygote_close_inherited (int control, int events) {
+  DIR *dir;
+  struct dirent *entry;
+  int fd;
+
+  dir = opendir ("/proc/self/fd");
+  if (NULL == dir) {
+    for (fd = 3; fd < 1024; fd++) {
+      if (fd != control && fd != events) {
+        close (fd);
+      }
+    }
+    return;
+  }
+
+  while (NULL != (entry = readdir (dir))) {
+    fd = atoi (entry->d_name);
+    if (fd > 2 && fd != control && fd != events && fd != dirfd (dir)) {
+      close (fd);
+    }
+  }
+  closedir (dir);
+}
+
+static void
+zygote_send_reply (int control, SpawnReply *reply, int *fds, int nfds) {
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE (3 * sizeof (int))];
+  } cmsg_buf;
+
+  memset (&msg, 0, sizeof (msg));
+  memset (&cmsg_buf, 0, sizeof (cmsg_buf));
+  iov.iov_base = reply;
+  iov.iov_len = sizeof (SpawnReply);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  if (nfds > 0) {
+    msg.msg_control = cmsg_buf.buf;
+    msg.msg_controllen = CMSG_SPACE (nfds * sizeof (int));
+    cmsg = CMSG_FIRSTHDR (&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN (nfds * sizeof (int));
+    memcpy (CMSG_DATA (cmsg), fds, nfds * sizeof (int));
+  }
+
+  while (sendmsg (control, &msg, MSG_NOSIGNAL) < 0 && EINTR == errno);
+}
+
+#ifdef __linux__
+static void
+zygote_limit (pid_t pid, int resource, guint64 value) {
+  struct rlimit limit;
+
+  if (0 != value) {
+    limit.rlim_cur = value;
+    limit.rlim_max = value;
+    prlimit (pid, resource, &limit, NULL);
+  }
+}
+#endif
+
+/**
+ * posix_spawn has no hook to run in the child, so limits are put on the
+ * child from outside as soon as it exists. It may run briefly unconfined.
+ */
+static void
+zygote_confine (pid_t pid, const SpawnLimits *limits, const char *procs) {
+  char buffer[32];
+  int fd, length;
+
+#ifdef __linux__
+  zygote_limit (pid, RLIMIT_CPU, limits->cpu);
+  zygote_limit (pid, RLIMIT_AS, limits->address_space);
+  zygote_limit (pid, RLIMIT_NOFILE, limits->nofile);
+#endif
+
+  if ('\0' != procs[0] && -1 != (fd = open (procs, O_WRONLY | O_CLOEXEC))) {
+    length = snprintf (buffer, sizeof (buffer), "%d", (int) pid);
+    if (write (fd, buffer, length) < 0) {
+      /* The child simply stays in the zygote's cgroup. */
+    }
+    close (fd);
+  }
+}
+
+/**
+ * A request is a SpawnLimits, then the cgroup.procs file to join (possibly
+ * empty), the working directory and the argument vector, each string
+ * terminated by a NUL byte.
+ */
+static void
+zygote_spawn (int control, char *request, size_t length) {
+  SpawnReply reply = { -1, 0 };
+  SpawnLimits limits;
+  char *procs;
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t defaults, empty;
+  char **argv;
+  size_t i, argc;
+  char *cursor;
+  int in[2] = { -1, -1 }, out[2] = { -1, -1 }, err[2] = { -1, -1 };
+  int fds[3];
+  int home = -1;
+  pid_t pid;
+
+  if (length < sizeof (limits)) {
+    reply.error = EINVAL;
+    zygote_send_reply (control, &reply, NULL, 0);
+    return;
+  }
+  memcpy (&limits, request, sizeof (limits));
+  request += sizeof (limits);
+  length -= sizeof (limits);
+
+  argc = 0;
+  for (i = 0; i < length; i++) {
+    argc += ('\0' == request[i]);
+  }
+  if (argc < 3 || '\0' != request[length - 1]) {
+    reply.error = EINVAL;
+    zygote_send_reply (control, &reply, NULL, 0);
+    return;
+  }
+
+  /* Then the working directory, and only then the arguments. */
+  procs = request;
+  request += strlen (request) + 1;
+  argc--;
+  argv = calloc (argc, sizeof (char *));
+  cursor = request + strlen (request) + 1;
+  for (i = 0; i < argc - 1; i++) {
+    argv[i] = cursor;
+    cursor += strlen (cursor) + 1;
+  }
+
+  /* The child inherits our directory; we go back to ours once it has. */
+  if ('\0' != request[0]
+      && ((home = open (".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0
+          || chdir (request) < 0)) {
+    reply.error = errno;
+    goto out;
+  }
+  if (pipe (in) < 0 || pipe (out) < 0 || pipe (err) < 0) {
+    reply.error = errno;
+    goto out;
+  }
+  for (i = 0; i < 2; i++) {
+    set_cloexec (in[i]);
+    set_cloexec (out[i]);
+    set_cloexec (err[i]);
+  }
+
+  posix_spawn_file_actions_init (&actions);
+  posix_spawn_file_actions_adddup2 (&actions, in[0], STDIN_FILENO);
+  posix_spawn_file_actions_adddup2 (&actions, out[1], STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2 (&actions, err[1], STDERR_FILENO);
+
+  /* Children should not inherit the dispositions valet and the zygote use. */
+  sigemptyset (&empty);
+  sigemptyset (&defaults);
+  sigaddset (&defaults, SIGCHLD);
+  sigaddset (&defaults, SIGINT);
+  sigaddset (&defaults, SIGHUP);
+  sigaddset (&defaults, SIGPIPE);
+  posix_spawnattr_init (&attr);
+  posix_spawnattr_setsigdefault (&attr, &defaults);
+  posix_spawnattr_setsigmask (&attr, &empty);
+  /* A process group of its own, so a timeout can take out its children. */
+  posix_spawnattr_setpgroup (&attr, 0);
+  posix_spawnattr_setflags
+    (&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK
+     | POSIX_SPAWN_SETPGROUP);
+
+  reply.error = posix_spawn (&pid, argv[0], &actions, &attr, argv, environ);
+  posix_spawn_file_actions_destroy (&actions);
+  posix_spawnattr_destroy (&attr);
+  if (0 == reply.error) {
+    reply.pid = pid;
+    zygote_confine (pid, &limits, procs);
+  }
+
+ out:
+  free (argv);
+  if (-1 != home) {
+    if (fchdir (home) < 0) {
+      /* Later relative working directories will fail to resolve. */
+    }
+    close (home);
+  }
+  if (-1 != in[0]) close (in[0]);
+  if (-1 != out[1]) close (out[1]);
+  if (-1 != err[1]) close (err[1]);
+
+  if (0 == reply.error) {
+    fds[0] = in[1];
+    fds[1] = out[0];
+    fds[2] = err[0];
+    zygote_send_reply (control, &reply, fds, 3);
+  }
+  else {
+    zygote_send_reply (control, &reply, NULL, 0);
+  }
+
+  if (-1 != in[1]) close (in[1]);
+  if (-1 != out[0]) close (out[0]);
+  if (-1 != err[0]) close (err[0]);
+}
+
+static void
+zygote_reap (int events) {
+  ExitEvent event;
+  pid_t pid;
+  int status;
+
+  while ((pid = waitpid (-1, &status, WNOHANG)) > 0) {
+    event.pid = pid;
+    event.status = status;
+    while (send (events, &event, sizeof (event), MSG_NOSIGNAL) < 0
+           && EINTR == errno);
+  }
+}
+
+static void
+zygote_main (int control, int events) {
+  struct sigaction action;
+  struct pollfd fds[2];
+  char *request;
+  ssize_t length;
+  char drain[64];
+
+  /* valet decides when we go away: we exit once our sockets close. */
+  signal (SIGINT, SIG_IGN);
+  signal (SIGHUP, SIG_IGN);
+  signal (SIGPIPE, SIG_IGN);
+
+  zygote_close_inherited (control, events);
+
+  if (pipe (sigchld_pipe) < 0) {
+    _exit (1);
+  }
+  set_cloexec (sigchld_pipe[0]);
+  set_cloexec (sigchld_pipe[1]);
+  fcntl (sigchld_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl (sigchld_pipe[1], F_SETFL, O_NONBLOCK);
+
+  memset (&action, 0, sizeof (action));
+  action.sa_handler = zygote_sigchld;
+  action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigaction (SIGCHLD, &action, NULL);
+
+  request = malloc (ZYGOTE_REQUEST_MAX);
+  fds[0].fd = control;
+  fds[0].events = POLLIN;
+  fds[1].fd = sigchld_pipe[0];
+  fds[1].events = POLLIN;
+
+  for (;;) {
+    if (poll (fds, 2, -1) < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      _exit (1);
+    }
+
+    if (fds[1].revents & POLLIN) {
+      while (read (sigchld_pipe[0], drain, sizeof (drain)) > 0);
+      zygote_reap (events);
+    }
+
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      length = recv (control, request, ZYGOTE_REQUEST_MAX, 0);
+      if (length < 0 && EINTR == errno) {
+        continue;
+      }
+      if (length <= 0) {
+        _exit (0);
+      }
+      zygote_spawn (control, request, length);
+    }
+  }
+}
+
+/*** Valet's side of the conversation. ***/
+
+/**
+ * The zygote is gone: stop using it and settle up with anyone still waiting
+ * on one of its children.
+ */
+static void
+zygote_lost (void) {
+  g_warning ("Zygote executor exited; spawning commands directly.");
+  close (control_fd);
+  close (events_fd);
+  control_fd = -1;
+  events_fd = -1;
+  zygote_pid = -1;
+  valet_children_lost (ZYGOTE_LOST_STATUS);
+}
+
+static gboolean
+zygote_event (GIOChannel *channel, GIOCondition cond, gpointer data) {
+  ExitEvent event;
+  ssize_t length;
+
+  length = recv (events_fd, &event, sizeof (event), MSG_DONTWAIT);
+  if (sizeof (event) == length) {
+    valet_child_exited (event.pid, event.status);
+    return TRUE;
+  }
+  if (length < 0 && (EINTR == errno || EAGAIN == errno)) {
+    return TRUE;
+  }
+
+  zygote_lost ();
+  return FALSE;
+}
+
+/**
+ * Start the executor. In zygote mode this forks the helper, so it must be
+ * called before libpurple is initialized.
+ */
+gboolean
+valet_executor_start (ValetExecutorMode mode) {
+  GIOChannel *channel;
+  struct timeval timeout = { ZYGOTE_REPLY_TIMEOUT_SEC, 0 };
+  int control[2], events[2];
+
+  valet_children_start ();
+  if (VALET_EXECUTOR_ZYGOTE != mode) {
+    return TRUE;
+  }
+
+  if (socketpair (AF_UNIX, SOCK_SEQPACKET, 0, control) < 0) {
+    g_warning ("Could not create zygote socket: %s", g_strerror (errno));
+    return FALSE;
+  }
+  if (socketpair (AF_UNIX, SOCK_SEQPACKET, 0, events) < 0) {
+    g_warning ("Could not create zygote socket: %s", g_strerror (errno));
+    close (control[0]);
+    close (control[1]);
+    return FALSE;
+  }
+  set_cloexec (control[0]);
+  set_cloexec (control[1]);
+  set_cloexec (events[0]);
+  set_cloexec (events[1]);
+
+  zygote_pid = fork ();
+  if (zygote_pid < 0) {
+    g_warning ("Could not fork zygote: %s", g_strerror (errno));
+    close (control[0]);
+    close (control[1]);
+    close (events[0]);
+    close (events[1]);
+    zygote_pid = -1;
+    return FALSE;
+  }
+
+  if (0 == zygote_pid) {
+    close (control[0]);
+    close (events[0]);
+    zygote_main (control[1], events[1]);
+    _exit (0);
+  }
+
+  close (control[1]);
+  close (events[1]);
+  control_fd = control[0];
+  events_fd = events[0];
+  setsockopt (control_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+
+  channel = g_io_channel_unix_new (events_fd);
+  g_io_add_watch (channel, G_IO_IN | G_IO_HUP | G_IO_ERR, zygote_event, NULL);
+  g_io_channel_unref (channel);
+
+  g_message ("Started zygote executor (pid %d)", zygote_pid);
+  return TRUE;
+}
+
+static ZygoteResult
+zygote_spawn_request (const gchar *working_dir,
+                      gchar **argv,
+                      const ValetLimits *limits,
+                      const gchar *procs,
+                      GPid *pid,
+                      gint *child_stdin,
+                      gint *child_stdout,
+                      gint *child_stderr,
+                      GError **error) {
+  GString *request;
+  SpawnReply reply;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE (3 * sizeof (int))];
+  } cmsg_buf;
+  int fds[3];
+  ssize_t length;
+  gchar **arg;
+  SpawnLimits header;
+
+  header.cpu = limits->cpu;
+  header.address_space = limits->address_space;
+  header.nofile = limits->nofile;
+
+  request = g_string_new (NULL);
+  g_string_append_len (request, (const gchar *) &header, sizeof (header));
+  g_string_append_len
+    (request, procs ? procs : "", (procs ? strlen (procs) : 0) + 1);
+  g_string_append_len
+    (request, working_dir ? working_dir : "",
+     (working_dir ? strlen (working_dir) : 0) + 1);
+  for (arg = argv; NULL != *arg; arg++) {
+    g_string_append_len (request, *arg, strlen (*arg) + 1);
+  }
+
+  if (request->len > ZYGOTE_REQUEST_MAX) {
+    g_string_free (request, TRUE);
+    return ZYGOTE_UNAVAILABLE;
+  }
+
+  length = send (control_fd, request->str, request->len, MSG_NOSIGNAL);
+  g_string_free (request, TRUE);
+  if (length < 0) {
+    return ZYGOTE_UNAVAILABLE;
+  }
+
+  memset (&msg, 0, sizeof (msg));
+  memset (&cmsg_buf, 0, sizeof (cmsg_buf));
+  iov.iov_base = &reply;
+  iov.iov_len = sizeof (reply);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsg_buf.buf;
+  msg.msg_controllen = sizeof (cmsg_buf.buf);
+
+  do {
+    length = recvmsg (control_fd, &msg, MSG_CMSG_CLOEXEC);
+  } while (length < 0 && EINTR == errno);
+
+  if (sizeof (reply) != length) {
+    /* A late reply would leave us out of step; give up on the zygote. */
+    kill (zygote_pid, SIGKILL);
+    return ZYGOTE_UNAVAILABLE;
+  }
+
+  if (0 != reply.error) {
+    g_set_error (error, G_SPAWN_ERROR, G_SPAWN_ERROR_FAILED,
+                 "Failed to execute child process \"%s\" (%s)",
+                 argv[0], g_strerror (reply.error));
+    return ZYGOTE_SPAWN_FAILED;
+  }
+
+  cmsg = CMSG_FIRSTHDR (&msg);
+  if (NULL == cmsg || SCM_RIGHTS != cmsg->cmsg_type
+      || CMSG_LEN (3 * sizeof (int)) != cmsg->cmsg_len) {
+    g_set_error (error, G_SPAWN_ERROR, G_SPAWN_ERROR_FAILED,
+                 "Zygote did not pass back the pipes for \"%s\"", argv[0]);
+    return ZYGOTE_SPAWN_FAILED;
+  }
+  memcpy (fds, CMSG_DATA (cmsg), sizeof (fds));
+
+  *pid = reply.pid;
+  *child_stdin = fds[0];
+  *child_stdout = fds[1];
+  *child_stderr = fds[2];
+  return ZYGOTE_OK;
+}
+
+typedef struct {
+  const ValetLimits *limits;
+  const gchar *procs;
+} ChildSetup;
+
+/**
+ * Runs in the forked child before exec, so only async-signal-safe calls.
+ */
+static void
+child_setup (gpointer data) {
+  ChildSetup *setup = data;
+  ssize_t written G_GNUC_UNUSED;
+  int fd;
+
+  /* A process group of its own, so a timeout can take out its children. */
+  setpgid (0, 0);
+  valet_limits_apply (setup->limits);
+  if (NULL != setup->procs
+      && -1 != (fd = open (setup->procs, O_WRONLY | O_CLOEXEC))) {
+    /* "0" moves the writer, ie this child, into the cgroup. */
+    written = write (fd, "0", 1);
+    close (fd);
+  }
+}
+
+/**
+ * Spawn a command with pipes for its standard streams, through the zygote if
+ * one is running and with GLib otherwise. The child gets the rlimits in
+ * `limits`, its own process group and, if `cgroup` is not NULL, is moved
+ * into that cgroup.
+ */
+gboolean
+valet_executor_spawn (const gchar *working_dir,
+                      gchar **argv,
+                      const ValetLimits *limits,
+                      const gchar *cgroup,
+                      GPid *pid,
+                      gint *child_stdin,
+                      gint *child_stdout,
+                      gint *child_stderr,
+                      GError **error) {
+  ChildSetup setup;
+  gchar *procs;
+  gboolean ok;
+
+  procs = NULL == cgroup
+    ? NULL : g_build_filename (cgroup, "cgroup.procs", NULL);
+
+  if (-1 != control_fd) {
+    switch (zygote_spawn_request (working_dir, argv, limits, procs, pid,
+                                  child_stdin, child_stdout, child_stderr,
+                                  error)) {
+    case ZYGOTE_OK:
+      valet_child_track (*pid, FALSE);
+      g_free (procs);
+      return TRUE;
+
+    case ZYGOTE_SPAWN_FAILED:
+      g_free (procs);
+      return FALSE;
+
+    case ZYGOTE_UNAVAILABLE:
+      break;
+    }
+  }
+
+  setup.limits = limits;
+  setup.procs = procs;
+  ok = g_spawn_async_with_pipes
+    ( working_dir,
+      argv,
+      NULL,
+      G_SPAWN_DO_NOT_REAP_CHILD,
+      child_setup, &setup,
+      pid,
+      child_stdin,
+      child_stdout,
+      child_stderr,
+      error );
+  g_free (procs);
+  if (ok) {
+    valet_child_track (*pid, TRUE);
+  }
+  return ok;
+}
@@ -0,0 +1,233 @@
+/***
+ * index.c
+ * Keeps track of which commands exist so that we only fork for real ones.
+ */
+
+#include <errno.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "index.h"
+
+#define SIDECAR_SUFFIX ".meta"
+
+struct _CommandIndex {
+  gchar *dir; /* Absolute path of the commands directory */
+  GHashTable *entries; /* name -> CommandEntry */
+  int inotify_fd;
+  guint watch;
+};
+
+static void
+entry_free (gpointer data) {
+  CommandEntry *entry = data;
+  g_free (entry->name);
+  g_free (entry->path);
+  g_free (entry);
+}
+
+/**
+ * Read the optional sidecar for `entry`.
+ */
+static void
+entry_load_meta (CommandIndex *index, CommandEntry *entry) {
+  GKeyFile *keyfile;
+  gchar *filename, *path;
+  gint ttl;
+
+  filename = g_strconcat (entry->name, SIDECAR_SUFFIX, NULL);
+  path = g_build_filename (index->dir, filename, NULL);
+  keyfile = g_key_file_new ();
+
+  if (g_key_file_load_from_file (keyfile, path, G_KEY_FILE_NONE, NULL)) {
+    ttl = g_key_file_get_integer (keyfile, "command", "cache_ttl", NULL);
+    entry->cache_ttl = ttl > 0 ? ttl : 0;
+    entry->takes_input = g_key_file_get_boolean
+      (keyfile, "command", "stdin", NULL);
+    entry->dedup = g_key_file_get_boolean
+      (keyfile, "command", "dedup", NULL);
+    valet_limits_load (&entry->limits, keyfile, "command");
+  }
+
+  g_key_file_free (keyfile);
+  g_free (path);
+  g_free (filename);
+}
+
+/**
+ * Bring the entry for `name` in line with what is on disk.
+ */
+static void
+index_refresh (CommandIndex *index, const gchar *name) {
+  CommandEntry *entry;
+  gchar *path;
+
+  g_hash_table_remove (index->entries, name);
+
+  if ('.' == name[0] || g_str_has_suffix (name, SIDECAR_SUFFIX)) {
+    return;
+  }
+
+  path = g_build_filename (index->dir, name, NULL);
+  if (!g_file_test (path, G_FILE_TEST_IS_REGULAR)
+      || !g_file_test (path, G_FILE_TEST_IS_EXECUTABLE)) {
+    g_free (path);
+    return;
+  }
+
+  entry = g_new0 (CommandEntry, 1);
+  entry->name = g_strdup (name);
+  entry->path = path;
+  valet_limits_inherit (&entry->limits);
+  entry_load_meta (index, entry);
+  g_hash_table_insert (index->entries, entry->name, entry);
+}
+
+static void
+index_scan (CommandIndex *index) {
+  GDir *dir;
+  GError *error = NULL;
+  const gchar *name;
+
+  g_hash_table_remove_all (index->entries);
+
+  dir = g_dir_open (index->dir, 0, &error);
+  if (NULL == dir) {
+    g_warning ("Cannot read commands directory: %s", error->message);
+    g_error_free (error);
+    return;
+  }
+
+  while (NULL != (name = g_dir_read_name (dir))) {
+    index_refresh (index, name);
+  }
+  g_dir_close (dir);
+
+  g_message ("Indexed %u commands in %s",
+             g_hash_table_size (index->entries), index->dir);
+}
+
+#ifdef __linux__
+static gboolean
+index_inotify (GIOChannel *channel, GIOCondition cond, gpointer data) {
+  CommandIndex *index = data;
+  char buffer[4096]
+    __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+  const struct inotify_event *event;
+  gchar *stem;
+  ssize_t length;
+  char *cursor;
+
+  for (;;) {
+    length = read (index->inotify_fd, buffer, sizeof (buffer));
+    if (length < 0 && EINTR == errno) {
+      continue;
+    }
+    if (length <= 0) {
+      break;
+    }
+
+    for (cursor = buffer; cursor < buffer + length;
+         cursor += sizeof (struct inotify_event) + event->len) {
+      event = (const struct inotify_event *) cursor;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        index_scan (index);
+      }
+      else if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        g_warning ("Commands directory %s went away.", index->dir);
+        g_hash_table_remove_all (index->entries);
+      }
+      else if (event->len > 0) {
+        if (g_str_has_suffix (event->name, SIDECAR_SUFFIX)) {
+          /* The sidecar changed; reload the command it describes. */
+          stem = g_strndup
+            (event->name, strlen (event->name) - strlen (SIDECAR_SUFFIX));
+          index_refresh (index, stem);
+          g_free (stem);
+        }
+        else {
+          index_refresh (index, event->name);
+        }
+      }
+    }
+  }
+
+  return TRUE;
+}
+
+static void
+index_watch (CommandIndex *index) {
+  GIOChannel *channel;
+
+  index->inotify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  if (index->inotify_fd < 0) {
+    g_warning ("inotify unavailable (%s); new commands need a restart.",
+               g_strerror (errno));
+    return;
+  }
+
+  if (inotify_add_watch
+      (index->inotify_fd, index->dir,
+       IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB
+       | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+    g_warning ("Cannot watch %s (%s); new commands need a restart.",
+               index->dir, g_strerror (errno));
+    close (index->inotify_fd);
+    index->inotify_fd = -1;
+    return;
+  }
+
+  channel = g_io_channel_unix_new (index->inotify_fd);
+  index->watch = g_io_add_watch (channel, G_IO_IN, index_inotify, index);
+  g_io_channel_unref (channel);
+}
+#endif
+
+CommandIndex *
+valet_index_new (const gchar *dir) {
+  CommandIndex *index;
+  gchar *cwd;
+
+  index = g_new0 (CommandIndex, 1);
+  if (g_path_is_absolute (dir)) {
+    index->dir = g_strdup (dir);
+  }
+  else {
+    cwd = g_get_current_dir ();
+    index->dir = g_build_filename (cwd, dir, NULL);
+    g_free (cwd);
+  }
+  index->entries = g_hash_table_new_full
+    (g_str_hash, g_str_equal, NULL, entry_free);
+  index->inotify_fd = -1;
+
+  index_scan (index);
+#ifdef __linux__
+  index_watch (index);
+#endif
+  return index;
+}
+
+void
+valet_index_free (CommandIndex *index) {
+  if (0 != index->watch) {
+    g_source_remove (index->watch);
+  }
+  if (-1 != index->inotify_fd) {
+    close (index->inotify_fd);
+  }
+  g_hash_table_destroy (index->entries);
+  g_free (index->dir);
+  g_free (index);
+}
+
+/**
+ * Find the command called `name`, or NULL if there is no such executable.
+ */
+const CommandEntry *
+valet_index_lookup (CommandIndex *index, const gchar *name) {
+  return g_hash_table_lookup (index->entries, name);
+}
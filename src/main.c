@@ -1,15 +1,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
-
-#include <adapters/glib.h>
+#include <glib-unix.h>
 
 #include "defines.h"
 #include "context.h"
 #include "chat.h"
+#include "response.h"
+#include "executor.h"
+#include "metrics.h"
+#include "supervisor.h"
 
 /* Global values! */
 char *config_path;
+gint worker_index = -1;
 GMainLoop *loop;
 
 static void
@@ -20,22 +24,42 @@ handle_term (int signum) {
   }
 }
 
-static void
-redis_connect_cb (const redisAsyncContext *ac G_GNUC_UNUSED,
-                  int status) {
-  if (REDIS_OK != status) {
-    g_debug ("Failed to connect to redis: %s", ac->errstr);
+/**
+ * Read the configuration file again on SIGHUP and take on whatever can
+ * change without signing out: see valet_context_reload. The accounts are
+ * only touched if the credentials changed.
+ */
+static gboolean
+handle_hup (gpointer data) {
+  Context *context = data;
+  Context *fresh;
+  GError *error = NULL;
+
+  fresh = get_context (config_path, &error);
+  if (NULL == fresh) {
+    g_warning ("Not reloading %s: %s", config_path, error->message);
+    g_error_free (error);
+    return TRUE;
   }
-  else {
-    g_message ("Redis connected");
+  if (worker_index >= 0) {
+    valet_worker_configure (fresh, config_path, worker_index);
   }
+
+  valet_chat_set_credentials (context, fresh->username, fresh->password);
+  valet_context_reload (context, fresh);
+  g_message ("Reloaded %s", config_path);
+  return TRUE;
 }
 
 /* Acceptable command line options */
 GOptionEntry options[] = {
     { "config", 'c', 0,
       G_OPTION_ARG_STRING, &config_path,
-      "Location of configuration file", NULL }
+      "Location of configuration file", NULL },
+    { "worker", 0, G_OPTION_FLAG_HIDDEN,
+      G_OPTION_ARG_INT, &worker_index,
+      "Run as the given worker of a supervisor", NULL },
+    { NULL }
 };
 
 int
@@ -44,7 +68,6 @@ main (int argc, char *argv[]) {
   Context *valet_context;
   GError *error;
   GOptionContext *context;
-  GSource *source = NULL;
   struct sigaction action;
 
   loop = g_main_loop_new (gmc, FALSE);
@@ -55,12 +78,13 @@ main (int argc, char *argv[]) {
   error = NULL;
 
 #ifndef _WIN32
-  /* libpurple's built-in DNS resolution forks processes to perform
-   * blocking lookups without blocking the main process.  It does not
-   * handle SIGCHLD itself, so if the UI does not you quickly get an army
-   * of zombie subprocesses marching around.
-   */
-  signal (SIGCHLD, SIG_IGN);
+  /* SIGCHLD is left alone: ignoring it would have the kernel reap commands
+   * before we learn how they exited. The zombies libpurple's DNS helpers
+   * leave behind are swept up by the executor instead; see children.c. */
+
+  /* Commands may exit before reading all of their input; writing the rest
+   * should fail with EPIPE rather than kill us. */
+  signal (SIGPIPE, SIG_IGN);
 #endif
 
   /* Parse options */
@@ -78,16 +102,39 @@ main (int argc, char *argv[]) {
 
   valet_context = get_context (config_path, &error);
   if (NULL == valet_context) {
-    g_error ("Error: cannot find configuration file.\n");
+    g_error ("Error: cannot read configuration file: %s\n", error->message);
+  }
+
+  if (worker_index >= 0) {
+    valet_worker_configure (valet_context, config_path, worker_index);
+  }
+  else if (valet_context->workers > 1) {
+    /* The supervisor leaves everything else to its workers. */
+    return valet_supervise (valet_context, argv[0], config_path, loop);
+  }
+
+  /* The zygote must be forked while the process image is still small. */
+  if (!valet_executor_start (valet_context->executor)) {
+    g_warning ("Falling back to spawning commands directly.");
+  }
+
+  valet_kvstore_connect (valet_context);
+
+  initialize_responses (valet_context);
+
+  if (!valet_metrics_listen
+      (valet_context->metrics_socket, valet_context->metrics_port, &error)) {
+    g_warning ("Metrics unavailable: %s", error->message);
+    g_error_free (error);
+    error = NULL;
   }
 
-  if (NULL != valet_context->redisCtx) {
-    source = redis_source_new (valet_context->redisCtx);
-    redisAsyncSetConnectCallback (valet_context->redisCtx, redis_connect_cb);
-    g_source_attach (source, gmc);
+  if (worker_index >= 0) {
+    valet_worker_heartbeat (valet_context);
   }
 
   initialize_libpurple (valet_context);
+  g_unix_signal_add (SIGHUP, handle_hup, valet_context);
 
   g_main_loop_run (loop);
   purple_plugins_save_loaded (PLUGIN_SAVE_PREF);
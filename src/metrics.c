@@ -0,0 +1,515 @@
+/***
+ * metrics.c
+ * Counters, gauges and fixed-bucket histograms describing where valet spends
+ * its time, served in the Prometheus text format from the main loop.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "metrics.h"
+
+#define MAX_BUCKETS 16
+
+/* Requests are not parsed, only read up to the end of their headers. */
+#define REQUEST_MAX 8192
+
+typedef struct {
+  const gchar *name;
+  const gchar *help;
+  gdouble scale; /* Divides recorded values on export */
+  guint64 bounds[MAX_BUCKETS]; /* Upper bounds, ascending; 0 ends the list */
+} HistogramSpec;
+
+static const HistogramSpec histogram_specs[VALET_N_HISTOGRAMS] = {
+  { "valet_command_reply_latency_seconds",
+    "Time from receiving a message to sending its first reply.",
+    G_USEC_PER_SEC,
+    { 1000, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+      1000000, 2500000, 5000000, 10000000, 30000000, 60000000 } },
+  { "valet_command_spawn_latency_seconds",
+    "Time taken to start a command process.",
+    G_USEC_PER_SEC,
+    { 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+      100000, 250000, 1000000 } },
+  { "valet_command_runtime_seconds",
+    "Time from a command process starting to its exit.",
+    G_USEC_PER_SEC,
+    { 1000, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+      1000000, 2500000, 5000000, 10000000, 30000000, 60000000 } },
+  { "valet_command_output_bytes",
+    "Bytes of output produced by a command.",
+    1,
+    { 64, 256, 1024, 4096, 16384, 65536, 262144, 1048576 } },
+  { "valet_command_output_lines",
+    "Lines of output produced by a command.",
+    1,
+    { 1, 2, 5, 10, 25, 50, 100, 250, 1000 } }
+};
+
+static const gchar *counter_names[VALET_N_COUNTERS][2] = {
+  { "valet_messages_received_total", "Messages received from buddies." },
+  { "valet_messages_sent_total", "Messages sent to buddies." },
+  { "valet_commands_killed_total",
+    "Commands stopped for running past their timeout." },
+  { "valet_worker_restarts_total", "Worker processes that had to restart." },
+  { "valet_messages_denied_total", "Messages refused by the ACL." },
+  { "valet_commands_shared_total",
+    "Requests answered by joining an identical running command." },
+  { "valet_outbox_dropped_total",
+    "Messages dropped because their conversation's queue was full." }
+};
+
+/**
+ * Buckets hold plain (non-cumulative) counts and are bumped atomically, so
+ * recording never takes a lock; the cumulative view is built when rendering.
+ */
+typedef struct {
+  guint buckets[MAX_BUCKETS + 1]; /* The last one is +Inf */
+  gsize sum;
+  guint count;
+} Histogram;
+
+typedef struct {
+  gchar *name;
+  gchar *label; /* The name, escaped for use as a label value */
+  Histogram histograms[VALET_N_HISTOGRAMS];
+  GHashTable *exits; /* exit status -> guint * */
+} CommandMetrics;
+
+typedef struct {
+  gchar *name;
+  gchar *help;
+  ValetGaugeFunc func;
+  gpointer data;
+} Gauge;
+
+typedef struct {
+  int fd;
+  GString *buffer; /* The request while reading, the response while writing */
+  gsize written;
+} Connection;
+
+static GHashTable *commands = NULL; /* name -> CommandMetrics */
+static guint counters[VALET_N_COUNTERS];
+static GList *gauges = NULL;
+
+static void
+command_metrics_free (gpointer data) {
+  CommandMetrics *metrics = data;
+  g_hash_table_destroy (metrics->exits);
+  g_free (metrics->label);
+  g_free (metrics->name);
+  g_free (metrics);
+}
+
+/**
+ * Escape `value` the way the text exposition format wants label values:
+ * backslashes, double quotes and newlines get a backslash.
+ */
+static gchar *
+label_escape (const gchar *value) {
+  GString *escaped;
+  const gchar *p;
+
+  escaped = g_string_sized_new (strlen (value));
+  for (p = value; '\0' != *p; p++) {
+    if ('\\' == *p || '"' == *p) {
+      g_string_append_c (escaped, '\\');
+      g_string_append_c (escaped, *p);
+    }
+    else if ('\n' == *p) {
+      g_string_append (escaped, "\\n");
+    }
+    else {
+      g_string_append_c (escaped, *p);
+    }
+  }
+  return g_string_free (escaped, FALSE);
+}
+
+static CommandMetrics *
+command_metrics (const gchar *name) {
+  CommandMetrics *metrics;
+
+  if (NULL == commands) {
+    commands = g_hash_table_new_full
+      (g_str_hash, g_str_equal, NULL, command_metrics_free);
+  }
+
+  metrics = g_hash_table_lookup (commands, name);
+  if (NULL == metrics) {
+    metrics = g_new0 (CommandMetrics, 1);
+    metrics->name = g_strdup (name);
+    metrics->label = label_escape (name);
+    metrics->exits = g_hash_table_new_full
+      (g_direct_hash, g_direct_equal, NULL, g_free);
+    g_hash_table_insert (commands, metrics->name, metrics);
+  }
+  return metrics;
+}
+
+/**
+ * Record `value` in the histogram `which` of the command called `name`.
+ */
+void
+valet_metrics_observe (const gchar *name, ValetHistogram which, guint64 value) {
+  const HistogramSpec *spec = &histogram_specs[which];
+  Histogram *histogram;
+  guint i;
+
+  histogram = &command_metrics (name)->histograms[which];
+  for (i = 0; i < MAX_BUCKETS && 0 != spec->bounds[i]; i++) {
+    if (value <= spec->bounds[i]) {
+      break;
+    }
+  }
+  if (i < MAX_BUCKETS && 0 == spec->bounds[i]) {
+    i = MAX_BUCKETS;
+  }
+
+  g_atomic_int_inc (&histogram->buckets[i]);
+  g_atomic_pointer_add (&histogram->sum, (gssize) value);
+  g_atomic_int_inc (&histogram->count);
+}
+
+/**
+ * Count a process exit of the command called `name`. `status` is a wait
+ * status, or negative if it was never learned.
+ */
+void
+valet_metrics_exit (const gchar *name, gint status) {
+  CommandMetrics *metrics = command_metrics (name);
+  gint code;
+  guint *count;
+
+  if (status < 0) {
+    code = -1;
+  }
+  else if (WIFEXITED (status)) {
+    code = WEXITSTATUS (status);
+  }
+  else {
+    /* As a shell would report it */
+    code = 128 + WTERMSIG (status);
+  }
+
+  count = g_hash_table_lookup (metrics->exits, GINT_TO_POINTER (code));
+  if (NULL == count) {
+    count = g_new0 (guint, 1);
+    g_hash_table_insert (metrics->exits, GINT_TO_POINTER (code), count);
+  }
+  g_atomic_int_inc (count);
+}
+
+void
+valet_metrics_count (ValetCounter which) {
+  g_atomic_int_inc (&counters[which]);
+}
+
+/**
+ * Export `func`'s value as the gauge `name` on every scrape.
+ */
+void
+valet_metrics_gauge (const gchar *name,
+                     const gchar *help,
+                     ValetGaugeFunc func,
+                     gpointer data) {
+  Gauge *gauge;
+
+  gauge = g_new0 (Gauge, 1);
+  gauge->name = g_strdup (name);
+  gauge->help = g_strdup (help);
+  gauge->func = func;
+  gauge->data = data;
+  gauges = g_list_append (gauges, gauge);
+}
+
+static void
+render_histogram (GString *out,
+                  const HistogramSpec *spec,
+                  const gchar *command,
+                  Histogram *histogram) {
+  guint64 cumulative = 0;
+  guint i;
+
+  for (i = 0; i < MAX_BUCKETS && 0 != spec->bounds[i]; i++) {
+    cumulative += g_atomic_int_get (&histogram->buckets[i]);
+    g_string_append_printf
+      (out, "%s_bucket{command=\"%s\",le=\"%g\"} %" G_GUINT64_FORMAT "\n",
+       spec->name, command, spec->bounds[i] / spec->scale, cumulative);
+  }
+  cumulative += g_atomic_int_get (&histogram->buckets[MAX_BUCKETS]);
+  g_string_append_printf
+    (out, "%s_bucket{command=\"%s\",le=\"+Inf\"} %" G_GUINT64_FORMAT "\n",
+     spec->name, command, cumulative);
+  g_string_append_printf
+    (out, "%s_sum{command=\"%s\"} %g\n", spec->name, command,
+     (gsize) g_atomic_pointer_get (&histogram->sum) / spec->scale);
+  g_string_append_printf
+    (out, "%s_count{command=\"%s\"} %u\n", spec->name, command,
+     g_atomic_int_get (&histogram->count));
+}
+
+/**
+ * Everything we know, in the Prometheus text exposition format.
+ */
+gchar *
+valet_metrics_render (void) {
+  GString *out;
+  GList *names, *name, *item;
+  GHashTableIter iter;
+  gpointer code, count;
+  CommandMetrics *metrics;
+  Gauge *gauge;
+  guint i;
+
+  out = g_string_new (NULL);
+
+  for (i = 0; i < VALET_N_COUNTERS; i++) {
+    g_string_append_printf
+      (out, "# HELP %s %s\n# TYPE %s counter\n%s %u\n",
+       counter_names[i][0], counter_names[i][1], counter_names[i][0],
+       counter_names[i][0], g_atomic_int_get (&counters[i]));
+  }
+
+  for (item = gauges; NULL != item; item = item->next) {
+    gauge = item->data;
+    g_string_append_printf
+      (out, "# HELP %s %s\n# TYPE %s gauge\n%s %g\n",
+       gauge->name, gauge->help, gauge->name,
+       gauge->name, gauge->func (gauge->data));
+  }
+
+  names = NULL;
+  if (NULL != commands) {
+    names = g_list_sort (g_hash_table_get_keys (commands),
+                         (GCompareFunc) g_strcmp0);
+  }
+
+  for (i = 0; i < VALET_N_HISTOGRAMS; i++) {
+    g_string_append_printf
+      (out, "# HELP %s %s\n# TYPE %s histogram\n",
+       histogram_specs[i].name, histogram_specs[i].help,
+       histogram_specs[i].name);
+    for (name = names; NULL != name; name = name->next) {
+      metrics = g_hash_table_lookup (commands, name->data);
+      render_histogram
+        (out, &histogram_specs[i], metrics->label, &metrics->histograms[i]);
+    }
+  }
+
+  g_string_append
+    (out, "# HELP valet_command_exits_total Command processes by exit code.\n"
+     "# TYPE valet_command_exits_total counter\n");
+  for (name = names; NULL != name; name = name->next) {
+    metrics = g_hash_table_lookup (commands, name->data);
+    g_hash_table_iter_init (&iter, metrics->exits);
+    while (g_hash_table_iter_next (&iter, &code, &count)) {
+      g_string_append_printf
+        (out, "valet_command_exits_total{command=\"%s\",code=\"%d\"} %u\n",
+         metrics->label, GPOINTER_TO_INT (code),
+         g_atomic_int_get ((guint *) count));
+    }
+  }
+
+  g_list_free (names);
+  return g_string_free (out, FALSE);
+}
+
+/*** The endpoint. Every connection gets the current metrics, whatever it
+     asked for, and is then closed. ***/
+
+static void
+connection_free (Connection *connection) {
+  close (connection->fd);
+  g_string_free (connection->buffer, TRUE);
+  g_free (connection);
+}
+
+static gboolean
+connection_write (GIOChannel *channel, GIOCondition cond, gpointer data) {
+  Connection *connection = data;
+  ssize_t n;
+
+  /* MSG_NOSIGNAL: a scraper hanging up early must not cost us a SIGPIPE. */
+  n = send (connection->fd,
+            connection->buffer->str + connection->written,
+            connection->buffer->len - connection->written, MSG_NOSIGNAL);
+  if (n < 0 && (EAGAIN == errno || EINTR == errno)) {
+    return TRUE;
+  }
+  if (n > 0) {
+    connection->written += n;
+    if (connection->written < connection->buffer->len) {
+      return TRUE;
+    }
+  }
+
+  connection_free (connection);
+  return FALSE;
+}
+
+static void
+connection_respond (Connection *connection) {
+  GIOChannel *channel;
+  gchar *body;
+
+  body = valet_metrics_render ();
+  g_string_printf
+    (connection->buffer,
+     "HTTP/1.0 200 OK\r\n"
+     "Content-Type: text/plain; version=0.0.4\r\n"
+     "Content-Length: %" G_GSIZE_FORMAT "\r\n"
+     "Connection: close\r\n\r\n%s",
+     strlen (body), body);
+  g_free (body);
+
+  channel = g_io_channel_unix_new (connection->fd);
+  g_io_add_watch (channel, G_IO_OUT | G_IO_ERR | G_IO_HUP,
+                  connection_write, connection);
+  g_io_channel_unref (channel);
+}
+
+static gboolean
+connection_read (GIOChannel *channel, GIOCondition cond, gpointer data) {
+  Connection *connection = data;
+  gchar buffer[1024];
+  ssize_t n;
+
+  n = read (connection->fd, buffer, sizeof (buffer));
+  if (n < 0 && (EAGAIN == errno || EINTR == errno)) {
+    return TRUE;
+  }
+
+  if (n > 0) {
+    g_string_append_len (connection->buffer, buffer, n);
+  }
+  /* A bare connection that hangs up, as `nc -U` may, is answered too. */
+  if (n > 0 && NULL == strstr (connection->buffer->str, "\r\n\r\n")
+      && NULL == strstr (connection->buffer->str, "\n\n")
+      && connection->buffer->len < REQUEST_MAX) {
+    return TRUE;
+  }
+
+  if (n < 0) {
+    connection_free (connection);
+    return FALSE;
+  }
+
+  connection_respond (connection);
+  return FALSE;
+}
+
+static gboolean
+metrics_accept (GIOChannel *channel, GIOCondition cond, gpointer data) {
+  Connection *connection;
+  GIOChannel *client;
+  int fd;
+
+  fd = accept (g_io_channel_unix_get_fd (channel), NULL, NULL);
+  if (fd < 0) {
+    return TRUE;
+  }
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+  fcntl (fd, F_SETFD, FD_CLOEXEC);
+
+  connection = g_new0 (Connection, 1);
+  connection->fd = fd;
+  connection->buffer = g_string_new (NULL);
+
+  client = g_io_channel_unix_new (fd);
+  g_io_add_watch (client, G_IO_IN | G_IO_ERR | G_IO_HUP,
+                  connection_read, connection);
+  g_io_channel_unref (client);
+  return TRUE;
+}
+
+static int
+listen_unix (const gchar *path) {
+  struct sockaddr_un address;
+  int fd;
+
+  if (strlen (path) >= sizeof (address.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  memset (&address, 0, sizeof (address));
+  address.sun_family = AF_UNIX;
+  strcpy (address.sun_path, path);
+  unlink (path);
+
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd >= 0
+      && (0 != bind (fd, (struct sockaddr *) &address, sizeof (address))
+          || 0 != listen (fd, 16))) {
+    close (fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+static int
+listen_tcp (gint port) {
+  struct sockaddr_in address;
+  int fd, yes = 1;
+
+  memset (&address, 0, sizeof (address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons (port);
+  address.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+  fd = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd >= 0) {
+    setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof (yes));
+    if (0 != bind (fd, (struct sockaddr *) &address, sizeof (address))
+        || 0 != listen (fd, 16)) {
+      close (fd);
+      fd = -1;
+    }
+  }
+  return fd;
+}
+
+/**
+ * Serve the metrics on the Unix socket at `path` if it is not NULL, and on
+ * the loopback interface at `port` if it is positive.
+ */
+gboolean
+valet_metrics_listen (const gchar *path, gint port, GError **error) {
+  GIOChannel *channel;
+  int fds[2] = { -1, -1 };
+  guint i;
+
+  if (NULL != path && -1 == (fds[0] = listen_unix (path))) {
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                 "Cannot listen on %s: %s", path, g_strerror (errno));
+    return FALSE;
+  }
+  if (port > 0 && -1 == (fds[1] = listen_tcp (port))) {
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                 "Cannot listen on port %d: %s", port, g_strerror (errno));
+    if (-1 != fds[0]) {
+      close (fds[0]);
+    }
+    return FALSE;
+  }
+
+  for (i = 0; i < G_N_ELEMENTS (fds); i++) {
+    if (-1 == fds[i]) {
+      continue;
+    }
+    channel = g_io_channel_unix_new (fds[i]);
+    g_io_add_watch (channel, G_IO_IN, metrics_accept, NULL);
+    g_io_channel_unref (channel);
+  }
+  return TRUE;
+}
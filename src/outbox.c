@@ -0,0 +1,388 @@
+/***
+ * outbox.c
+ * Rate shaping and fair queuing for outgoing messages.
+ */
+
+#include "outbox.h"
+#include "metrics.h"
+
+typedef struct {
+  gdouble tokens;
+  gint64 updated; /* Monotonic time tokens was last brought up to date */
+} Bucket;
+
+typedef struct {
+  Bucket bucket;
+} Account;
+
+typedef struct {
+  PurpleConvIm *im;
+  Account *account;
+  Bucket bucket;
+  GQueue queues[2]; /* Indexed by ValetSendPriority */
+  gboolean in_ring;
+  guint dropped; /* Messages that did not fit in the queues */
+} Conversation;
+
+static gboolean started = FALSE;
+static gdouble account_rate, conversation_rate;
+static guint account_burst, conversation_burst;
+static guint max_queued; /* Per conversation */
+static GHashTable *accounts = NULL; /* PurpleAccount -> Account */
+static GHashTable *conversations = NULL; /* PurpleConvIm -> Conversation */
+static GHashTable *holders = NULL; /* PurpleConvIm -> GSList of its holders */
+static GQueue ring = G_QUEUE_INIT; /* Conversations with waiting messages */
+static guint queued = 0;
+static guint timer = 0;
+
+static void
+bucket_init (Bucket *bucket, guint burst) {
+  bucket->tokens = burst;
+  bucket->updated = g_get_monotonic_time ();
+}
+
+static void
+bucket_refill (Bucket *bucket, gdouble rate, guint burst, gint64 now) {
+  bucket->tokens = MIN
+    (burst, bucket->tokens + rate * (now - bucket->updated) / G_USEC_PER_SEC);
+  bucket->updated = now;
+}
+
+/**
+ * Microseconds until `bucket` holds a whole token.
+ */
+static gint64
+bucket_wait (Bucket *bucket, gdouble rate) {
+  if (bucket->tokens >= 1) {
+    return 0;
+  }
+  return (gint64) ((1 - bucket->tokens) / rate * G_USEC_PER_SEC) + 1;
+}
+
+/**
+ * Configure the rates and start queuing. Until this is called, valet_send
+ * hands messages straight to libpurple.
+ */
+void
+valet_outbox_start (gdouble conv_rate,
+                    guint conv_burst,
+                    gdouble acct_rate,
+                    guint acct_burst,
+                    guint conv_max_queued) {
+  conversation_rate = conv_rate;
+  conversation_burst = MAX (conv_burst, 1);
+  account_rate = acct_rate;
+  account_burst = MAX (acct_burst, 1);
+  max_queued = MAX (conv_max_queued, 1);
+  accounts = g_hash_table_new_full
+    (g_direct_hash, g_direct_equal, NULL, g_free);
+  conversations = g_hash_table_new_full
+    (g_direct_hash, g_direct_equal, NULL, g_free);
+  started = TRUE;
+}
+
+static Conversation *
+conversation_get (PurpleConvIm *im) {
+  Conversation *conversation;
+  PurpleAccount *account;
+  Account *state;
+
+  conversation = g_hash_table_lookup (conversations, im);
+  if (NULL != conversation) {
+    return conversation;
+  }
+
+  account = purple_conversation_get_account
+    (purple_conv_im_get_conversation (im));
+  state = g_hash_table_lookup (accounts, account);
+  if (NULL == state) {
+    state = g_new0 (Account, 1);
+    bucket_init (&state->bucket, account_burst);
+    g_hash_table_insert (accounts, account, state);
+  }
+
+  conversation = g_new0 (Conversation, 1);
+  conversation->im = im;
+  conversation->account = state;
+  bucket_init (&conversation->bucket, conversation_burst);
+  g_queue_init (&conversation->queues[VALET_SEND_INTERACTIVE]);
+  g_queue_init (&conversation->queues[VALET_SEND_BULK]);
+  g_hash_table_insert (conversations, im, conversation);
+  return conversation;
+}
+
+/**
+ * Take a token from both of the conversation's buckets, if both have one.
+ */
+static gboolean
+conversation_admit (Conversation *conversation, gint64 now) {
+  Bucket *account = &conversation->account->bucket;
+
+  bucket_refill (account, account_rate, account_burst, now);
+  bucket_refill
+    (&conversation->bucket, conversation_rate, conversation_burst, now);
+  if (account->tokens < 1 || conversation->bucket.tokens < 1) {
+    return FALSE;
+  }
+  account->tokens--;
+  conversation->bucket.tokens--;
+  return TRUE;
+}
+
+static gboolean
+conversation_idle (Conversation *conversation) {
+  return g_queue_is_empty (&conversation->queues[VALET_SEND_INTERACTIVE])
+    && g_queue_is_empty (&conversation->queues[VALET_SEND_BULK]);
+}
+
+static gboolean drain_timeout (gpointer);
+
+/**
+ * One round-robin pass over the ring, sending at most one message of
+ * `priority` per conversation. Returns whether anything was sent.
+ */
+static gboolean
+drain_pass (ValetSendPriority priority, gint64 now) {
+  Conversation *conversation;
+  gchar *message;
+  gboolean sent = FALSE;
+  guint i, length;
+
+  length = ring.length;
+  for (i = 0; i < length; i++) {
+    conversation = g_queue_pop_head (&ring);
+
+    if (!g_queue_is_empty (&conversation->queues[priority])
+        && conversation_admit (conversation, now)) {
+      message = g_queue_pop_head (&conversation->queues[priority]);
+      queued--;
+      purple_conv_im_send (conversation->im, message);
+      g_free (message);
+      sent = TRUE;
+    }
+
+    if (conversation_idle (conversation)) {
+      conversation->in_ring = FALSE;
+    }
+    else {
+      g_queue_push_tail (&ring, conversation);
+    }
+  }
+  return sent;
+}
+
+/**
+ * Send whatever the buckets allow, then sleep until the next token is due.
+ */
+static void
+drain (void) {
+  Conversation *conversation;
+  gint64 now, wait, soonest;
+  gboolean sent;
+  GList *item;
+
+  if (0 != timer) {
+    g_source_remove (timer);
+    timer = 0;
+  }
+
+  do {
+    now = g_get_monotonic_time ();
+    /* Interactive messages get the first go at every account token. */
+    sent = drain_pass (VALET_SEND_INTERACTIVE, now);
+    sent = drain_pass (VALET_SEND_BULK, now) || sent;
+  } while (sent && !g_queue_is_empty (&ring));
+
+  if (g_queue_is_empty (&ring)) {
+    return;
+  }
+
+  soonest = G_MAXINT64;
+  for (item = ring.head; NULL != item; item = item->next) {
+    conversation = item->data;
+    wait = MAX (bucket_wait (&conversation->account->bucket, account_rate),
+                bucket_wait (&conversation->bucket, conversation_rate));
+    soonest = MIN (soonest, wait);
+  }
+  timer = g_timeout_add (MAX (1, (soonest + 999) / 1000), drain_timeout, NULL);
+}
+
+static gboolean
+drain_timeout (gpointer data) {
+  timer = 0;
+  drain ();
+  return FALSE;
+}
+
+/**
+ * Send `message` to `im` as soon as the rate limits allow; right away if
+ * nothing is waiting and there is budget to spare.
+ */
+void
+valet_send (PurpleConvIm *im,
+            const gchar *message,
+            ValetSendPriority priority) {
+  Conversation *conversation;
+
+  /* The conversation is gone; so is whoever this was for. */
+  if (NULL == im) {
+    return;
+  }
+
+  if (!started) {
+    purple_conv_im_send (im, message);
+    return;
+  }
+
+  conversation = conversation_get (im);
+  if (conversation_idle (conversation)
+      && conversation_admit (conversation, g_get_monotonic_time ())) {
+    purple_conv_im_send (im, message);
+    return;
+  }
+
+  /* A full queue makes room for replies by dropping its newest bulk
+   * message; anything else that does not fit is dropped itself. */
+  if (conversation->queues[VALET_SEND_INTERACTIVE].length
+      + conversation->queues[VALET_SEND_BULK].length >= max_queued) {
+    conversation->dropped++;
+    valet_metrics_count (VALET_COUNTER_OUTBOX_DROPPED);
+    if (VALET_SEND_BULK == priority
+        || g_queue_is_empty (&conversation->queues[VALET_SEND_BULK])) {
+      return;
+    }
+    g_free (g_queue_pop_tail (&conversation->queues[VALET_SEND_BULK]));
+    queued--;
+  }
+
+  g_queue_push_tail (&conversation->queues[priority], g_strdup (message));
+  queued++;
+  if (!conversation->in_ring) {
+    conversation->in_ring = TRUE;
+    g_queue_push_tail (&ring, conversation);
+  }
+  if (0 == timer) {
+    drain ();
+  }
+}
+
+/**
+ * Note that `*holder` points at a conversation, so that it can be cleared
+ * if libpurple frees the conversation first. Sending to a cleared holder
+ * does nothing.
+ */
+void
+valet_outbox_hold (PurpleConvIm **holder) {
+  GSList *list;
+
+  if (NULL == *holder) {
+    return;
+  }
+  if (NULL == holders) {
+    holders = g_hash_table_new_full
+      (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify) g_slist_free);
+  }
+  list = g_hash_table_lookup (holders, *holder);
+  g_hash_table_steal (holders, *holder);
+  g_hash_table_insert (holders, *holder, g_slist_prepend (list, holder));
+}
+
+/**
+ * `*holder` no longer needs to hear about its conversation.
+ */
+void
+valet_outbox_release (PurpleConvIm **holder) {
+  GSList *list;
+
+  if (NULL == *holder || NULL == holders) {
+    return;
+  }
+  list = g_hash_table_lookup (holders, *holder);
+  g_hash_table_steal (holders, *holder);
+  list = g_slist_remove (list, holder);
+  if (NULL != list) {
+    g_hash_table_insert (holders, *holder, list);
+  }
+}
+
+/**
+ * Forget a conversation libpurple is about to free, along with whatever is
+ * still waiting to be sent to it, and clear everyone still holding it.
+ */
+void
+valet_outbox_forget (PurpleConvIm *im) {
+  Conversation *conversation;
+  GSList *list, *item;
+  gchar *message;
+  guint i;
+
+  if (NULL != holders) {
+    list = g_hash_table_lookup (holders, im);
+    g_hash_table_steal (holders, im);
+    for (item = list; NULL != item; item = item->next) {
+      *(PurpleConvIm **) item->data = NULL;
+    }
+    g_slist_free (list);
+  }
+
+  if (!started) {
+    return;
+  }
+  conversation = g_hash_table_lookup (conversations, im);
+  if (NULL == conversation) {
+    return;
+  }
+
+  if (conversation->in_ring) {
+    g_queue_remove (&ring, conversation);
+  }
+  for (i = 0; i < G_N_ELEMENTS (conversation->queues); i++) {
+    while (NULL != (message = g_queue_pop_head (&conversation->queues[i]))) {
+      g_free (message);
+      queued--;
+    }
+  }
+  g_hash_table_remove (conversations, im);
+}
+
+/**
+ * Messages waiting across all conversations.
+ */
+guint
+valet_outbox_queued (void) {
+  return queued;
+}
+
+/**
+ * A summary of the queues and budgets, for debugging.
+ */
+gchar *
+valet_outbox_describe (void) {
+  Conversation *conversation;
+  GString *out;
+  GList *item;
+
+  out = g_string_new (NULL);
+  if (!started) {
+    g_string_append (out, "The outbox is not running.");
+    return g_string_free (out, FALSE);
+  }
+
+  g_string_append_printf
+    (out, "%u messages waiting in %u conversations "
+     "(%.1f/s per conversation, %.1f/s per account).",
+     queued, ring.length, conversation_rate, account_rate);
+  for (item = ring.head; NULL != item; item = item->next) {
+    conversation = item->data;
+    g_string_append_printf
+      (out, "\n%s: %u interactive, %u bulk, %u dropped, %.1f tokens, "
+       "account %.1f tokens",
+       purple_conversation_get_name
+       (purple_conv_im_get_conversation (conversation->im)),
+       conversation->queues[VALET_SEND_INTERACTIVE].length,
+       conversation->queues[VALET_SEND_BULK].length,
+       conversation->dropped,
+       conversation->bucket.tokens, conversation->account->bucket.tokens);
+  }
+  return g_string_free (out, FALSE);
+}
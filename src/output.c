@@ -0,0 +1,115 @@
+/***
+ * output.c
+ * Batches command output so that a chatty command produces a handful of
+ * messages rather than one stanza per line.
+ */
+
+#include "output.h"
+
+struct _OutputBuffer {
+  PurpleConvIm *im; /* NULL once the conversation is gone */
+  GString *pending;
+  gsize max_bytes;
+  guint flush_ms;
+  guint timer;
+  ValetSendPriority priority;
+  gint64 first_sent; /* Monotonic time of the first message, or 0 */
+};
+
+OutputBuffer *
+valet_output_new (PurpleConvIm *im, gsize max_bytes, guint flush_ms) {
+  OutputBuffer *output;
+
+  output = g_new0 (OutputBuffer, 1);
+  output->im = im;
+  valet_outbox_hold (&output->im);
+  output->max_bytes = max_bytes;
+  output->flush_ms = flush_ms;
+  output->priority = VALET_SEND_BULK;
+  output->pending = g_string_sized_new (max_bytes);
+  return output;
+}
+
+static gboolean
+flush_timeout (gpointer data) {
+  OutputBuffer *output = data;
+
+  output->timer = 0;
+  valet_output_flush (output);
+  return FALSE;
+}
+
+/**
+ * Send everything buffered so far as a single message.
+ */
+void
+valet_output_flush (OutputBuffer *output) {
+  if (0 != output->timer) {
+    g_source_remove (output->timer);
+    output->timer = 0;
+  }
+
+  if (0 == output->pending->len) {
+    return;
+  }
+
+  if (0 == output->first_sent) {
+    output->first_sent = g_get_monotonic_time ();
+  }
+  valet_send (output->im, output->pending->str, output->priority);
+  g_string_truncate (output->pending, 0);
+}
+
+/**
+ * Queue one line of output (without its trailing newline).
+ */
+void
+valet_output_append (OutputBuffer *output, const gchar *line, gsize length) {
+  gsize needed;
+
+  needed = length + (output->pending->len > 0 ? 1 : 0);
+  if (output->pending->len + needed > output->max_bytes) {
+    valet_output_flush (output);
+  }
+
+  if (output->pending->len > 0) {
+    g_string_append_c (output->pending, '\n');
+  }
+  g_string_append_len (output->pending, line, length);
+
+  if (output->pending->len >= output->max_bytes) {
+    /* A single line at least as large as the limit goes out on its own. */
+    valet_output_flush (output);
+  }
+  else if (0 == output->timer) {
+    output->timer = g_timeout_add (output->flush_ms, flush_timeout, output);
+  }
+}
+
+/**
+ * Output is bulk by default; builtins that stream their answers through a
+ * buffer mark it interactive.
+ */
+void
+valet_output_set_priority (OutputBuffer *output, ValetSendPriority priority) {
+  output->priority = priority;
+}
+
+/**
+ * When the first message went out (in monotonic time), or 0 if none has.
+ */
+gint64
+valet_output_first_sent (OutputBuffer *output) {
+  return output->first_sent;
+}
+
+/**
+ * Flush any remaining output and release the buffer.
+ */
+void
+valet_output_free (OutputBuffer *output) {
+  valet_output_flush (output);
+  valet_outbox_release (&output->im);
+  g_string_free (output->pending, TRUE);
+  g_free (output);
+}
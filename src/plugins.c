@@ -0,0 +1,305 @@
+/***
+ * plugins.c
+ * Loads shared-object commands and runs them on a pool of worker threads.
+ */
+
+#include <gmodule.h>
+#include <string.h>
+
+#include "plugins.h"
+
+typedef struct {
+  GModule *module;
+  const ValetPlugin *plugin;
+} Loaded;
+
+struct _Plugins {
+  GHashTable *loaded; /* name -> Loaded */
+  GThreadPool *pool;
+};
+
+/**
+ * One run of a plugin. The worker thread fills `lines` and the main loop
+ * empties it; `idle` is set while a drain is scheduled, so that a burst of
+ * output costs one wakeup. Once `done` is set the worker lets go, and the
+ * main loop frees the invocation after its last drain.
+ */
+typedef struct {
+  const ValetPlugin *plugin;
+  gchar **argv;
+  gchar *input;
+  ValetLineFunc on_line;
+  ValetPluginDoneFunc on_done;
+  gpointer data;
+  GMutex lock;
+  GPtrArray *lines; /* GBytes waiting for the main loop */
+  gsize written; /* Bytes of output taken so far */
+  gsize cap; /* Output beyond this many bytes is dropped */
+  gboolean truncated;
+  guint idle;
+  gboolean done;
+  gint status;
+} Invocation;
+
+static void
+loaded_free (gpointer data) {
+  Loaded *loaded = data;
+
+  if (NULL != loaded->plugin->shutdown) {
+    loaded->plugin->shutdown ();
+  }
+  g_module_close (loaded->module);
+  g_free (loaded);
+}
+
+/**
+ * Load the plugin at `path`, or say why not.
+ */
+static void
+plugins_load (Plugins *plugins, const gchar *path) {
+  GModule *module;
+  const ValetPlugin *plugin;
+  gpointer symbol;
+  GError *error = NULL;
+  Loaded *loaded;
+
+  module = g_module_open (path, G_MODULE_BIND_LOCAL);
+  if (NULL == module) {
+    g_warning ("Cannot load plugin %s: %s", path, g_module_error ());
+    return;
+  }
+
+  if (!g_module_symbol (module, VALET_PLUGIN_SYMBOL, &symbol)
+      || NULL == symbol) {
+    g_warning ("%s does not export " VALET_PLUGIN_SYMBOL, path);
+    g_module_close (module);
+    return;
+  }
+
+  plugin = symbol;
+  if (VALET_PLUGIN_ABI != plugin->abi) {
+    g_warning ("%s was built for plugin ABI %u, not %u",
+               path, plugin->abi, VALET_PLUGIN_ABI);
+    g_module_close (module);
+    return;
+  }
+  if (NULL == plugin->name || NULL == plugin->handle) {
+    g_warning ("%s has no name or no handler", path);
+    g_module_close (module);
+    return;
+  }
+  if (NULL != g_hash_table_lookup (plugins->loaded, plugin->name)) {
+    g_warning ("%s: a plugin called %s is already loaded",
+               path, plugin->name);
+    g_module_close (module);
+    return;
+  }
+
+  if (NULL != plugin->init && !plugin->init (&error)) {
+    g_warning ("Plugin %s failed to start: %s",
+               plugin->name, error ? error->message : "unknown error");
+    g_clear_error (&error);
+    g_module_close (module);
+    return;
+  }
+
+  loaded = g_new0 (Loaded, 1);
+  loaded->module = module;
+  loaded->plugin = plugin;
+  g_hash_table_insert (plugins->loaded, (gpointer) plugin->name, loaded);
+}
+
+static void
+invocation_free (Invocation *invocation) {
+  g_strfreev (invocation->argv);
+  g_free (invocation->input);
+  g_ptr_array_free (invocation->lines, TRUE);
+  g_mutex_clear (&invocation->lock);
+  g_free (invocation);
+}
+
+/**
+ * Hand everything the plugin has written so far to the caller, and finish
+ * up if it has returned.
+ */
+static gboolean
+invocation_drain (gpointer data) {
+  Invocation *invocation = data;
+  GPtrArray *lines;
+  GBytes *line;
+  gboolean done;
+  gsize length;
+  guint i;
+
+  g_mutex_lock (&invocation->lock);
+  lines = invocation->lines;
+  invocation->lines = g_ptr_array_new_with_free_func
+    ((GDestroyNotify) g_bytes_unref);
+  invocation->idle = 0;
+  done = invocation->done;
+  g_mutex_unlock (&invocation->lock);
+
+  for (i = 0; i < lines->len; i++) {
+    line = g_ptr_array_index (lines, i);
+    invocation->on_line
+      (g_bytes_get_data (line, &length), length, invocation->data);
+  }
+  g_ptr_array_free (lines, TRUE);
+
+  if (done) {
+    invocation->on_done (invocation->status, invocation->data);
+    invocation_free (invocation);
+  }
+  return FALSE;
+}
+
+/**
+ * Must be called with the lock held.
+ */
+static void
+invocation_wake (Invocation *invocation) {
+  if (0 == invocation->idle) {
+    invocation->idle = g_idle_add (invocation_drain, invocation);
+  }
+}
+
+/**
+ * The ValetPluginWriteFunc handed to plugins; runs on a worker thread.
+ * Output past the cap is dropped here, after one notice, so a plugin that
+ * writes faster than the main loop drains cannot pile up memory.
+ */
+static void
+invocation_write (const gchar *line, gsize length, gpointer data) {
+  Invocation *invocation = data;
+  gchar *notice;
+
+  g_mutex_lock (&invocation->lock);
+  if (invocation->truncated) {
+    g_mutex_unlock (&invocation->lock);
+    return;
+  }
+  if (invocation->written + length > invocation->cap) {
+    invocation->truncated = TRUE;
+    notice = g_strdup_printf
+      ("[output truncated after %" G_GSIZE_FORMAT " bytes]",
+       invocation->written);
+    g_ptr_array_add
+      (invocation->lines, g_bytes_new_take (notice, strlen (notice)));
+  }
+  else {
+    invocation->written += length;
+    g_ptr_array_add (invocation->lines, g_bytes_new (line, length));
+  }
+  invocation_wake (invocation);
+  g_mutex_unlock (&invocation->lock);
+}
+
+static void
+invocation_run (gpointer item, gpointer data G_GNUC_UNUSED) {
+  Invocation *invocation = item;
+  gint status;
+
+  status = invocation->plugin->handle
+    (invocation->argv, invocation->input, invocation_write, invocation);
+
+  g_mutex_lock (&invocation->lock);
+  invocation->status = status;
+  invocation->done = TRUE;
+  invocation_wake (invocation);
+  g_mutex_unlock (&invocation->lock);
+}
+
+/**
+ * Load every plugin in `dir`, to be run on at most `threads` threads at
+ * once.
+ */
+Plugins *
+valet_plugins_new (const gchar *dir, guint threads) {
+  Plugins *plugins;
+  GDir *handle;
+  GError *error = NULL;
+  const gchar *name;
+  gchar *path;
+
+  plugins = g_new0 (Plugins, 1);
+  plugins->loaded = g_hash_table_new_full
+    (g_str_hash, g_str_equal, NULL, loaded_free);
+  plugins->pool = g_thread_pool_new
+    (invocation_run, NULL, MAX (threads, 1), FALSE, NULL);
+
+  if (!g_module_supported ()) {
+    g_warning ("Plugins are not supported on this platform.");
+    return plugins;
+  }
+
+  handle = g_dir_open (dir, 0, &error);
+  if (NULL == handle) {
+    g_warning ("Cannot read plugins directory: %s", error->message);
+    g_error_free (error);
+    return plugins;
+  }
+
+  while (NULL != (name = g_dir_read_name (handle))) {
+    if (g_str_has_suffix (name, "." G_MODULE_SUFFIX)) {
+      path = g_build_filename (dir, name, NULL);
+      plugins_load (plugins, path);
+      g_free (path);
+    }
+  }
+  g_dir_close (handle);
+
+  g_message ("Loaded %u plugins from %s",
+             g_hash_table_size (plugins->loaded), dir);
+  return plugins;
+}
+
+/**
+ * Wait for running plugins to return, then shut every plugin down.
+ */
+void
+valet_plugins_free (Plugins *plugins) {
+  g_thread_pool_free (plugins->pool, FALSE, TRUE);
+  g_hash_table_destroy (plugins->loaded);
+  g_free (plugins);
+}
+
+/**
+ * Find the plugin called `name`, or NULL if there is none.
+ */
+const ValetPlugin *
+valet_plugins_lookup (Plugins *plugins, const gchar *name) {
+  Loaded *loaded = g_hash_table_lookup (plugins->loaded, name);
+  return NULL != loaded ? loaded->plugin : NULL;
+}
+
+/**
+ * Run `plugin` with `argv` and `input` (which may be NULL) on the pool,
+ * taking ownership of both. `on_line` is called for each line it writes, up
+ * to `cap` bytes in all, and `on_done` once it returns, both from the main
+ * loop.
+ */
+void
+valet_plugins_run (Plugins *plugins,
+                   const ValetPlugin *plugin,
+                   gchar **argv,
+                   gchar *input,
+                   gsize cap,
+                   ValetLineFunc on_line,
+                   ValetPluginDoneFunc on_done,
+                   gpointer data) {
+  Invocation *invocation;
+
+  invocation = g_new0 (Invocation, 1);
+  invocation->plugin = plugin;
+  invocation->argv = argv;
+  invocation->input = input;
+  invocation->cap = cap;
+  invocation->on_line = on_line;
+  invocation->on_done = on_done;
+  invocation->data = data;
+  g_mutex_init (&invocation->lock);
+  invocation->lines = g_ptr_array_new_with_free_func
+    ((GDestroyNotify) g_bytes_unref);
+
+  g_thread_pool_push (plugins->pool, invocation, NULL);
+}
@@ -0,0 +1,157 @@
+/***
+ * reader.c
+ * Non-blocking, fixed-memory line reader for command output.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "reader.h"
+
+/* Reads per wakeup, so that one busy child cannot hog the main loop. */
+#define READS_PER_WAKEUP 16
+
+struct _LineReader {
+  gint fd;
+  guint watch;
+  gchar *buffer;
+  gsize capacity;
+  gsize length; /* Bytes of an unfinished line at the start of buffer */
+  ValetLineFunc on_line;
+  ValetEofFunc on_eof;
+  gpointer data;
+};
+
+static void
+reader_emit (LineReader *reader, const gchar *line, gsize length) {
+  if (length > 0 && '\r' == line[length - 1]) {
+    length--;
+  }
+  reader->on_line (line, length, reader->data);
+}
+
+/**
+ * Hand over every complete line in the buffer, then move the unfinished
+ * remainder to the front. A full buffer without a newline is handed over
+ * as it is.
+ */
+static void
+reader_split (LineReader *reader, gsize scanned) {
+  gchar *start, *newline, *end;
+
+  start = reader->buffer;
+  end = reader->buffer + reader->length;
+  newline = memchr (start + scanned, '\n', end - start - scanned);
+  while (NULL != newline) {
+    reader_emit (reader, start, newline - start);
+    start = newline + 1;
+    newline = memchr (start, '\n', end - start);
+  }
+
+  reader->length = end - start;
+  if (reader->length == reader->capacity) {
+    reader_emit (reader, start, reader->length);
+    reader->length = 0;
+  }
+  else if (start != reader->buffer && reader->length > 0) {
+    memmove (reader->buffer, start, reader->length);
+  }
+}
+
+static void
+reader_finish (LineReader *reader) {
+  if (reader->length > 0) {
+    reader_emit (reader, reader->buffer, reader->length);
+    reader->length = 0;
+  }
+  close (reader->fd);
+  reader->fd = -1;
+  reader->watch = 0;
+  reader->on_eof (reader->data);
+}
+
+static gboolean
+reader_ready (GIOChannel *channel, GIOCondition cond, gpointer data) {
+  LineReader *reader = data;
+  gsize scanned;
+  ssize_t n;
+  guint i;
+
+  for (i = 0; i < READS_PER_WAKEUP; i++) {
+    n = read (reader->fd, reader->buffer + reader->length,
+              reader->capacity - reader->length);
+    if (n < 0 && EINTR == errno) {
+      continue;
+    }
+    if (n < 0 && EAGAIN == errno) {
+      return TRUE;
+    }
+    if (n <= 0) {
+      if (n < 0) {
+        g_warning ("Error reading command output: %s", g_strerror (errno));
+      }
+      reader_finish (reader);
+      return FALSE;
+    }
+
+    /* Only the new bytes can hold a newline we have not seen. */
+    scanned = reader->length;
+    reader->length += n;
+    reader_split (reader, scanned);
+  }
+  return TRUE;
+}
+
+/**
+ * Read lines from `fd`, which the reader now owns, into a buffer of
+ * `capacity` bytes. `on_eof` is called once the child closes its end.
+ */
+LineReader *
+valet_reader_new (gint fd,
+                  gsize capacity,
+                  ValetLineFunc on_line,
+                  ValetEofFunc on_eof,
+                  gpointer data) {
+  LineReader *reader;
+  GIOChannel *channel;
+
+  reader = g_new0 (LineReader, 1);
+  reader->fd = fd;
+  reader->capacity = MAX (capacity, 1);
+  reader->buffer = g_malloc (reader->capacity);
+  reader->on_line = on_line;
+  reader->on_eof = on_eof;
+  reader->data = data;
+
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+  channel = g_io_channel_unix_new (fd);
+  reader->watch = g_io_add_watch
+    (channel, G_IO_IN | G_IO_HUP | G_IO_ERR, reader_ready, reader);
+  g_io_channel_unref (channel);
+  return reader;
+}
+
+/**
+ * Stop reading without waiting for the child to close its end, dropping
+ * anything it has not finished writing. `on_eof` is not called.
+ */
+void
+valet_reader_close (LineReader *reader) {
+  if (0 != reader->watch) {
+    g_source_remove (reader->watch);
+    reader->watch = 0;
+  }
+  if (-1 != reader->fd) {
+    close (reader->fd);
+    reader->fd = -1;
+  }
+}
+
+void
+valet_reader_free (LineReader *reader) {
+  valet_reader_close (reader);
+  g_free (reader->buffer);
+  g_free (reader);
+}
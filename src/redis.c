@@ -0,0 +1,430 @@
+/***
+ * redis.c
+ * A thin, binary-safe layer over hiredis' async API which pipelines the
+ * commands issued during each main loop iteration and rides out the server
+ * going away.
+ */
+
+#include <adapters/glib.h>
+
+#include "redis.h"
+
+#define BACKOFF_MIN_MS 100
+#define BACKOFF_MAX_MS 30000
+
+typedef struct {
+  ValetRedisFunc func;
+  gpointer data;
+  char *command; /* Formatted with redisFormatCommandArgv */
+  int length;
+} Pending;
+
+typedef struct {
+  gchar *pattern;
+  ValetRedisFunc func;
+  gpointer data;
+} Subscription;
+
+/**
+ * A Link is one connection to the server, and its plans for reconnecting.
+ */
+typedef struct {
+  Redis *redis;
+  const gchar *name;
+  redisAsyncContext *ctx;
+  GSource *source;
+  gboolean connected;
+  guint backoff_ms; /* Delay before the next attempt, before jitter */
+  guint retry;
+  guint generation; /* The address this link is connecting to */
+} Link;
+
+struct _Redis {
+  gchar *host;
+  gint port;
+  Link link; /* Commands */
+  Link sub_link; /* Subscriptions */
+  GQueue pending; /* Commands waiting for the next flush */
+  guint max_pending;
+  guint in_flight;
+  guint flush;
+  GList *subscriptions;
+  guint generation; /* Bumped each time the address changes */
+};
+
+static void
+redis_schedule_flush (Redis *);
+
+static void
+link_connect (Link *);
+
+static void
+pending_fail (Pending *pending) {
+  if (NULL != pending->func) {
+    pending->func (NULL, pending->data);
+  }
+  redisFreeCommand (pending->command);
+  g_free (pending);
+}
+
+static void
+reply_cb (redisAsyncContext *ac, gpointer r, gpointer data) {
+  Pending *pending = data;
+  Link *link = ac->data;
+
+  link->redis->in_flight--;
+  if (NULL != pending->func) {
+    pending->func (r, pending->data);
+  }
+  g_free (pending);
+}
+
+static void
+subscription_cb (redisAsyncContext *ac, gpointer r, gpointer data) {
+  Subscription *subscription = data;
+  subscription->func (r, subscription->data);
+}
+
+static void
+subscription_send (Link *link, Subscription *subscription) {
+  if (REDIS_OK != redisAsyncCommand
+      (link->ctx, subscription_cb, subscription, "PSUBSCRIBE %b",
+       subscription->pattern, strlen (subscription->pattern))) {
+    subscription->func (NULL, subscription->data);
+  }
+}
+
+/**
+ * Hand everything queued since the last flush to hiredis at once. While the
+ * connection is down, commands stay queued until it comes back.
+ */
+static gboolean
+redis_flush (gpointer data) {
+  Redis *redis = data;
+  Pending *pending;
+
+  redis->flush = 0;
+  while (redis->link.connected
+         && NULL != (pending = g_queue_pop_head (&redis->pending))) {
+    if (REDIS_OK != redisAsyncFormattedCommand
+        (redis->link.ctx, reply_cb, pending,
+         pending->command, pending->length)) {
+      pending_fail (pending);
+      continue;
+    }
+    redis->in_flight++;
+    /* hiredis has copied the command into its output buffer. */
+    redisFreeCommand (pending->command);
+    pending->command = NULL;
+  }
+  return FALSE;
+}
+
+static void
+redis_schedule_flush (Redis *redis) {
+  if (0 == redis->flush && redis->link.connected) {
+    redis->flush = g_idle_add_full
+      (G_PRIORITY_HIGH_IDLE, redis_flush, redis, NULL);
+  }
+}
+
+static gboolean
+source_release (gpointer data) {
+  GSource *source = data;
+  g_source_destroy (source);
+  g_source_unref (source);
+  return FALSE;
+}
+
+static gboolean
+link_retry (gpointer data) {
+  Link *link = data;
+  link->retry = 0;
+  link_connect (link);
+  return FALSE;
+}
+
+/**
+ * Try again after the current backoff, with jitter so that several bots do
+ * not all reconnect in step, and double the backoff for next time.
+ */
+static void
+link_schedule_retry (Link *link) {
+  guint delay;
+
+  delay = link->backoff_ms / 2
+    + g_random_int_range (0, link->backoff_ms / 2 + 1);
+  link->backoff_ms = MIN (link->backoff_ms * 2, BACKOFF_MAX_MS);
+
+  g_message ("Reconnecting redis %s link in %ums", link->name, delay);
+  link->retry = g_timeout_add (delay, link_retry, link);
+}
+
+/**
+ * hiredis frees a context once its connection is gone; let go of it and of
+ * its main loop source, then plan the next attempt. The source is released
+ * from an idle callback since we may be inside its dispatch, and hiredis may
+ * still call its cleanup hook.
+ */
+static void
+link_lost (Link *link) {
+  link->ctx = NULL;
+  link->connected = FALSE;
+  if (NULL != link->source) {
+    g_idle_add (source_release, link->source);
+    link->source = NULL;
+  }
+  link_schedule_retry (link);
+}
+
+static void
+redis_connect_cb (const redisAsyncContext *ac, int status) {
+  Link *link = ac->data;
+  Redis *redis = link->redis;
+  GList *item;
+
+  if (REDIS_OK != status) {
+    g_warning ("Failed to connect redis %s link: %s", link->name, ac->errstr);
+    link_lost (link);
+    return;
+  }
+
+  /* The server moved while we were connecting to the old one. */
+  if (link->generation != redis->generation) {
+    redisAsyncDisconnect (link->ctx);
+    return;
+  }
+
+  g_message ("Redis %s link connected", link->name);
+  link->connected = TRUE;
+  link->backoff_ms = BACKOFF_MIN_MS;
+
+  if (link == &redis->sub_link) {
+    for (item = redis->subscriptions; NULL != item; item = item->next) {
+      subscription_send (link, item->data);
+    }
+  }
+  else {
+    redis_schedule_flush (redis);
+  }
+}
+
+static void
+redis_disconnect_cb (const redisAsyncContext *ac, int status) {
+  Link *link = ac->data;
+
+  if (REDIS_OK != status) {
+    g_warning ("Lost redis %s link: %s", link->name, ac->errstr);
+  }
+  link_lost (link);
+}
+
+static void
+link_connect (Link *link) {
+  redisAsyncContext *ac;
+
+  ac = redisAsyncConnect (link->redis->host, link->redis->port);
+  if (NULL == ac || ac->err) {
+    g_warning ("redis error: %s", ac ? ac->errstr : "out of memory");
+    if (NULL != ac) {
+      redisAsyncFree (ac);
+    }
+    link_schedule_retry (link);
+    return;
+  }
+
+  ac->data = link;
+  link->generation = link->redis->generation;
+  redisAsyncSetConnectCallback (ac, redis_connect_cb);
+  redisAsyncSetDisconnectCallback (ac, redis_disconnect_cb);
+  link->ctx = ac;
+  link->source = redis_source_new (ac);
+  g_source_attach (link->source, NULL);
+}
+
+static void
+link_init (Link *link, Redis *redis, const gchar *name) {
+  link->redis = redis;
+  link->name = name;
+  link->backoff_ms = BACKOFF_MIN_MS;
+  link_connect (link);
+}
+
+/**
+ * Connect to the redis server at `host`:`port`. Connecting is asynchronous,
+ * and lost connections are retried with backoff. Up to `max_pending`
+ * commands wait for the connection; beyond that they fail at once.
+ */
+Redis *
+valet_redis_new (const gchar *host, gint port, guint max_pending) {
+  Redis *redis;
+
+  redis = g_new0 (Redis, 1);
+  redis->host = g_strdup (host);
+  redis->port = port;
+  redis->max_pending = max_pending;
+  g_queue_init (&redis->pending);
+
+  link_init (&redis->link, redis, "command");
+  link_init (&redis->sub_link, redis, "subscription");
+  return redis;
+}
+
+/**
+ * Drop the link's connection, if it has one, so that it reconnects to the
+ * current address. Replies still due from the old server are waited for.
+ */
+static void
+link_restart (Link *link) {
+  link->backoff_ms = BACKOFF_MIN_MS;
+  if (0 != link->retry) {
+    g_source_remove (link->retry);
+    link->retry = 0;
+    link_connect (link);
+  }
+  else if (link->connected) {
+    /* Hold new commands back until the new connection is up. */
+    link->connected = FALSE;
+    redisAsyncDisconnect (link->ctx);
+  }
+  /* A link still connecting notices the new address once it is done. */
+}
+
+/**
+ * Move to the redis server at `host`:`port`. Queued commands go to the new
+ * server; subscriptions see NULL when the old connection goes, and are
+ * renewed on the new one.
+ */
+void
+valet_redis_retarget (Redis *redis, const gchar *host, gint port) {
+  if (0 == g_strcmp0 (host, redis->host) && port == redis->port) {
+    return;
+  }
+  g_message ("Moving redis from %s:%d to %s:%d",
+             redis->host, redis->port, host, port);
+  g_free (redis->host);
+  redis->host = g_strdup (host);
+  redis->port = port;
+  redis->generation++;
+  link_restart (&redis->link);
+  link_restart (&redis->sub_link);
+}
+
+/**
+ * Queue a command. Each of the `argc` arguments is sent with its length from
+ * `argvlen`, so keys and values may contain spaces or arbitrary bytes.
+ * `func` may be NULL if the reply is of no interest. Returns FALSE if the
+ * command was dropped straight away, in which case `func` has already been
+ * called with NULL.
+ */
+gboolean
+valet_redis_command_argv (Redis *redis,
+                          ValetRedisFunc func,
+                          gpointer data,
+                          gint argc,
+                          const gchar **argv,
+                          const gsize *argvlen) {
+  Pending *pending;
+
+  pending = g_new0 (Pending, 1);
+  pending->func = func;
+  pending->data = data;
+
+  if (redis->pending.length >= redis->max_pending) {
+    g_warning ("Dropping redis command; %u already waiting.",
+               redis->pending.length);
+    pending_fail (pending);
+    return FALSE;
+  }
+
+  pending->length = redisFormatCommandArgv
+    (&pending->command, argc, argv, argvlen);
+  if (pending->length < 0) {
+    pending->command = NULL;
+    pending_fail (pending);
+    return FALSE;
+  }
+
+  g_queue_push_tail (&redis->pending, pending);
+  redis_schedule_flush (redis);
+  return TRUE;
+}
+
+/**
+ * Queue a command given as a NULL-terminated list of string arguments.
+ */
+gboolean
+valet_redis_command (Redis *redis, ValetRedisFunc func, gpointer data, ...) {
+  GPtrArray *argv;
+  GArray *argvlen;
+  const gchar *arg;
+  gsize length;
+  va_list args;
+  gboolean queued;
+
+  argv = g_ptr_array_new ();
+  argvlen = g_array_new (FALSE, FALSE, sizeof (gsize));
+
+  va_start (args, data);
+  while (NULL != (arg = va_arg (args, const gchar *))) {
+    length = strlen (arg);
+    g_ptr_array_add (argv, (gpointer) arg);
+    g_array_append_val (argvlen, length);
+  }
+  va_end (args);
+
+  queued = valet_redis_command_argv
+    (redis, func, data, argv->len,
+     (const gchar **) argv->pdata, (const gsize *) argvlen->data);
+
+  g_ptr_array_free (argv, TRUE);
+  g_array_free (argvlen, TRUE);
+  return queued;
+}
+
+/**
+ * Subscribe to channels matching `pattern`. `func` sees every reply on the
+ * subscription, starting with the confirmation, and NULL whenever it is
+ * lost. The subscription is renewed each time the connection comes back.
+ */
+void
+valet_redis_psubscribe (Redis *redis,
+                        const gchar *pattern,
+                        ValetRedisFunc func,
+                        gpointer data) {
+  Subscription *subscription;
+
+  subscription = g_new0 (Subscription, 1);
+  subscription->pattern = g_strdup (pattern);
+  subscription->func = func;
+  subscription->data = data;
+  redis->subscriptions = g_list_append (redis->subscriptions, subscription);
+
+  if (redis->sub_link.connected) {
+    subscription_send (&redis->sub_link, subscription);
+  }
+}
+
+/**
+ * Whether commands are currently reaching the server.
+ */
+gboolean
+valet_redis_connected (Redis *redis) {
+  return redis->link.connected;
+}
+
+/**
+ * Commands waiting to be sent, eg while the connection is down.
+ */
+guint
+valet_redis_queued (Redis *redis) {
+  return redis->pending.length;
+}
+
+/**
+ * Commands sent and still waiting for their reply.
+ */
+guint
+valet_redis_in_flight (Redis *redis) {
+  return redis->in_flight;
+}
@@ -0,0 +1,385 @@
+/***
+ * remote.c
+ * Sends commands to valet-worker processes through redis and relays what
+ * they print.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "remote.h"
+
+/* Wait status reported for jobs that never reached a worker */
+#define REMOTE_FAILED (255 << 8)
+
+struct _RemoteJob {
+  Remote *remote;
+  gchar *id;
+  gchar *payload; /* As pushed onto the queue */
+  gsize length;
+  ValetLineFunc on_line;
+  ValetRemoteDoneFunc on_done;
+  gpointer data;
+  gboolean started; /* Whether a worker has said it took the job */
+  guint failure; /* Pending report that the job could not be queued */
+};
+
+struct _Remote {
+  Redis *redis;
+  gchar *queue; /* Key of the job list */
+  gchar *channels; /* What every job's channel starts with */
+  gchar **commands; /* Names run remotely; "*" for anything not known here */
+  GHashTable *jobs; /* id -> RemoteJob, until done or cancelled */
+  GQueue held; /* Jobs waiting for the subscription to their output */
+  gboolean subscribed;
+  guint64 serial;
+};
+
+/**
+ * What the reply to a push needs to find its job, which may be gone by
+ * then.
+ */
+typedef struct {
+  Remote *remote;
+  gchar *id;
+} Pushed;
+
+static void
+job_free (RemoteJob *job) {
+  if (0 != job->failure) {
+    g_source_remove (job->failure);
+  }
+  g_free (job->id);
+  g_free (job->payload);
+  g_free (job);
+}
+
+/**
+ * Tell the caller a job is over, and forget about it.
+ */
+static void
+job_done (RemoteJob *job, gint status) {
+  Remote *remote = job->remote;
+
+  g_hash_table_steal (remote->jobs, job->id);
+  g_queue_remove (&remote->held, job);
+  job->on_done (status, job->data);
+  job_free (job);
+}
+
+/**
+ * Deferred so that a job which fails while it is being submitted does not
+ * finish before valet_remote_run has returned its handle.
+ */
+static gboolean
+job_fail (gpointer data) {
+  RemoteJob *job = data;
+  static const gchar notice[] = "[could not reach the job queue]";
+
+  job->failure = 0;
+  job->on_line (notice, sizeof (notice) - 1, job->data);
+  job_done (job, REMOTE_FAILED);
+  return FALSE;
+}
+
+static void
+job_pushed_cb (redisReply *reply, gpointer data) {
+  Pushed *pushed = data;
+  RemoteJob *job;
+
+  job = g_hash_table_lookup (pushed->remote->jobs, pushed->id);
+  if (NULL != job && 0 == job->failure
+      && (NULL == reply || REDIS_REPLY_ERROR == reply->type)) {
+    g_warning ("Could not queue remote job %s: %s", job->id,
+               NULL != reply ? reply->str : "redis went away");
+    job->failure = g_idle_add (job_fail, job);
+  }
+  g_free (pushed->id);
+  g_free (pushed);
+}
+
+static void
+job_push (RemoteJob *job) {
+  Remote *remote = job->remote;
+  Pushed *pushed;
+  const gchar *argv[3];
+  gsize argvlen[3];
+
+  argv[0] = "LPUSH";
+  argvlen[0] = strlen (argv[0]);
+  argv[1] = remote->queue;
+  argvlen[1] = strlen (argv[1]);
+  argv[2] = job->payload;
+  argvlen[2] = job->length;
+
+  pushed = g_new0 (Pushed, 1);
+  pushed->remote = remote;
+  pushed->id = g_strdup (job->id);
+  valet_redis_command_argv
+    (remote->redis, job_pushed_cb, pushed, 3, argv, argvlen);
+}
+
+/**
+ * Handle one message from a job's channel.
+ */
+static void
+job_message (RemoteJob *job, const gchar *message, gsize length) {
+  gchar *status, *notice;
+
+  if (0 == length) {
+    return;
+  }
+
+  switch (message[0]) {
+  case VALET_REMOTE_STARTED:
+    /* A job is only started twice if its first worker died with it. */
+    if (job->started) {
+      notice = g_strdup_printf
+        ("[restarted on %.*s]", (gint) length - 1, message + 1);
+      job->on_line (notice, strlen (notice), job->data);
+      g_free (notice);
+    }
+    job->started = TRUE;
+    break;
+  case VALET_REMOTE_LINE:
+    job->on_line (message + 1, length - 1, job->data);
+    break;
+  case VALET_REMOTE_EXIT:
+    status = g_strndup (message + 1, length - 1);
+    job_done (job, atoi (status));
+    g_free (status);
+    break;
+  default:
+    break;
+  }
+}
+
+/**
+ * Every job's output arrives here. Lines published while the subscription
+ * is down are lost; a job whose end is lost runs out its timeout.
+ */
+static void
+remote_message_cb (redisReply *reply, gpointer data) {
+  Remote *remote = data;
+  redisReply *channel, *message;
+  RemoteJob *job;
+
+  if (NULL == reply) {
+    if (remote->subscribed) {
+      g_warning ("Lost the output of remote jobs; holding new ones back.");
+    }
+    remote->subscribed = FALSE;
+    return;
+  }
+
+  if (REDIS_REPLY_ARRAY != reply->type || reply->elements < 3) {
+    return;
+  }
+
+  if (0 == g_strcmp0 (reply->element[0]->str, "psubscribe")) {
+    remote->subscribed = TRUE;
+    while (NULL != (job = g_queue_pop_head (&remote->held))) {
+      job_push (job);
+    }
+    return;
+  }
+
+  if (4 != reply->elements
+      || 0 != g_strcmp0 (reply->element[0]->str, "pmessage")) {
+    return;
+  }
+
+  channel = reply->element[2];
+  message = reply->element[3];
+  if (!g_str_has_prefix (channel->str, remote->channels)) {
+    return;
+  }
+  job = g_hash_table_lookup
+    (remote->jobs, channel->str + strlen (remote->channels));
+  if (NULL != job) {
+    job_message (job, message->str, message->len);
+  }
+}
+
+/**
+ * Run the commands named in `commands` through workers listening on the
+ * keys below `prefix`.
+ */
+Remote *
+valet_remote_new (Redis *redis, const gchar *prefix, gchar **commands) {
+  Remote *remote;
+  gchar *pattern;
+
+  remote = g_new0 (Remote, 1);
+  remote->redis = redis;
+  remote->queue = g_strdup_printf (VALET_REMOTE_QUEUE, prefix);
+  remote->channels = g_strdup_printf (VALET_REMOTE_CHANNEL, prefix, "");
+  remote->commands = g_strdupv (commands);
+  remote->jobs = g_hash_table_new (g_str_hash, g_str_equal);
+  g_queue_init (&remote->held);
+
+  pattern = g_strconcat (remote->channels, "*", NULL);
+  valet_redis_psubscribe (redis, pattern, remote_message_cb, remote);
+  g_free (pattern);
+  return remote;
+}
+
+void
+valet_remote_set_commands (Remote *remote, gchar **commands) {
+  g_strfreev (remote->commands);
+  remote->commands = g_strdupv (commands);
+}
+
+/**
+ * Whether the command called `name` should run remotely. Commands named
+ * outright always do; "*" takes anything that is not `known` here.
+ */
+gboolean
+valet_remote_wants (Remote *remote, const gchar *name, gboolean known) {
+  gchar **command;
+
+  if (NULL == remote->commands) {
+    return FALSE;
+  }
+  for (command = remote->commands; NULL != *command; command++) {
+    if (0 == strcmp (*command, name)
+        || (!known && 0 == strcmp (*command, "*"))) {
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/**
+ * Queue `argv` to run on a worker, with `input` (which may be NULL) on its
+ * stdin. Workers skip a job still waiting `timeout` seconds from now, if it
+ * is not 0, and stop it by then otherwise. `on_line` is called for each
+ * line of output and `on_done` once it is over. The handle stays valid
+ * until then, or until the job is cancelled.
+ */
+RemoteJob *
+valet_remote_run (Remote *remote,
+                  gchar **argv,
+                  const gchar *input,
+                  guint64 timeout,
+                  ValetLineFunc on_line,
+                  ValetRemoteDoneFunc on_done,
+                  gpointer data) {
+  RemoteJob *job;
+  gint64 deadline = 0;
+
+  if (0 != timeout) {
+    deadline = g_get_real_time () / G_USEC_PER_SEC + timeout;
+  }
+
+  job = g_new0 (RemoteJob, 1);
+  job->remote = remote;
+  job->id = g_strdup_printf
+    ("%s-%d-%" G_GUINT64_FORMAT, g_get_host_name (), (gint) getpid (),
+     ++remote->serial);
+  job->payload = valet_remote_job_encode
+    (job->id, deadline, input, argv, &job->length);
+  job->on_line = on_line;
+  job->on_done = on_done;
+  job->data = data;
+  g_hash_table_insert (remote->jobs, job->id, job);
+
+  /* Output published before we listen for it would be lost. */
+  if (remote->subscribed) {
+    job_push (job);
+  }
+  else {
+    g_queue_push_tail (&remote->held, job);
+  }
+  return job;
+}
+
+/**
+ * Stop waiting for `job`. A worker that has already taken it still runs it
+ * to the end; one that has not skips it once its deadline has passed.
+ */
+void
+valet_remote_cancel (Remote *remote, RemoteJob *job) {
+  g_hash_table_remove (remote->jobs, job->id);
+  g_queue_remove (&remote->held, job);
+  job_free (job);
+}
+
+/**
+ * Jobs queued or running, as far as we know.
+ */
+guint
+valet_remote_jobs (Remote *remote) {
+  return g_hash_table_size (remote->jobs);
+}
+
+/**
+ * A job is its id, its deadline in seconds since the epoch (or 0), its input
+ * and its arguments, each followed by a NUL byte. An empty input means
+ * none. Returns the job and its length in `length`.
+ */
+gchar *
+valet_remote_job_encode (const gchar *id,
+                         gint64 deadline,
+                         const gchar *input,
+                         gchar **argv,
+                         gsize *length) {
+  GString *job;
+  gchar **arg;
+
+  job = g_string_new (id);
+  g_string_append_c (job, '\0');
+  g_string_append_printf (job, "%" G_GINT64_FORMAT, deadline);
+  g_string_append_c (job, '\0');
+  g_string_append (job, NULL != input ? input : "");
+  g_string_append_c (job, '\0');
+  for (arg = argv; NULL != *arg; arg++) {
+    g_string_append (job, *arg);
+    g_string_append_c (job, '\0');
+  }
+
+  *length = job->len;
+  return g_string_free (job, FALSE);
+}
+
+/**
+ * Read a job made by valet_remote_job_encode. Returns its arguments and
+ * sets `id`, `deadline` and `input` (NULL for none), or returns NULL if it
+ * is malformed.
+ */
+gchar **
+valet_remote_job_decode (const gchar *job,
+                         gsize length,
+                         gchar **id,
+                         gint64 *deadline,
+                         gchar **input) {
+  GPtrArray *fields;
+  const gchar *p, *end;
+  gchar **argv;
+  guint i;
+
+  if (0 == length || '\0' != job[length - 1]) {
+    return NULL;
+  }
+
+  fields = g_ptr_array_new ();
+  for (p = job, end = job + length; p < end; p += strlen (p) + 1) {
+    g_ptr_array_add (fields, (gpointer) p);
+  }
+  if (fields->len < 4 || '\0' == ((gchar *) fields->pdata[3])[0]) {
+    g_ptr_array_free (fields, TRUE);
+    return NULL;
+  }
+
+  *id = g_strdup (fields->pdata[0]);
+  *deadline = g_ascii_strtoll (fields->pdata[1], NULL, 10);
+  *input = '\0' != ((gchar *) fields->pdata[2])[0]
+    ? g_strdup (fields->pdata[2]) : NULL;
+  argv = g_new0 (gchar *, fields->len - 2);
+  for (i = 3; i < fields->len; i++) {
+    argv[i - 3] = g_strdup (fields->pdata[i]);
+  }
+  g_ptr_array_free (fields, TRUE);
+  return argv;
+}
@@ -0,0 +1,193 @@
+/***
+ * resources.c
+ * Resource limits for command processes: rlimits set in the child before it
+ * runs, and optionally a cgroup v2 leaf of its own.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "resources.h"
+
+/* cpu.max is a quota per period; we express it as a share of this period. */
+#define CPU_MAX_PERIOD_USEC 100000
+
+static void
+load_one (guint64 *field, GKeyFile *keyfile,
+          const gchar *group, const gchar *key) {
+  GError *error = NULL;
+  guint64 value;
+
+  value = g_key_file_get_uint64 (keyfile, group, key, &error);
+  if (NULL == error) {
+    *field = value;
+  }
+  else {
+    g_error_free (error);
+  }
+}
+
+/**
+ * Overwrite the fields of `limits` that `group` of `keyfile` mentions.
+ */
+void
+valet_limits_load (ValetLimits *limits,
+                   GKeyFile *keyfile,
+                   const gchar *group) {
+  load_one (&limits->timeout, keyfile, group, "timeout");
+  load_one (&limits->kill_grace, keyfile, group, "kill_grace");
+  load_one (&limits->cpu, keyfile, group, "cpu");
+  load_one (&limits->address_space, keyfile, group, "address_space");
+  load_one (&limits->nofile, keyfile, group, "nofile");
+  load_one (&limits->memory_max, keyfile, group, "memory_max");
+  load_one (&limits->cpu_max, keyfile, group, "cpu_max");
+}
+
+/**
+ * Mark every limit as inherited, before a sidecar names its own.
+ */
+void
+valet_limits_inherit (ValetLimits *limits) {
+  limits->timeout = VALET_LIMIT_INHERIT;
+  limits->kill_grace = VALET_LIMIT_INHERIT;
+  limits->cpu = VALET_LIMIT_INHERIT;
+  limits->address_space = VALET_LIMIT_INHERIT;
+  limits->nofile = VALET_LIMIT_INHERIT;
+  limits->memory_max = VALET_LIMIT_INHERIT;
+  limits->cpu_max = VALET_LIMIT_INHERIT;
+}
+
+/**
+ * Apply a command's own limits on top of the defaults.
+ */
+void
+valet_limits_merge (ValetLimits *limits, const ValetLimits *overrides) {
+#define MERGE(field) \
+  if (VALET_LIMIT_INHERIT != overrides->field) limits->field = overrides->field
+  MERGE (timeout);
+  MERGE (kill_grace);
+  MERGE (cpu);
+  MERGE (address_space);
+  MERGE (nofile);
+  MERGE (memory_max);
+  MERGE (cpu_max);
+#undef MERGE
+}
+
+static void
+apply_one (int resource, guint64 value) {
+  struct rlimit limit;
+
+  if (0 == value) {
+    return;
+  }
+  limit.rlim_cur = value;
+  limit.rlim_max = value;
+  setrlimit (resource, &limit);
+}
+
+/**
+ * Set the rlimits of the calling process. This runs in a freshly forked
+ * child, so it only makes async-signal-safe calls.
+ */
+void
+valet_limits_apply (const ValetLimits *limits) {
+  apply_one (RLIMIT_CPU, limits->cpu);
+  apply_one (RLIMIT_AS, limits->address_space);
+  apply_one (RLIMIT_NOFILE, limits->nofile);
+}
+
+/**
+ * cgroup files are written in place; g_file_set_contents would try to
+ * rename a temporary file over them.
+ */
+static gboolean
+cgroup_write (const gchar *leaf, const gchar *file,
+              const gchar *value, GError **error) {
+  gchar *path;
+  gboolean ok;
+  int fd;
+
+  path = g_build_filename (leaf, file, NULL);
+  fd = open (path, O_WRONLY | O_CLOEXEC);
+  ok = fd >= 0 && write (fd, value, strlen (value)) >= 0;
+  if (!ok) {
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                 "Cannot write %s: %s", path, g_strerror (errno));
+  }
+  if (fd >= 0) {
+    close (fd);
+  }
+  g_free (path);
+  return ok;
+}
+
+/**
+ * Make a cgroup for one command under `parent`, which must be a cgroup v2
+ * directory delegated to valet with the memory and cpu controllers enabled
+ * for its children. Returns the new directory.
+ */
+gchar *
+valet_cgroup_new (const gchar *parent,
+                  const ValetLimits *limits,
+                  GError **error) {
+  static guint serial = 0;
+  gchar *name, *leaf, *value;
+  gboolean ok = TRUE;
+
+  name = g_strdup_printf ("valet-%d-%u", (int) getpid (), ++serial);
+  leaf = g_build_filename (parent, name, NULL);
+  g_free (name);
+
+  if (0 != mkdir (leaf, 0755)) {
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                 "Cannot create cgroup %s: %s", leaf, g_strerror (errno));
+    g_free (leaf);
+    return NULL;
+  }
+
+  if (0 != limits->memory_max) {
+    value = g_strdup_printf ("%" G_GUINT64_FORMAT, limits->memory_max);
+    ok = cgroup_write (leaf, "memory.max", value, error);
+    g_free (value);
+  }
+  if (ok && 0 != limits->cpu_max) {
+    value = g_strdup_printf
+      ("%" G_GUINT64_FORMAT " %d",
+       limits->cpu_max * CPU_MAX_PERIOD_USEC / 100, CPU_MAX_PERIOD_USEC);
+    ok = cgroup_write (leaf, "cpu.max", value, error);
+    g_free (value);
+  }
+
+  if (!ok) {
+    valet_cgroup_free (leaf);
+    return NULL;
+  }
+  return leaf;
+}
+
+/**
+ * Kill everything in the cgroup, including anything the command forked and
+ * left behind.
+ */
+void
+valet_cgroup_kill (const gchar *leaf) {
+  if (!cgroup_write (leaf, "cgroup.kill", "1", NULL)) {
+    g_debug ("cgroup.kill is not available for %s", leaf);
+  }
+}
+
+/**
+ * Remove the cgroup, once it is empty.
+ */
+void
+valet_cgroup_free (gchar *leaf) {
+  if (0 != rmdir (leaf)) {
+    g_warning ("Cannot remove cgroup %s: %s", leaf, g_strerror (errno));
+  }
+  g_free (leaf);
+}
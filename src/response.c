@@ -3,74 +3,247 @@
  * This code is responsible for spawning the appropriate commands and replying
  * with the output.
  */
+#include <signal.h>
+#include <unistd.h>
+
 #include "response.h"
 #include "context.h"
+#include "dispatch.h"
+#include "output.h"
+#include "executor.h"
+#include "scheduler.h"
+#include "cache.h"
+#include "index.h"
+#include "redis.h"
+#include "metrics.h"
+#include "outbox.h"
+#include "reader.h"
+#include "writer.h"
+#include "plugins.h"
+#include "tokenize.h"
+#include "session.h"
+#include "acl.h"
+#include "remote.h"
+
+/* Ending the first line with this sends the rest of the message to stdin */
+#define HEREDOC_MARKER "<<"
+
+/* Told to users instead of an answer when the kvstore is out of reach */
+#define KV_UNREACHABLE "The key-value store is unreachable; try again later."
 
 /**
  * The arguments, output file descriptors, and libpurple conversation comprising
  * a given command.
  */
 typedef struct {
+  Arena *arena; /* Holds the arguments, name, sender and cache key */
   char **args;
+  gchar *working_dir; /* commands_path as of when the command arrived */
+  gchar *name; /* As found in the index, or "remote"; metrics use it */
   int child_stdin;
   int child_stdout;
   int child_stderr;
-  PurpleConvIm *im;
+  gchar *sender; /* Whose scheduler slot this command holds */
   GPid pid;
   Context *context;
+  OutputBuffer *output;
+  LineReader *readers[2]; /* stdout and stderr */
+  gsize rest; /* Offset of the second line in the message, or 0 */
+  gchar *input; /* The rest of the message, when it goes to stdin */
+  gboolean heredoc; /* The first line asked for input on stdin */
+  PipeWriter *writer;
+  guint open_streams; /* Output streams not yet at EOF */
+  gboolean truncated; /* Whether output went past the cap */
+  gboolean exited;
+  gint status; /* Wait status, once exited */
+  gchar *cache_key; /* Set when the output of this command may be cached */
+  guint cache_ttl;
+  GString *captured; /* Output collected for the cache */
+  gint64 received; /* When the message arrived, in monotonic time */
+  gint64 started; /* When the process was spawned */
+  gsize output_bytes;
+  guint output_lines;
+  ValetLimits limits; /* The defaults with the command's own on top */
+  gchar *cgroup; /* The command's own cgroup, if any */
+  guint deadline; /* Pending SIGTERM or SIGKILL */
+  const ValetPlugin *plugin; /* Set when run in-process instead of spawned */
+  gboolean remote; /* Set when a valet-worker runs it instead */
+  RemoteJob *job; /* The remote run, until it is over */
+  gchar *dedup_key; /* Set while identical requests may join this one */
+  GPtrArray *subscribers; /* Output buffers of the requests that joined */
+  GString *sent; /* Lines sent so far, each ending in '\n', for latecomers */
 } Command;
 
+/**
+ * Only the first line of `message` becomes arguments; where the rest starts
+ * is noted in case it turns out to be the command's input.
+ */
 Command *
-valet_command_new (char *args, PurpleConvIm *im, Context *context) {
+valet_command_new (const char *message, PurpleConvIm *im, Context *context) {
   Command *command;
-  char *tmp = NULL;
+  const gchar *rest;
+  gsize length;
+  guint argc;
+
   command = g_new0 (Command, 1);
 
-  if (g_str_has_prefix (args, "<font>")) {
-    /* This is likely a Bonjour message with hardcoded formatting. */
-    GMatchInfo *match_info;
-    GRegex *regex =  g_regex_new ("^<font>(.*)</font>", 0, 0, NULL);
-    tmp = args;
-    g_regex_match (regex, tmp, 0, &match_info);
-    args = g_match_info_fetch (match_info, 1);
-    g_free (match_info);
-    g_regex_unref (regex);
-  }
+  /* Enough for the arguments twice over, should they have to be read again
+   * from the whole message, and the odd name. */
+  length = strlen (message);
+  command->arena = valet_arena_new (2 * length + 256);
+  command->args = valet_tokenize
+    (command->arena, message, length,
+     VALET_TOKENIZE_MARKUP | VALET_TOKENIZE_FIRST_LINE, &rest);
+  command->rest = NULL != rest ? rest - message : 0;
 
-  command->args = g_regex_split_simple("[\\s+]", args, 0, 0);
+  argc = g_strv_length (command->args);
+  if (argc > 1 && 0 == strcmp (command->args[argc - 1], HEREDOC_MARKER)) {
+    command->heredoc = TRUE;
+    command->args[argc - 1] = NULL;
+  }
   command->child_stdin = -1;
   command->child_stdout = -1;
   command->child_stderr = -1;
-  command->im = im;
   command->pid = -1;
   command->context = context;
-
-  if (NULL != tmp) {
-    g_free (tmp);
-    tmp = NULL;
-  }
+  command->received = g_get_monotonic_time ();
+  command->output = valet_output_new
+    (im, context->output_max_bytes, context->output_flush_ms);
   return command;
 }
 
 void
 valet_command_free (Command *command) {
-  if (NULL != command->args) {
-    g_strfreev (command->args);
+  if (NULL != command->dedup_key
+      && command == g_hash_table_lookup
+      (command->context->in_flight, command->dedup_key)) {
+    g_hash_table_remove (command->context->in_flight, command->dedup_key);
+  }
+
+  valet_output_flush (command->output);
+  if (NULL != command->name
+      && 0 != valet_output_first_sent (command->output)) {
+    valet_metrics_observe
+      (command->name, VALET_HISTOGRAM_REPLY_LATENCY,
+       valet_output_first_sent (command->output) - command->received);
+  }
+
+  if (0 != command->deadline) {
+    g_source_remove (command->deadline);
+  }
+  if (NULL != command->job) {
+    valet_remote_cancel (command->context->remote, command->job);
+  }
+  if (NULL != command->cgroup) {
+    valet_cgroup_free (command->cgroup);
+  }
+  if (NULL != command->readers[0]) {
+    valet_reader_free (command->readers[0]);
+  }
+  if (NULL != command->readers[1]) {
+    valet_reader_free (command->readers[1]);
+  }
+  if (NULL != command->writer) {
+    valet_writer_free (command->writer);
+  }
+  if (-1 != command->child_stdin) {
+    close (command->child_stdin);
   }
+  g_free (command->input);
+  if (NULL != command->captured) {
+    g_string_free (command->captured, TRUE);
+  }
+  /* Everyone who joined is served their last lines here. */
+  if (NULL != command->subscribers) {
+    g_ptr_array_free (command->subscribers, TRUE);
+  }
+  if (NULL != command->sent) {
+    g_string_free (command->sent, TRUE);
+  }
+  valet_output_free (command->output);
+  valet_arena_free (command->arena);
   g_free (command);
 }
 
-static gboolean
-handle_geo (Context *context, PurpleConvIm *im, char *str) {
-  if (!g_str_has_prefix (str, ("geo:"))) {
-    return FALSE;
+/**
+ * The cache key for a command is its argument vector, joined with a
+ * separator no one types.
+ */
+static gchar *
+command_cache_key (Command *command) {
+  gchar *joined, *key;
+
+  joined = g_strjoinv ("\x1f", command->args);
+  key = valet_arena_strdup (command->arena, joined);
+  g_free (joined);
+  return key;
+}
+
+/**
+ * Send a line to everyone waiting on the command: whoever asked for it,
+ * whoever joined since, and the record kept for anyone who joins later.
+ */
+static void
+command_send (Command *command, const gchar *line, gsize length) {
+  guint i;
+
+  valet_output_append (command->output, line, length);
+  if (NULL != command->subscribers) {
+    for (i = 0; i < command->subscribers->len; i++) {
+      valet_output_append
+        (g_ptr_array_index (command->subscribers, i), line, length);
+    }
+  }
+  if (NULL != command->sent) {
+    g_string_append_len (command->sent, line, length);
+    g_string_append_c (command->sent, '\n');
+  }
+}
+
+/**
+ * Attach a request from `im` to `running`, an identical command that is
+ * queued or running already. It is sent whatever the command has printed so
+ * far straight away, and the rest as it comes.
+ */
+static void
+command_join (Command *running, PurpleConvIm *im) {
+  Context *context = running->context;
+  OutputBuffer *output;
+  const gchar *line, *end, *stop;
+
+  output = valet_output_new
+    (im, context->output_max_bytes, context->output_flush_ms);
+  stop = running->sent->str + running->sent->len;
+  for (line = running->sent->str; line < stop; line = end + 1) {
+    end = memchr (line, '\n', stop - line);
+    valet_output_append (output, line, end - line);
   }
 
-  GMatchInfo *match_info;
-  GRegex *regex = g_regex_new ("^geo:(.+),(.+)$", 0, 0, NULL);
+  if (NULL == running->subscribers) {
+    running->subscribers = g_ptr_array_new_with_free_func
+      ((GDestroyNotify) valet_output_free);
+  }
+  g_ptr_array_add (running->subscribers, output);
+  valet_metrics_count (VALET_COUNTER_COMMANDS_SHARED);
+}
 
-  g_regex_match (regex, str, 0, &match_info);
+/**
+ * Send a cached result through the command's output buffer, line by line, so
+ * it is batched exactly like live output would be.
+ */
+static void
+command_replay (Command *command, const gchar *cached) {
+  const gchar *line, *end;
 
+  for (line = cached; NULL != line; line = end ? end + 1 : NULL) {
+    end = strchr (line, '\n');
+    valet_output_append
+      (command->output, line, end ? (gsize) (end - line) : strlen (line));
+  }
+}
+
+static void
+handle_geo (Context *context, PurpleConvIm *im, GMatchInfo *match_info) {
   gchar *lat = g_match_info_fetch (match_info, 1);
   gchar *lng = g_match_info_fetch (match_info, 2);
 
@@ -78,132 +251,437 @@ handle_geo (Context *context, PurpleConvIm *im, char *str) {
 
   g_free (lat);
   g_free (lng);
-  g_free (match_info);
-  g_regex_unref (regex);
-  return TRUE;
 }
 
-static gboolean
-handle_set_key (Context *context, PurpleConvIm *im, char *str) {
-  if (!g_str_has_prefix (str, "#set")) {
-    return FALSE;
-  }
-  GMatchInfo *match_info;
-  GRegex *regex = g_regex_new ("^#set\\s+(\\S+)\\s+(.*)$", 0, 0, NULL);
-
-  g_regex_match (regex, str, 0, &match_info);
+/**
+ * Answers from valet itself, rather than command output, go to the front of
+ * the outbox.
+ */
+static void
+builtin_reply (PurpleConvIm *im, const gchar *message) {
+  valet_send (im, message, VALET_SEND_INTERACTIVE);
+}
 
+static void
+handle_set_key (Context *context, PurpleConvIm *im, GMatchInfo *match_info) {
   gchar *key = g_match_info_fetch (match_info, 1);
   gchar *val = g_match_info_fetch (match_info, 2);
 
-  valet_set_key (context, key, val);
-  purple_conv_im_send (im, "Inserted key value pair.");
+  switch (valet_set_key (context, key, val)) {
+  case VALET_KV_OK:
+    builtin_reply (im, "Inserted key value pair.");
+    break;
+
+  case VALET_KV_NONE:
+    builtin_reply (im, "No key-value store is configured.");
+    break;
+
+  case VALET_KV_UNREACHABLE:
+    builtin_reply (im, KV_UNREACHABLE);
+    break;
+  }
 
   g_free (key);
   g_free (val);
-  g_free (match_info);
-  g_regex_unref (regex);
-  return TRUE;
 }
 
-static gboolean
-handle_get_key (Context *context, PurpleConvIm *im, char *str) {
-  if (!g_str_has_prefix (str, "#get")) {
-    return FALSE;
-  }
-  GMatchInfo *match_info;
-  GRegex *regex = g_regex_new ("^#get\\s+(\\S+)", 0, 0, NULL);
+/**
+ * The answer may come after the conversation is gone, so it goes through
+ * an output buffer, which hears about that.
+ */
+static void
+get_key_reply (const gchar *key,
+               const gchar *value,
+               ValetKvStatus status,
+               gpointer data) {
+  OutputBuffer *output = data;
+  const gchar *reply;
 
-  g_regex_match (regex, str, 0, &match_info);
+  if (VALET_KV_OK != status) {
+    reply = KV_UNREACHABLE;
+  }
+  else {
+    reply = NULL != value ? value : "No value found for key.";
+  }
+  valet_output_append (output, reply, strlen (reply));
+  valet_output_free (output);
+}
 
+static void
+handle_get_key (Context *context, PurpleConvIm *im, GMatchInfo *match_info) {
   gchar *key = g_match_info_fetch (match_info, 1);
-  valet_get_key (context, key, im);
-  /*
-  gchar *val = valet_get_key (context, key, im);
-  if (NULL == val) {
-    purple_conv_im_send (im, "No value found for key.");
+  OutputBuffer *output;
+
+  output = valet_output_new
+    (im, context->output_max_bytes, context->output_flush_ms);
+  valet_output_set_priority (output, VALET_SEND_INTERACTIVE);
+  if (!valet_get_key (context, key, get_key_reply, output)) {
+    builtin_reply (im, "No key-value store is configured.");
+    valet_output_free (output);
+  }
+  g_free (key);
+}
+
+/**
+ * `#mset` takes one key and value per line; the value is the rest of the
+ * line, so it may contain spaces.
+ */
+static void
+handle_mset (Context *context, PurpleConvIm *im, GMatchInfo *match_info) {
+  gchar *body, **lines, **line, *key, *value;
+  GPtrArray *pairs;
+  gchar *notice;
+  guint count;
+
+  body = g_match_info_fetch (match_info, 1);
+  lines = g_strsplit (body, "\n", -1);
+  pairs = g_ptr_array_new_with_free_func (g_free);
+
+  for (line = lines; NULL != *line; line++) {
+    key = g_strstrip (*line);
+    value = key + strcspn (key, " \t");
+    if ('\0' == *key || '\0' == *value) {
+      continue;
+    }
+    *value++ = '\0';
+    g_ptr_array_add (pairs, g_strdup (key));
+    g_ptr_array_add (pairs, g_strdup (g_strchug (value)));
+  }
+  count = pairs->len / 2;
+  g_ptr_array_add (pairs, NULL);
+
+  if (0 == count) {
+    builtin_reply (im, "Usage: #mset <key> <value> (one pair per line)");
+  }
+  else {
+    switch (valet_set_keys (context, (gchar **) pairs->pdata)) {
+    case VALET_KV_OK:
+      notice = g_strdup_printf ("Inserted %u key value pairs.", count);
+      builtin_reply (im, notice);
+      g_free (notice);
+      break;
+
+    case VALET_KV_NONE:
+      builtin_reply (im, "No key-value store is configured.");
+      break;
+
+    case VALET_KV_UNREACHABLE:
+      builtin_reply (im, KV_UNREACHABLE);
+      break;
+    }
+  }
+
+  g_ptr_array_free (pairs, TRUE);
+  g_strfreev (lines);
+  g_free (body);
+}
+
+/**
+ * Every key of one #mget has the same status, so an unreachable store is
+ * reported once, at the end, rather than as a missing value per key.
+ */
+static void
+mget_reply (const gchar *key,
+            const gchar *value,
+            ValetKvStatus status,
+            gpointer data) {
+  OutputBuffer *output = data;
+  gchar *line;
+
+  if (NULL == key) {
+    if (VALET_KV_OK != status) {
+      valet_output_append (output, KV_UNREACHABLE, strlen (KV_UNREACHABLE));
+    }
+    valet_output_free (output);
+    return;
+  }
+  if (VALET_KV_OK != status) {
+    return;
+  }
+
+  line = g_strdup_printf ("%s: %s", key, value ? value : "(nil)");
+  valet_output_append (output, line, strlen (line));
+  g_free (line);
+}
+
+static void
+handle_mget (Context *context, PurpleConvIm *im, GMatchInfo *match_info) {
+  gchar *body, **words, **word;
+  GPtrArray *keys;
+  OutputBuffer *output;
+
+  body = g_match_info_fetch (match_info, 1);
+  words = g_strsplit_set (body, " \t\r\n", -1);
+  keys = g_ptr_array_new ();
+  for (word = words; NULL != *word; word++) {
+    if ('\0' != **word) {
+      g_ptr_array_add (keys, *word);
+    }
+  }
+  g_ptr_array_add (keys, NULL);
+
+  output = valet_output_new
+    (im, context->output_max_bytes, context->output_flush_ms);
+  valet_output_set_priority (output, VALET_SEND_INTERACTIVE);
+  if (!valet_get_keys (context, (gchar **) keys->pdata, mget_reply, output)) {
+    builtin_reply (im, "No key-value store is configured.");
+    valet_output_free (output);
+  }
+
+  g_ptr_array_free (keys, TRUE);
+  g_strfreev (words);
+  g_free (body);
+}
+
+static void
+keys_reply (const gchar **keys, gboolean done, gpointer data) {
+  OutputBuffer *output = data;
+  const gchar **key;
+
+  for (key = keys; NULL != key && NULL != *key; key++) {
+    valet_output_append (output, *key, strlen (*key));
+  }
+  if (done) {
+    valet_output_free (output);
+  }
+}
+
+static void
+handle_keys (Context *context, PurpleConvIm *im, GMatchInfo *match_info) {
+  gchar *prefix;
+  OutputBuffer *output;
+
+  prefix = g_match_info_fetch (match_info, 1);
+  output = valet_output_new
+    (im, context->output_max_bytes, context->output_flush_ms);
+  valet_output_set_priority (output, VALET_SEND_INTERACTIVE);
+  if (!valet_scan_keys (context, prefix ? prefix : "", keys_reply, output)) {
+    builtin_reply (im, "No key-value store is configured.");
+    valet_output_free (output);
+  }
+  g_free (prefix);
+}
+
+static void
+handle_redis_status (Context *context,
+                     PurpleConvIm *im,
+                     GMatchInfo *match_info G_GNUC_UNUSED) {
+  gchar *status;
+
+  if (NULL == context->redis) {
+    builtin_reply (im, "Redis is not configured.");
+    return;
+  }
+
+  status = g_strdup_printf
+    ("Redis %s:%d is %s; %u commands queued, %u in flight.",
+     context->redis_host, context->redis_port,
+     valet_redis_connected (context->redis) ? "connected" : "unreachable",
+     valet_redis_queued (context->redis),
+     valet_redis_in_flight (context->redis));
+  builtin_reply (im, status);
+  g_free (status);
+}
+
+static void
+handle_outbox (Context *context,
+               PurpleConvIm *im,
+               GMatchInfo *match_info G_GNUC_UNUSED) {
+  gchar *description = valet_outbox_describe ();
+  builtin_reply (im, description);
+  g_free (description);
+}
+
+/**
+ * The normalized JID of whoever is on the other end of `im`.
+ */
+static const gchar *
+conversation_sender (PurpleConvIm *im) {
+  PurpleConversation *conv = purple_conv_im_get_conversation (im);
+
+  return purple_normalize (purple_conversation_get_account (conv),
+                           purple_conversation_get_name (conv));
+}
+
+/**
+ * `#session <command> [args]` starts a command that keeps reading this
+ * conversation's messages on stdin. Only executables from the index can be
+ * sessions; a plugin invocation cannot outlive its message.
+ */
+static void
+handle_session (Context *context, PurpleConvIm *im, GMatchInfo *match_info) {
+  const CommandEntry *entry;
+  ValetLimits limits;
+  GError *error = NULL;
+  Arena *arena;
+  gchar *body, **args, *notice;
+
+  body = g_match_info_fetch (match_info, 1);
+  arena = valet_arena_new (strlen (body) + 256);
+  args = valet_tokenize (arena, body, strlen (body), 0, NULL);
+  entry = NULL == args[0]
+    ? NULL : valet_index_lookup (context->commands, args[0]);
+
+  if (NULL == args[0]) {
+    notice = g_strdup ("Usage: #session <command> [args]");
+  }
+  else if (valet_session_exists (context->sessions, im)) {
+    notice = g_strdup ("A session is already open here; #endsession first.");
+  }
+  else if (NULL == entry) {
+    notice = g_strdup_printf ("Unknown command: %s", args[0]);
+  }
+  /* Being allowed #session is not being allowed every command. */
+  else if (VALET_ACL_ALLOW != valet_acl_check
+           (context->acl, conversation_sender (im),
+            entry->name, strlen (entry->name))) {
+    notice = g_strdup_printf ("Not allowed: %s", entry->name);
+  }
+  else if (valet_sessions_full (context->sessions)) {
+    notice = g_strdup ("Too many sessions are open; try again later.");
   }
   else {
-    purple_conv_im_send (im, val);
-    g_free (val);
+    limits = context->limits;
+    valet_limits_merge (&limits, &entry->limits);
+    args[0] = valet_arena_strdup (arena, entry->path);
+    if (valet_session_open
+        (context->sessions, im, entry->name, args, &limits, &error)) {
+      notice = g_strdup_printf
+        ("Session with %s open; messages here go to it until #endsession.",
+         entry->name);
+    }
+    else {
+      notice = g_strdup_printf
+        ("Cannot start %s: %s", entry->name, error->message);
+      g_error_free (error);
+    }
   }
-  */
 
-  g_free (key);
-  g_free (match_info);
-  g_regex_unref (regex);
-  return TRUE;
+  builtin_reply (im, notice);
+  g_free (notice);
+  valet_arena_free (arena);
+  g_free (body);
 }
 
 /**
- * Called by the GLib event loop whenever a command produces output.
+ * The session says when it has ended, once its output is all sent.
  */
-static gboolean
-reply (GIOChannel *channel, GIOCondition cond, gpointer data) {
-  GIOStatus status;
-  GError *error;
-  PurpleConvIm *im;
-  char *buffer;
-  gsize length, term_pos;
-  gboolean more_data;
+static void
+handle_end_session (Context *context,
+                    PurpleConvIm *im,
+                    GMatchInfo *match_info G_GNUC_UNUSED) {
+  if (!valet_session_close (context->sessions, im)) {
+    builtin_reply (im, "No session is open here.");
+  }
+}
+
+/**
+ * A command is done once its process has exited and both of its output
+ * channels have been drained; whatever is still buffered is flushed then.
+ */
+static void
+command_maybe_finish (Command *command) {
+  Context *context = command->context;
+
+  if (!command->exited || 0 != command->open_streams) {
+    return;
+  }
+
+  /* Only clean runs whose output was kept in full are worth remembering. */
+  if (NULL != command->captured
+      && g_spawn_check_exit_status (command->status, NULL)
+      && command->captured->len <= context->cache_max_entry_bytes) {
+    valet_cache_insert
+      (context->output_cache, command->cache_key,
+       command->captured->str, command->cache_ttl);
+  }
+
+  valet_metrics_observe
+    (command->name, VALET_HISTOGRAM_OUTPUT_BYTES, command->output_bytes);
+  valet_metrics_observe
+    (command->name, VALET_HISTOGRAM_OUTPUT_LINES, command->output_lines);
+  valet_command_free (command);
+}
+
+/**
+ * Called for each line a command writes. Lines from stdout and stderr feed
+ * the same buffer, so they are sent in the order they were read. Past the
+ * output cap the user is told once and the rest is dropped.
+ */
+static void
+command_line (const gchar *line, gsize length, gpointer data) {
   Command *command = data;
+  Context *context = command->context;
+  gchar *valid = NULL, *notice;
 
-  more_data = TRUE;
-  error = NULL;
-  im = command->im;
-  status = g_io_channel_read_line
-    ( channel,
-      &buffer,
-      &length,
-      &term_pos,
-      &error );
+  if (command->truncated) {
+    return;
+  }
 
-  if (NULL != error) {
-    g_warning ("Error: %s\n", error->message);
-    g_error_free (error);
+  if (command->output_bytes + length > context->output_cap_bytes) {
+    command->truncated = TRUE;
+    notice = g_strdup_printf
+      ("[output truncated after %" G_GSIZE_FORMAT " bytes]",
+       command->output_bytes);
+    command_send (command, notice, strlen (notice));
+    g_free (notice);
+    /* Partial results are not worth caching. */
+    if (NULL != command->captured) {
+      g_string_free (command->captured, TRUE);
+      command->captured = NULL;
+    }
+    return;
   }
 
-  if (G_IO_STATUS_NORMAL == status) {
-    /* Strip the trailing newline */
-    buffer[strcspn (buffer, "\n")] = 0;
-    /* If the command needs some more info, reply with it here. */
-    purple_conv_im_send (im, buffer);
-    free (buffer);
+  /* Chat messages must be UTF-8; commands may print anything. */
+  if (!g_utf8_validate (line, length, NULL)) {
+    valid = g_utf8_make_valid (line, length);
+    line = valid;
+    length = strlen (valid);
   }
 
-  else { /* ERROR, EOF */
-    more_data = FALSE;
-    g_io_channel_shutdown (channel, TRUE, NULL);
+  command_send (command, line, length);
+  command->output_bytes += length;
+  command->output_lines++;
+
+  if (NULL != command->captured) {
+    if (command->captured->len + length + 1 > context->cache_max_entry_bytes) {
+      /* Too big to cache, so stop holding on to it. */
+      g_string_free (command->captured, TRUE);
+      command->captured = NULL;
+    }
+    else {
+      if (command->captured->len > 0) {
+        g_string_append_c (command->captured, '\n');
+      }
+      g_string_append_len (command->captured, line, length);
+    }
   }
+  g_free (valid);
+}
 
-  return more_data;
+static void
+command_stream_closed (gpointer data) {
+  Command *command = data;
+
+  command->open_streams--;
+  command_maybe_finish (command);
 }
 
 /**
- * Set up response channels from child process output.
+ * Start reading the child's stdout and stderr.
  */
 void
 create_response_channels (Command *command) {
-  GIOChannel *out_channel, *err_channel;
-
-  out_channel = g_io_channel_unix_new (command->child_stdout);
-  err_channel = g_io_channel_unix_new (command->child_stderr);
+  gsize capacity = command->context->read_buffer_bytes;
 
-  g_io_add_watch_full
-    ( out_channel,
-      G_PRIORITY_DEFAULT,
-      G_IO_IN | G_IO_HUP,
-      reply,
-      command,
-      NULL );
-
-  g_io_add_watch_full
-    ( err_channel,
-      G_PRIORITY_DEFAULT,
-      G_IO_IN | G_IO_HUP,
-      reply,
-      command,
-      NULL );
+  command->open_streams = 2;
+  command->readers[0] = valet_reader_new
+    (command->child_stdout, capacity,
+     command_line, command_stream_closed, command);
+  command->readers[1] = valet_reader_new
+    (command->child_stderr, capacity,
+     command_line, command_stream_closed, command);
 }
 
 /**
@@ -211,61 +689,583 @@ create_response_channels (Command *command) {
  */
 void
 command_process_watch (GPid pid, int status, gpointer data) {
+  Command *command = data;
+
   g_debug
     ( "Command process %d exited %s\n",
       pid,
       g_spawn_check_exit_status (status, NULL)
       ? "normally" : "abnormally" );
   g_spawn_close_pid (pid);
-  valet_command_free (data);
+  valet_metrics_observe
+    (command->name, VALET_HISTOGRAM_RUNTIME,
+     g_get_monotonic_time () - command->started);
+  valet_metrics_exit (command->name, status);
+  valet_scheduler_release (command->context->scheduler, command->sender);
+  command->exited = TRUE;
+  command->status = status;
+  command_maybe_finish (command);
 }
 
 /**
- * Parse an incoming message and try to spawn a command.
- * Commands are defined as CMD_PATH in defines.h
+ * The grace period is over; kill whatever is left of the command, and stop
+ * reading output. Without a cgroup, children it left behind once it was
+ * reaped cannot be reached, and may hold our pipes open for good.
  */
-void
-spawn_command (char *buffer, PurpleConvIm *im, Context *context) {
-  Command *command;
+static gboolean
+command_kill (gpointer data) {
+  Command *command = data;
+  guint i;
+
+  command->deadline = 0;
+  valet_child_kill (command->pid, SIGKILL);
+  if (NULL != command->cgroup) {
+    valet_cgroup_kill (command->cgroup);
+  }
+
+  for (i = 0; i < G_N_ELEMENTS (command->readers); i++) {
+    if (NULL != command->readers[i]) {
+      valet_reader_close (command->readers[i]);
+    }
+  }
+  command->open_streams = 0;
+  command_maybe_finish (command);
+  return FALSE;
+}
+
+/**
+ * The command has run too long: ask its process group to stop, and insist
+ * after the grace period. The timer keeps running after the command itself
+ * exits, so the command still ends if children it left hold our pipes.
+ */
+static gboolean
+command_timeout (gpointer data) {
+  Command *command = data;
+  gchar *notice;
+
+  notice = g_strdup_printf
+    ("[%s timed out after %" G_GUINT64_FORMAT "s and was stopped]",
+     command->name, command->limits.timeout);
+  command_send (command, notice, strlen (notice));
+  g_free (notice);
+  valet_metrics_count (VALET_COUNTER_COMMANDS_KILLED);
+
+  valet_child_kill (command->pid, SIGTERM);
+  command->deadline = g_timeout_add_seconds
+    (command->limits.kill_grace, command_kill, command);
+  return FALSE;
+}
+
+/**
+ * Called once a plugin returns. Its exit code is turned into a wait status
+ * so that it is reported and cached exactly like a process's.
+ */
+static void
+command_plugin_done (gint code, gpointer data) {
+  Command *command = data;
+
+  valet_metrics_observe
+    (command->name, VALET_HISTOGRAM_RUNTIME,
+     g_get_monotonic_time () - command->started);
+  command->status = (code & 0xff) << 8;
+  valet_metrics_exit (command->name, command->status);
+  valet_scheduler_release (command->context->scheduler, command->sender);
+  command->exited = TRUE;
+  command_maybe_finish (command);
+}
+
+/**
+ * Hand a command the scheduler has admitted to the plugin thread pool. The
+ * arguments and input go with it; timeouts do not apply, since a thread
+ * cannot be stopped the way a process can.
+ */
+static gboolean
+command_start_plugin (Command *command) {
+  command->started = g_get_monotonic_time ();
+  valet_plugins_run
+    (command->context->plugins, command->plugin, g_strdupv (command->args),
+     command->input, command->context->output_cap_bytes,
+     command_line, command_plugin_done, command);
+  command->input = NULL;
+  return TRUE;
+}
+
+/**
+ * Called once a remote job is over, with the wait status the worker saw.
+ */
+static void
+command_remote_done (gint status, gpointer data) {
+  Command *command = data;
+
+  command->job = NULL;
+  if (0 != command->deadline) {
+    g_source_remove (command->deadline);
+    command->deadline = 0;
+  }
+  valet_metrics_observe
+    (command->name, VALET_HISTOGRAM_RUNTIME,
+     g_get_monotonic_time () - command->started);
+  command->status = status;
+  valet_metrics_exit (command->name, command->status);
+  valet_scheduler_release (command->context->scheduler, command->sender);
+  command->exited = TRUE;
+  command_maybe_finish (command);
+}
+
+/**
+ * The worker should have stopped a remote command by now, but nothing has
+ * come back; whatever it says from here on is ignored.
+ */
+static gboolean
+command_remote_timeout (gpointer data) {
+  Command *command = data;
+  gchar *notice;
+
+  command->deadline = 0;
+  notice = g_strdup_printf
+    ("[%s timed out after %" G_GUINT64_FORMAT "s on a remote worker]",
+     command->args[0], command->limits.timeout);
+  command_send (command, notice, strlen (notice));
+  g_free (notice);
+  valet_metrics_count (VALET_COUNTER_COMMANDS_KILLED);
+
+  valet_remote_cancel (command->context->remote, command->job);
+  command_remote_done (SIGKILL, command);
+  return FALSE;
+}
+
+/**
+ * Queue a command the scheduler has admitted for a valet-worker. It keeps
+ * its slot until the worker reports back, and the worker gets the time
+ * left of the timeout, counted from now, queueing included.
+ */
+static gboolean
+command_start_remote (Command *command) {
+  guint64 timeout = command->limits.timeout;
+
+  command->started = g_get_monotonic_time ();
+  command->job = valet_remote_run
+    (command->context->remote, command->args, command->input, timeout,
+     command_line, command_remote_done, command);
+  if (0 != timeout) {
+    command->deadline = g_timeout_add_seconds
+      (timeout + command->limits.kill_grace, command_remote_timeout, command);
+  }
+  return TRUE;
+}
+
+/**
+ * Spawn the process for a command the scheduler has admitted.
+ */
+static gboolean
+command_start (gpointer item, gpointer data G_GNUC_UNUSED) {
+  Command *command = item;
+  Context *context = command->context;
   GError *error;
-  char *commands_path;
+  gint64 before;
+
+  if (NULL != command->plugin) {
+    return command_start_plugin (command);
+  }
+  if (command->remote) {
+    return command_start_remote (command);
+  }
 
   error = NULL;
-  commands_path = context->commands_path;
-  command = valet_command_new (buffer, im, context);
+  if (NULL != context->cgroup_path) {
+    command->cgroup = valet_cgroup_new
+      (context->cgroup_path, &command->limits, &error);
+    if (NULL == command->cgroup) {
+      g_warning ("Running %s outside a cgroup: %s",
+                 command->name, error->message);
+      g_error_free (error);
+      error = NULL;
+    }
+  }
+  before = g_get_monotonic_time ();
 
   /* Spawn a new process */
-  g_spawn_async_with_pipes
-    ( commands_path,
+  valet_executor_spawn
+    ( command->working_dir,
       command->args,
-      NULL,
-      //G_SPAWN_DEFAULT,
-      G_SPAWN_DO_NOT_REAP_CHILD,
-      NULL, NULL,
+      &(command->limits),
+      command->cgroup,
       &(command->pid),
       &(command->child_stdin),
       &(command->child_stdout),
       &(command->child_stderr),
       &error );
 
-  /* Did GLib tell us something went wrong? */
+  /* Did the executor tell us something went wrong? */
   if (NULL != error) {
     g_warning ("Spawning child failed: %s\n", error->message);
     g_error_free (error);
     valet_command_free (command);
-    return;
+    return FALSE;
   }
 
   /* Did GLib lie? */
   if (-1 == command->child_stdout || -1 == command->child_stderr) {
     g_warning ("Error capturing child process output.\n");
     valet_command_free (command);
-    return;
+    return FALSE;
+  }
+
+  command->started = g_get_monotonic_time ();
+  valet_metrics_observe
+    (command->name, VALET_HISTOGRAM_SPAWN_LATENCY, command->started - before);
+
+  if (0 != command->limits.timeout) {
+    command->deadline = g_timeout_add_seconds
+      (command->limits.timeout, command_timeout, command);
   }
 
   /* Okay we've started a process let's do it. */
+  if (NULL != command->input && '\0' != command->input[0]) {
+    command->writer = valet_writer_new
+      (command->child_stdin, command->input, strlen (command->input));
+    command->input = NULL;
+  }
+  else {
+    close (command->child_stdin);
+  }
+  command->child_stdin = -1;
   create_response_channels (command);
-  g_child_watch_add (command->pid, command_process_watch, command);
+  valet_child_watch (command->pid, command_process_watch, command);
+  return TRUE;
+}
+
+/**
+ * Tell `im` that the command or builtin called `name`, of which `length`
+ * bytes count, is not allowed, unless the sender is not in the ACL at all.
+ */
+static void
+message_denied (PurpleConvIm *im,
+                ValetAclResult result,
+                const gchar *name,
+                gsize length) {
+  gchar *notice, *shown;
+
+  if (VALET_ACL_DENY == result) {
+    shown = g_strndup (name, length);
+    notice = g_strdup_printf ("Not allowed: %s", shown);
+    builtin_reply (im, notice);
+    g_free (notice);
+    g_free (shown);
+  }
+  valet_metrics_count (VALET_COUNTER_MESSAGES_DENIED);
+}
+
+/**
+ * Parse an incoming message and hand the command to the scheduler, letting
+ * the sender know if it has to wait. Commands with a cache TTL are answered
+ * from the cache when possible, without spawning anything.
+ * Commands are defined as CMD_PATH in defines.h
+ */
+void
+spawn_command (const char *buffer,
+               PurpleConvIm *im,
+               const char *sender,
+               Context *context) {
+  ValetAclResult result;
+  Command *command;
+  const CommandEntry *entry;
+  const ValetPlugin *plugin;
+  const gchar *cached;
+  Command *running;
+  guint depth;
+  gchar *notice;
+
+  command = valet_command_new (buffer, im, context);
+  command->sender = valet_arena_strdup (command->arena, sender);
+
+  /* Turn away anything that is neither in the commands directory nor a
+   * plugin, nor meant for a remote worker, before we spend a fork on it. */
+  entry = NULL;
+  plugin = NULL;
+  if (NULL != command->args[0] && '\0' != command->args[0][0]) {
+    /* The name as tokenized is the one that runs, so it is what the ACL
+     * must allow. */
+    result = valet_acl_check
+      (context->acl, sender, command->args[0], strlen (command->args[0]));
+    if (VALET_ACL_ALLOW != result) {
+      message_denied (im, result, command->args[0],
+                      strlen (command->args[0]));
+      valet_command_free (command);
+      return;
+    }
+    entry = valet_index_lookup (context->commands, command->args[0]);
+    if (NULL == entry && NULL != context->plugins) {
+      plugin = valet_plugins_lookup (context->plugins, command->args[0]);
+    }
+    if (NULL != context->remote
+        && valet_remote_wants (context->remote, command->args[0],
+                               NULL != entry || NULL != plugin)) {
+      entry = NULL;
+      plugin = NULL;
+      command->remote = TRUE;
+    }
+    if (NULL == entry && NULL == plugin && !command->remote) {
+      notice = g_strdup_printf ("Unknown command: %s", command->args[0]);
+      builtin_reply (im, notice);
+      g_free (notice);
+    }
+  }
+  if (NULL == entry && NULL == plugin && !command->remote) {
+    valet_command_free (command);
+    return;
+  }
+
+  if (0 != command->rest) {
+    if (command->heredoc || (NULL != entry && entry->takes_input)) {
+      command->input = valet_markup_strip
+        (buffer + command->rest, strlen (buffer + command->rest));
+    }
+    else {
+      /* Otherwise the rest of the message is more arguments, as ever. */
+      command->args = valet_tokenize
+        (command->arena, buffer, strlen (buffer),
+         VALET_TOKENIZE_MARKUP, NULL);
+    }
+  }
+
+  command->plugin = plugin;
+  command->limits = context->limits;
+  if (NULL != entry) {
+    command->name = valet_arena_strdup (command->arena, entry->name);
+    valet_limits_merge (&command->limits, &entry->limits);
+    command->cache_ttl = entry->cache_ttl;
+  }
+  else if (NULL != plugin) {
+    command->name = valet_arena_strdup (command->arena, plugin->name);
+  }
+  else if (valet_remote_wants (context->remote, command->args[0], TRUE)) {
+    command->name = command->args[0];
+  }
+  else {
+    /* Whatever "*" sends away is named by the sender, so its metrics are
+     * kept under one name rather than one per thing anyone types. */
+    command->name = valet_arena_strdup (command->arena, "remote");
+  }
+  if (0 == command->cache_ttl) {
+    command->cache_ttl = GPOINTER_TO_UINT
+      (g_hash_table_lookup (context->cache_ttls, command->args[0]));
+  }
+  /* Input is not part of the cache key, so commands fed any are not cached. */
+  if (command->cache_ttl > 0 && NULL == command->input) {
+    command->cache_key = command_cache_key (command);
+    cached = valet_cache_lookup (context->output_cache, command->cache_key);
+    if (NULL != cached) {
+      g_debug ("Answering \"%s\" from the cache", command->args[0]);
+      command_replay (command, cached);
+      valet_command_free (command);
+      return;
+    }
+    command->captured = g_string_new (NULL);
+  }
+
+  /* Identical requests for a command that allows it share one run. */
+  if (NULL != entry && entry->dedup && NULL == command->input) {
+    command->dedup_key = NULL != command->cache_key
+      ? command->cache_key : command_cache_key (command);
+    running = g_hash_table_lookup (context->in_flight, command->dedup_key);
+    if (NULL != running) {
+      g_debug ("Joining a running \"%s\"", command->args[0]);
+      command_join (running, im);
+      valet_command_free (command);
+      return;
+    }
+    command->sent = g_string_new (NULL);
+    g_hash_table_insert (context->in_flight, command->dedup_key, command);
+  }
+
+  /* The executor gets the resolved path, not whatever the user typed, and
+   * the directory it came from even if a reload changes it meanwhile. */
+  if (NULL != entry) {
+    command->args[0] = valet_arena_strdup (command->arena, entry->path);
+    command->working_dir = valet_arena_strdup
+      (command->arena, context->commands_path);
+  }
+
+  depth = valet_scheduler_submit (context->scheduler, sender, command);
+  if (depth > 0) {
+    notice = g_strdup_printf
+      ("Busy; your command is queued (%u waiting).", depth);
+    builtin_reply (im, notice);
+    g_free (notice);
+  }
+}
+
+static gdouble
+running_gauge (gpointer data) {
+  return valet_scheduler_running (data);
+}
+
+static gdouble
+queued_gauge (gpointer data) {
+  return valet_scheduler_queued (data);
+}
+
+static gdouble
+outbox_gauge (gpointer data G_GNUC_UNUSED) {
+  return valet_outbox_queued ();
+}
+
+static gdouble
+children_gauge (gpointer data G_GNUC_UNUSED) {
+  return valet_children_count ();
+}
+
+static gdouble
+sessions_gauge (gpointer data) {
+  return valet_sessions_count (data);
+}
+
+static gdouble
+remote_jobs_gauge (gpointer data) {
+  return valet_remote_jobs (data);
+}
+
+static gdouble
+redis_in_flight_gauge (gpointer data) {
+  return valet_redis_in_flight (data);
+}
+
+static gdouble
+redis_queued_gauge (gpointer data) {
+  return valet_redis_queued (data);
+}
+
+/**
+ * Set up the scheduler and register the builtin commands with the dispatcher.
+ * New builtins only need a line here.
+ */
+void
+initialize_responses (Context *context) {
+  GError *error = NULL;
+
+  valet_outbox_start
+    (context->outbox_rate, context->outbox_burst,
+     context->outbox_account_rate, context->outbox_account_burst,
+     context->outbox_max_queued);
+  context->dispatcher = valet_dispatcher_new ();
+  context->scheduler = valet_scheduler_new
+    (context->max_running, context->max_per_sender, command_start, NULL);
+  context->output_cache = valet_cache_new (context->cache_max_entries);
+  context->in_flight = g_hash_table_new (g_str_hash, g_str_equal);
+  context->commands = valet_index_new (context->commands_path);
+  if (NULL != context->plugins_path) {
+    context->plugins = valet_plugins_new
+      (context->plugins_path, context->plugin_threads);
+  }
+  context->sessions = valet_sessions_new
+    (context, context->max_sessions, context->session_idle_timeout);
+  if (NULL != context->remote_commands && NULL == context->redis) {
+    g_warning ("Remote commands need [redis]; running everything here.");
+  }
+  else if (NULL != context->remote_commands) {
+    context->remote = valet_remote_new
+      (context->redis, context->remote_prefix, context->remote_commands);
+  }
+
+  if (!valet_dispatcher_register
+      (context->dispatcher, "#set", "^#set\\s+(\\S+)\\s+(.*)$",
+       "Usage: #set <key> <value>", handle_set_key, &error)
+      || !valet_dispatcher_register
+      (context->dispatcher, "#get", "^#get\\s+(\\S+)",
+       "Usage: #get <key>", handle_get_key, &error)
+      || !valet_dispatcher_register
+      (context->dispatcher, "#mset", "^#mset\\s+(.+)$",
+       "Usage: #mset <key> <value> (one pair per line)", handle_mset, &error)
+      || !valet_dispatcher_register
+      (context->dispatcher, "#mget", "^#mget\\s+(.+)$",
+       "Usage: #mget <key> [<key> ...]", handle_mget, &error)
+      || !valet_dispatcher_register
+      (context->dispatcher, "#keys", "^#keys(?:\\s+(\\S+))?\\s*$",
+       "Usage: #keys [<prefix>]", handle_keys, &error)
+      || !valet_dispatcher_register
+      (context->dispatcher, "#redis", "^#redis\\s*$",
+       "Usage: #redis", handle_redis_status, &error)
+      || !valet_dispatcher_register
+      (context->dispatcher, "#outbox", "^#outbox\\s*$",
+       "Usage: #outbox", handle_outbox, &error)
+      || !valet_dispatcher_register
+      (context->dispatcher, "#session", "^#session\\s+(.+)$",
+       "Usage: #session <command> [args]", handle_session, &error)
+      || !valet_dispatcher_register
+      (context->dispatcher, "#endsession", "^#endsession\\s*$",
+       "Usage: #endsession", handle_end_session, &error)
+      || !valet_dispatcher_register
+      (context->dispatcher, "geo:", "^geo:(.+),(.+)$",
+       NULL, handle_geo, &error)) {
+    g_error ("Error registering builtins: %s\n", error->message);
+  }
+
+  valet_metrics_gauge
+    ("valet_running_commands", "Command processes currently running.",
+     running_gauge, context->scheduler);
+  valet_metrics_gauge
+    ("valet_queued_commands", "Commands waiting for a free slot.",
+     queued_gauge, context->scheduler);
+  valet_metrics_gauge
+    ("valet_outbox_queued", "Messages held back by the rate limits.",
+     outbox_gauge, NULL);
+  valet_metrics_gauge
+    ("valet_child_processes", "Command processes valet is tracking.",
+     children_gauge, NULL);
+  valet_metrics_gauge
+    ("valet_sessions", "Session processes currently running.",
+     sessions_gauge, context->sessions);
+  if (NULL != context->redis) {
+    valet_metrics_gauge
+      ("valet_redis_in_flight", "Redis commands awaiting their reply.",
+       redis_in_flight_gauge, context->redis);
+    valet_metrics_gauge
+      ("valet_redis_queued", "Redis commands waiting to be sent.",
+       redis_queued_gauge, context->redis);
+  }
+  if (NULL != context->remote) {
+    valet_metrics_gauge
+      ("valet_remote_jobs", "Jobs handed to remote workers and not over.",
+       remote_jobs_gauge, context->remote);
+  }
+}
+
+/**
+ * Check the ACL before anything is parsed: one lookup for the sender and
+ * one for the builtin the message starts with. Senders the ACL does not
+ * know are ignored outright, so a crowd of strangers costs no replies.
+ * Commands are checked by spawn_command once tokenized, since markup and
+ * quoting can make the first word something other than what runs. Messages
+ * for an open session are let through, since starting it was checked.
+ */
+static gboolean
+message_allowed (Context *context,
+                 PurpleConvIm *im,
+                 const gchar *jid,
+                 const gchar *buffer) {
+  ValetAclResult result;
+  const gchar *name;
+  gsize length;
+  gboolean builtin;
+
+  if (NULL == context->acl) {
+    return TRUE;
+  }
+
+  builtin = valet_dispatcher_command
+    (context->dispatcher, buffer, &name, &length);
+  if (!builtin && valet_session_exists (context->sessions, im)) {
+    return TRUE;
+  }
+
+  result = valet_acl_check (context->acl, jid, name, length);
+  if (VALET_ACL_ALLOW == result
+      || (!builtin && VALET_ACL_UNKNOWN != result)) {
+    return TRUE;
+  }
+  message_denied (im, result, name, length);
+  return FALSE;
 }
 
 /**
@@ -299,6 +1299,7 @@ received_im (PurpleAccount *account, char *sender, char *buffer,
   Context *context;
 
   context = data;
+  valet_metrics_count (VALET_COUNTER_MESSAGES_RECEIVED);
   conv = ensure_conversation (conv, account, sender);
   im = purple_conversation_get_im_data (conv);
   if (NULL == im) {
@@ -311,19 +1312,16 @@ received_im (PurpleAccount *account, char *sender, char *buffer,
     return;
   }
 
-  if (handle_set_key (context, im, buffer)) {
-    return;
-  }
-
-  else if (handle_get_key (context, im, buffer)) {
+  if (!message_allowed
+      (context, im, purple_normalize (account, sender), buffer)) {
     return;
   }
 
-  else if (handle_geo (context, im, buffer)) {
-    return;
-  }
-
-  else {
-    spawn_command (buffer, im, context);
+  /* Builtins still work in a conversation with a session open, so that it
+   * can be ended; everything else goes to the session. */
+  if (!valet_dispatch (context->dispatcher, context, im, buffer)
+      && !valet_session_send (context->sessions, im, buffer)) {
+    spawn_command (buffer, im,
+                   purple_normalize (account, sender), context);
   }
 }
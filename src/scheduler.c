@@ -0,0 +1,183 @@
+/***
+ * scheduler.c
+ * Admission control for spawned commands: a global cap, a per-sender cap and
+ * fair round-robin queuing for whatever does not fit.
+ */
+
+#include "scheduler.h"
+
+typedef struct {
+  gchar *name;
+  guint running;
+  GQueue pending;
+  gboolean in_ring; /* Whether this sender is waiting its turn */
+} Sender;
+
+struct _Scheduler {
+  guint max_running;
+  guint max_per_sender;
+  guint running;
+  guint queued; /* Items waiting across all senders */
+  GHashTable *senders; /* name -> Sender */
+  GQueue ring; /* Senders with pending work, in the order they will be served */
+  ValetRunFunc run;
+  gpointer data;
+};
+
+static void
+sender_free (gpointer data) {
+  Sender *sender = data;
+  g_free (sender->name);
+  g_free (sender);
+}
+
+Scheduler *
+valet_scheduler_new (guint max_running,
+                     guint max_per_sender,
+                     ValetRunFunc run,
+                     gpointer data) {
+  Scheduler *scheduler;
+
+  scheduler = g_new0 (Scheduler, 1);
+  scheduler->max_running = max_running;
+  scheduler->max_per_sender = max_per_sender;
+  scheduler->senders = g_hash_table_new_full
+    (g_str_hash, g_str_equal, NULL, sender_free);
+  g_queue_init (&scheduler->ring);
+  scheduler->run = run;
+  scheduler->data = data;
+  return scheduler;
+}
+
+/**
+ * Free the scheduler. Anything still queued is leaked to its owner, so only
+ * call this once nothing is pending.
+ */
+void
+valet_scheduler_free (Scheduler *scheduler) {
+  g_queue_clear (&scheduler->ring);
+  g_hash_table_destroy (scheduler->senders);
+  g_free (scheduler);
+}
+
+/**
+ * Forget about senders with nothing running and nothing queued.
+ */
+static void
+sender_maybe_remove (Scheduler *scheduler, Sender *sender) {
+  if (0 == sender->running && g_queue_is_empty (&sender->pending)) {
+    g_hash_table_remove (scheduler->senders, sender->name);
+  }
+}
+
+static void
+start (Scheduler *scheduler, Sender *sender, gpointer item) {
+  scheduler->running++;
+  sender->running++;
+
+  if (!scheduler->run (item, scheduler->data)) {
+    scheduler->running--;
+    sender->running--;
+  }
+}
+
+/**
+ * Start queued work, one item per sender per turn, until we run out of global
+ * slots or every waiting sender is at its own limit.
+ */
+static void
+drain (Scheduler *scheduler) {
+  Sender *sender;
+  gpointer item;
+  guint skipped = 0;
+
+  while (scheduler->running < scheduler->max_running
+         && skipped < scheduler->ring.length) {
+    sender = g_queue_pop_head (&scheduler->ring);
+
+    if (sender->running >= scheduler->max_per_sender) {
+      g_queue_push_tail (&scheduler->ring, sender);
+      skipped++;
+      continue;
+    }
+
+    item = g_queue_pop_head (&sender->pending);
+    scheduler->queued--;
+    if (g_queue_is_empty (&sender->pending)) {
+      sender->in_ring = FALSE;
+    }
+    else {
+      g_queue_push_tail (&scheduler->ring, sender);
+    }
+    skipped = 0;
+
+    start (scheduler, sender, item);
+    sender_maybe_remove (scheduler, sender);
+  }
+}
+
+/**
+ * Run `item` on behalf of `name` as soon as the limits allow.
+ * Returns 0 if it was started right away, otherwise how many of this
+ * sender's items are now waiting.
+ */
+guint
+valet_scheduler_submit (Scheduler *scheduler,
+                        const gchar *name,
+                        gpointer item) {
+  Sender *sender;
+
+  sender = g_hash_table_lookup (scheduler->senders, name);
+  if (NULL == sender) {
+    sender = g_new0 (Sender, 1);
+    sender->name = g_strdup (name);
+    g_queue_init (&sender->pending);
+    g_hash_table_insert (scheduler->senders, sender->name, sender);
+  }
+
+  if (scheduler->running < scheduler->max_running
+      && sender->running < scheduler->max_per_sender
+      && g_queue_is_empty (&sender->pending)) {
+    start (scheduler, sender, item);
+    sender_maybe_remove (scheduler, sender);
+    return 0;
+  }
+
+  g_queue_push_tail (&sender->pending, item);
+  scheduler->queued++;
+  if (!sender->in_ring) {
+    sender->in_ring = TRUE;
+    g_queue_push_tail (&scheduler->ring, sender);
+  }
+  return sender->pending.length;
+}
+
+/**
+ * Give back the slot held by one of `name`'s running items and start
+ * whatever is next.
+ */
+void
+valet_scheduler_release (Scheduler *scheduler, const gchar *name) {
+  Sender *sender;
+
+  sender = g_hash_table_lookup (scheduler->senders, name);
+  if (NULL == sender || 0 == sender->running) {
+    g_warning ("Released a slot %s does not hold.", name);
+    return;
+  }
+
+  scheduler->running--;
+  sender->running--;
+  sender_maybe_remove (scheduler, sender);
+  drain (scheduler);
+}
+
+guint
+valet_scheduler_running (Scheduler *scheduler) {
+  return scheduler->running;
+}
+
+guint
+valet_scheduler_queued (Scheduler *scheduler) {
+  return scheduler->queued;
+}
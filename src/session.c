@@ -0,0 +1,373 @@
+/***
+ * session.c
+ * Long-lived commands that read a conversation's messages on stdin.
+ */
+
+#include <signal.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "session.h"
+#include "executor.h"
+#include "output.h"
+#include "reader.h"
+#include "writer.h"
+#include "tokenize.h"
+
+struct _Sessions {
+  Context *context;
+  guint max_sessions;
+  guint idle_timeout; /* Seconds without input or output before closing */
+  GHashTable *open; /* PurpleConvIm -> Session, until it starts closing */
+  guint count; /* Sessions whose process is still around */
+};
+
+typedef struct {
+  Sessions *sessions;
+  PurpleConvIm *im;
+  gchar *name;
+  GPid pid;
+  gchar *cgroup; /* The session's own cgroup, if any */
+  guint64 kill_grace;
+  PipeWriter *writer;
+  LineReader *readers[2]; /* stdout and stderr */
+  OutputBuffer *output;
+  guint open_streams; /* Output streams not yet at EOF */
+  gboolean exited;
+  gint status; /* Wait status, once exited */
+  gboolean closing; /* Stdin is closed and the process is on notice */
+  gsize output_bytes; /* Since the last message */
+  gboolean truncated; /* Whether that went past the cap */
+  gint64 active; /* Last input or output, in monotonic time */
+  guint idle;
+  guint deadline; /* Pending SIGKILL */
+} Session;
+
+Sessions *
+valet_sessions_new (Context *context, guint max_sessions, guint idle_timeout) {
+  Sessions *sessions;
+
+  sessions = g_new0 (Sessions, 1);
+  sessions->context = context;
+  sessions->max_sessions = max_sessions;
+  sessions->idle_timeout = idle_timeout;
+  sessions->open = g_hash_table_new (g_direct_hash, g_direct_equal);
+  return sessions;
+}
+
+static void
+session_notice (Session *session, const gchar *notice) {
+  valet_output_append (session->output, notice, strlen (notice));
+}
+
+/**
+ * Once the process has exited and both of its output channels are drained,
+ * say so and let go of everything.
+ */
+static void
+session_maybe_finish (Session *session) {
+  gchar *notice;
+
+  if (!session->exited || 0 != session->open_streams) {
+    return;
+  }
+
+  if (!session->closing) {
+    g_hash_table_remove (session->sessions->open, session->im);
+  }
+  if (g_spawn_check_exit_status (session->status, NULL)) {
+    notice = g_strdup_printf ("[session with %s ended]", session->name);
+  }
+  else if (WIFSIGNALED (session->status)) {
+    notice = g_strdup_printf ("[session with %s ended by signal %d]",
+                              session->name, WTERMSIG (session->status));
+  }
+  else {
+    notice = g_strdup_printf ("[session with %s ended with status %d]",
+                              session->name, WEXITSTATUS (session->status));
+  }
+  session_notice (session, notice);
+  g_free (notice);
+
+  if (0 != session->idle) {
+    g_source_remove (session->idle);
+  }
+  if (0 != session->deadline) {
+    g_source_remove (session->deadline);
+  }
+  if (NULL != session->cgroup) {
+    valet_cgroup_free (session->cgroup);
+  }
+  valet_reader_free (session->readers[0]);
+  valet_reader_free (session->readers[1]);
+  valet_writer_free (session->writer);
+  valet_output_free (session->output);
+  session->sessions->count--;
+  g_free (session->name);
+  g_free (session);
+}
+
+/**
+ * The process has had its chance to exit at end of input.
+ */
+static gboolean
+session_kill (gpointer data) {
+  Session *session = data;
+
+  session->deadline = 0;
+  valet_child_kill (session->pid, SIGKILL);
+  if (NULL != session->cgroup) {
+    valet_cgroup_kill (session->cgroup);
+  }
+
+  /* Children it left behind may hold our pipes open for good. */
+  valet_reader_close (session->readers[0]);
+  valet_reader_close (session->readers[1]);
+  session->open_streams = 0;
+  session_maybe_finish (session);
+  return FALSE;
+}
+
+/**
+ * Close the session's stdin, which is how most interactive programs are
+ * asked to quit, and kill it if it has not done so after the grace period.
+ * Messages to the conversation are commands again from now on.
+ */
+static void
+session_stop (Session *session) {
+  if (session->closing) {
+    return;
+  }
+  session->closing = TRUE;
+  g_hash_table_remove (session->sessions->open, session->im);
+  session->im = NULL; /* Its conversation may go before it does */
+  if (0 != session->idle) {
+    g_source_remove (session->idle);
+    session->idle = 0;
+  }
+  valet_writer_close (session->writer);
+  session->deadline = g_timeout_add_seconds
+    (MAX (session->kill_grace, 1), session_kill, session);
+}
+
+/**
+ * Rather than moving a timer on every line, check how long it has really
+ * been whenever it fires and sleep for whatever is left.
+ */
+static gboolean
+session_idle (gpointer data) {
+  Session *session = data;
+  guint timeout = session->sessions->idle_timeout;
+  gint64 idle;
+  gchar *notice;
+
+  idle = (g_get_monotonic_time () - session->active) / G_USEC_PER_SEC;
+  if (idle < timeout) {
+    session->idle = g_timeout_add_seconds
+      (timeout - idle, session_idle, session);
+    return FALSE;
+  }
+
+  session->idle = 0;
+  notice = g_strdup_printf ("[session with %s closed after %us idle]",
+                            session->name, timeout);
+  session_notice (session, notice);
+  g_free (notice);
+  session_stop (session);
+  return FALSE;
+}
+
+/**
+ * Called for each line the session's process writes. As with commands, the
+ * output cap applies to what each message produces, so a runaway loop is
+ * cut short without ending the session.
+ */
+static void
+session_line (const gchar *line, gsize length, gpointer data) {
+  Session *session = data;
+  gsize cap = session->sessions->context->output_cap_bytes;
+  gchar *valid = NULL, *notice;
+
+  session->active = g_get_monotonic_time ();
+  if (session->truncated) {
+    return;
+  }
+  if (session->output_bytes + length > cap) {
+    session->truncated = TRUE;
+    notice = g_strdup_printf
+      ("[output truncated after %" G_GSIZE_FORMAT " bytes]",
+       session->output_bytes);
+    session_notice (session, notice);
+    g_free (notice);
+    return;
+  }
+
+  if (!g_utf8_validate (line, length, NULL)) {
+    valid = g_utf8_make_valid (line, length);
+    line = valid;
+    length = strlen (valid);
+  }
+  valet_output_append (session->output, line, length);
+  session->output_bytes += length;
+  g_free (valid);
+}
+
+static void
+session_stream_closed (gpointer data) {
+  Session *session = data;
+
+  session->open_streams--;
+  session_maybe_finish (session);
+}
+
+static void
+session_process_watch (GPid pid, gint status, gpointer data) {
+  Session *session = data;
+
+  g_debug ("Session process %d exited", pid);
+  g_spawn_close_pid (pid);
+  session->exited = TRUE;
+  session->status = status;
+  session_maybe_finish (session);
+}
+
+/**
+ * Start `argv` (whose first element is the resolved path of the command
+ * called `name`) as the session for `im`. The caller has made sure there is
+ * neither one open already nor too many elsewhere.
+ */
+gboolean
+valet_session_open (Sessions *sessions,
+                    PurpleConvIm *im,
+                    const gchar *name,
+                    gchar **argv,
+                    const ValetLimits *limits,
+                    GError **error) {
+  Context *context = sessions->context;
+  Session *session;
+  GError *cgroup_error = NULL;
+  gchar *cgroup = NULL;
+  gint child_stdin = -1, child_stdout = -1, child_stderr = -1;
+  GPid pid;
+
+  if (NULL != context->cgroup_path) {
+    cgroup = valet_cgroup_new (context->cgroup_path, limits, &cgroup_error);
+    if (NULL == cgroup) {
+      g_warning ("Running a session of %s outside a cgroup: %s",
+                 name, cgroup_error->message);
+      g_error_free (cgroup_error);
+    }
+  }
+
+  if (!valet_executor_spawn
+      (context->commands_path, argv, limits, cgroup,
+       &pid, &child_stdin, &child_stdout, &child_stderr, error)) {
+    if (NULL != cgroup) {
+      valet_cgroup_free (cgroup);
+    }
+    return FALSE;
+  }
+
+  session = g_new0 (Session, 1);
+  session->sessions = sessions;
+  session->im = im;
+  session->name = g_strdup (name);
+  session->pid = pid;
+  session->cgroup = cgroup;
+  session->kill_grace = limits->kill_grace;
+  session->active = g_get_monotonic_time ();
+  session->output = valet_output_new
+    (im, context->output_max_bytes, context->output_flush_ms);
+  /* Each line of output answers something the user just typed. */
+  valet_output_set_priority (session->output, VALET_SEND_INTERACTIVE);
+  session->writer = valet_writer_stream (child_stdin);
+  session->open_streams = 2;
+  session->readers[0] = valet_reader_new
+    (child_stdout, context->read_buffer_bytes,
+     session_line, session_stream_closed, session);
+  session->readers[1] = valet_reader_new
+    (child_stderr, context->read_buffer_bytes,
+     session_line, session_stream_closed, session);
+  session->idle = g_timeout_add_seconds
+    (sessions->idle_timeout, session_idle, session);
+  valet_child_watch (pid, session_process_watch, session);
+
+  g_hash_table_insert (sessions->open, im, session);
+  sessions->count++;
+  return TRUE;
+}
+
+gboolean
+valet_session_exists (Sessions *sessions, PurpleConvIm *im) {
+  return NULL != g_hash_table_lookup (sessions->open, im);
+}
+
+/**
+ * Write `message` to the stdin of the session open in `im`, as one line of
+ * plain text. Returns FALSE if there is no session there. A program that
+ * does not read what it is sent gets no more, and input it has not taken
+ * does not keep the session from going idle.
+ */
+gboolean
+valet_session_send (Sessions *sessions,
+                    PurpleConvIm *im,
+                    const gchar *message) {
+  Session *session;
+  gchar *text, *notice;
+  gsize length;
+  gboolean newline;
+
+  session = g_hash_table_lookup (sessions->open, im);
+  if (NULL == session) {
+    return FALSE;
+  }
+
+  text = valet_markup_strip (message, strlen (message));
+  length = strlen (text);
+  newline = 0 == length || '\n' != text[length - 1];
+  if (valet_writer_pending (session->writer) + length + newline
+      > sessions->context->session_max_input
+      || !valet_writer_append (session->writer, text, length)
+      || (newline && !valet_writer_append (session->writer, "\n", 1))) {
+    notice = length + newline > sessions->context->session_max_input
+      ? g_strdup_printf ("[message too long for session with %s]",
+                         session->name)
+      : g_strdup_printf ("[session with %s is not reading its input]",
+                         session->name);
+    session_notice (session, notice);
+    g_free (notice);
+  }
+  else {
+    session->active = g_get_monotonic_time ();
+    session->output_bytes = 0;
+    session->truncated = FALSE;
+  }
+  g_free (text);
+  return TRUE;
+}
+
+/**
+ * Close the session open in `im`. Returns FALSE if there is none.
+ */
+gboolean
+valet_session_close (Sessions *sessions, PurpleConvIm *im) {
+  Session *session;
+
+  session = g_hash_table_lookup (sessions->open, im);
+  if (NULL == session) {
+    return FALSE;
+  }
+  session_stop (session);
+  return TRUE;
+}
+
+gboolean
+valet_sessions_full (Sessions *sessions) {
+  return sessions->count >= sessions->max_sessions;
+}
+
+guint
+valet_sessions_count (Sessions *sessions) {
+  return sessions->count;
+}
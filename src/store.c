@@ -0,0 +1,376 @@
+/***
+ * store.c
+ * The embedded key-value store used when there is no redis server.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "store.h"
+
+#define SNAPSHOT_NAME "snapshot"
+#define SNAPSHOT_TEMP "snapshot.tmp"
+#define LOG_NAME      "log"
+#define SNAPSHOT_MAGIC "VALETKV1"
+
+/*
+ * Snapshot and log are sequences of the same record:
+ *   u32 key length | u32 value length | u32 checksum | key | value
+ * with little-endian integers. A record that is cut short or fails its
+ * checksum ends the file; in the log that is a write torn by a crash.
+ */
+#define RECORD_HEADER 12
+
+struct _Store {
+  gchar *dir;
+  GHashTable *entries; /* key -> value */
+  int log_fd;
+  gsize log_bytes;
+  gsize snapshot_bytes;
+  gsize compact_bytes; /* Log growth tolerated beyond the snapshot size */
+  guint compact;
+};
+
+/**
+ * FNV-1a, enough to tell a torn record from a whole one.
+ */
+static guint32
+record_checksum (const gchar *key, gsize key_len,
+                 const gchar *value, gsize value_len) {
+  guint32 hash = 2166136261u;
+  gsize i;
+
+  for (i = 0; i < key_len; i++) {
+    hash = (hash ^ (guint8) key[i]) * 16777619u;
+  }
+  for (i = 0; i < value_len; i++) {
+    hash = (hash ^ (guint8) value[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static void
+record_append (GByteArray *buffer, const gchar *key, const gchar *value) {
+  guint32 header[3];
+  gsize key_len = strlen (key), value_len = strlen (value);
+
+  header[0] = GUINT32_TO_LE ((guint32) key_len);
+  header[1] = GUINT32_TO_LE ((guint32) value_len);
+  header[2] = GUINT32_TO_LE
+    (record_checksum (key, key_len, value, value_len));
+  g_byte_array_append (buffer, (const guint8 *) header, RECORD_HEADER);
+  g_byte_array_append (buffer, (const guint8 *) key, key_len);
+  g_byte_array_append (buffer, (const guint8 *) value, value_len);
+}
+
+/**
+ * Apply the records in `data` to the store. Returns how many bytes held
+ * whole records.
+ */
+static gsize
+store_replay (Store *store, const gchar *data, gsize length) {
+  guint32 header[3];
+  gsize offset = 0, key_len, value_len;
+  const gchar *key, *value;
+
+  while (length - offset >= RECORD_HEADER) {
+    memcpy (header, data + offset, RECORD_HEADER);
+    key_len = GUINT32_FROM_LE (header[0]);
+    value_len = GUINT32_FROM_LE (header[1]);
+    if (length - offset - RECORD_HEADER < key_len + value_len) {
+      break;
+    }
+
+    key = data + offset + RECORD_HEADER;
+    value = key + key_len;
+    if (GUINT32_FROM_LE (header[2])
+        != record_checksum (key, key_len, value, value_len)) {
+      break;
+    }
+
+    g_hash_table_replace (store->entries,
+                          g_strndup (key, key_len),
+                          g_strndup (value, value_len));
+    offset += RECORD_HEADER + key_len + value_len;
+  }
+  return offset;
+}
+
+static gboolean
+store_load_snapshot (Store *store, GError **error) {
+  gchar *path, *data;
+  gsize length, magic = strlen (SNAPSHOT_MAGIC);
+  GError *local_error = NULL;
+
+  path = g_build_filename (store->dir, SNAPSHOT_NAME, NULL);
+  if (!g_file_get_contents (path, &data, &length, &local_error)) {
+    g_free (path);
+    if (g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+      g_error_free (local_error);
+      return TRUE;
+    }
+    g_propagate_error (error, local_error);
+    return FALSE;
+  }
+
+  /* Snapshots are only ever renamed into place whole. */
+  if (length < magic || 0 != memcmp (data, SNAPSHOT_MAGIC, magic)
+      || store_replay (store, data + magic, length - magic)
+      != length - magic) {
+    g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                 "%s is corrupt", path);
+    g_free (data);
+    g_free (path);
+    return FALSE;
+  }
+
+  store->snapshot_bytes = length;
+  g_free (data);
+  g_free (path);
+  return TRUE;
+}
+
+static gboolean
+store_load_log (Store *store, GError **error) {
+  gchar *path, *data = NULL;
+  gsize length = 0, valid;
+  GError *local_error = NULL;
+
+  path = g_build_filename (store->dir, LOG_NAME, NULL);
+  if (!g_file_get_contents (path, &data, &length, &local_error)) {
+    if (!g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+      g_propagate_error (error, local_error);
+      g_free (path);
+      return FALSE;
+    }
+    g_error_free (local_error);
+  }
+
+  valid = store_replay (store, data, length);
+  g_free (data);
+
+  store->log_fd = open (path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (-1 == store->log_fd) {
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                 "Cannot open %s: %s", path, g_strerror (errno));
+    g_free (path);
+    return FALSE;
+  }
+
+  if (valid != length) {
+    g_warning ("Dropping %" G_GSIZE_FORMAT " bytes of torn writes from %s",
+               length - valid, path);
+    if (0 != ftruncate (store->log_fd, valid)) {
+      g_warning ("Cannot truncate %s: %s", path, g_strerror (errno));
+    }
+  }
+  store->log_bytes = valid;
+  g_free (path);
+  return TRUE;
+}
+
+/**
+ * Open the store in `dir`, creating it if need be. The log is compacted
+ * once it is `compact_bytes` larger than the snapshot.
+ */
+Store *
+valet_store_open (const gchar *dir, gsize compact_bytes, GError **error) {
+  Store *store;
+
+  if (0 != g_mkdir_with_parents (dir, 0700)) {
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                 "Cannot create %s: %s", dir, g_strerror (errno));
+    return NULL;
+  }
+
+  store = g_new0 (Store, 1);
+  store->dir = g_strdup (dir);
+  store->entries = g_hash_table_new_full
+    (g_str_hash, g_str_equal, g_free, g_free);
+  store->log_fd = -1;
+  store->compact_bytes = compact_bytes;
+
+  if (!store_load_snapshot (store, error) || !store_load_log (store, error)) {
+    valet_store_close (store);
+    return NULL;
+  }
+
+  g_message ("Loaded %u keys from %s",
+             g_hash_table_size (store->entries), store->dir);
+  return store;
+}
+
+void
+valet_store_close (Store *store) {
+  if (0 != store->compact) {
+    g_source_remove (store->compact);
+  }
+  if (-1 != store->log_fd) {
+    close (store->log_fd);
+  }
+  g_hash_table_destroy (store->entries);
+  g_free (store->dir);
+  g_free (store);
+}
+
+static gboolean
+store_compact_idle (gpointer data) {
+  Store *store = data;
+  GError *error = NULL;
+
+  store->compact = 0;
+  if (!valet_store_compact (store, &error)) {
+    g_warning ("Cannot compact the kvstore: %s", error->message);
+    g_error_free (error);
+  }
+  return FALSE;
+}
+
+/**
+ * Set `key` to `value`. The change is in the log before this returns, so it
+ * survives the process dying; it is not synced to the disk.
+ */
+gboolean
+valet_store_set (Store *store, const gchar *key, const gchar *value) {
+  GByteArray *record;
+  gsize written = 0;
+  ssize_t n;
+
+  record = g_byte_array_new ();
+  record_append (record, key, value);
+
+  while (written < record->len) {
+    n = write (store->log_fd, record->data + written, record->len - written);
+    if (n < 0 && EINTR == errno) {
+      continue;
+    }
+    if (n < 0) {
+      g_warning ("Cannot write to the kvstore log: %s", g_strerror (errno));
+      /* Cut off whatever part of the record did make it. */
+      if (written > 0 && 0 != ftruncate (store->log_fd, store->log_bytes)) {
+        g_warning ("Cannot truncate the kvstore log: %s", g_strerror (errno));
+      }
+      g_byte_array_free (record, TRUE);
+      return FALSE;
+    }
+    written += n;
+  }
+  store->log_bytes += record->len;
+  g_byte_array_free (record, TRUE);
+
+  g_hash_table_replace (store->entries, g_strdup (key), g_strdup (value));
+
+  if (0 == store->compact
+      && store->log_bytes > store->snapshot_bytes + store->compact_bytes) {
+    store->compact = g_idle_add (store_compact_idle, store);
+  }
+  return TRUE;
+}
+
+/**
+ * Look up `key`. The returned string belongs to the store and is only valid
+ * until `key` is next set.
+ */
+const gchar *
+valet_store_get (Store *store, const gchar *key) {
+  return g_hash_table_lookup (store->entries, key);
+}
+
+/**
+ * List the keys starting with `prefix`, sorted. Free the array, not the keys.
+ */
+const gchar **
+valet_store_keys (Store *store, const gchar *prefix) {
+  GPtrArray *keys;
+  GHashTableIter iter;
+  gpointer key;
+
+  keys = g_ptr_array_new ();
+  g_hash_table_iter_init (&iter, store->entries);
+  while (g_hash_table_iter_next (&iter, &key, NULL)) {
+    if (g_str_has_prefix (key, prefix)) {
+      g_ptr_array_add (keys, key);
+    }
+  }
+  g_ptr_array_sort (keys, (GCompareFunc) g_strcmp0);
+  g_ptr_array_add (keys, NULL);
+  return (const gchar **) g_ptr_array_free (keys, FALSE);
+}
+
+static gboolean
+write_all (int fd, const guint8 *data, gsize length) {
+  ssize_t n;
+
+  while (length > 0) {
+    n = write (fd, data, length);
+    if (n < 0 && EINTR == errno) {
+      continue;
+    }
+    if (n < 0) {
+      return FALSE;
+    }
+    data += n;
+    length -= n;
+  }
+  return TRUE;
+}
+
+/**
+ * Write every key to a new snapshot and empty the log.
+ *
+ * The snapshot is synced and renamed into place before the log is
+ * truncated. Should we die between the two, the next start replays a log
+ * whose changes the snapshot already contains, which is harmless.
+ */
+gboolean
+valet_store_compact (Store *store, GError **error) {
+  GByteArray *snapshot;
+  GHashTableIter iter;
+  gpointer key, value;
+  gchar *temp, *path;
+  gboolean ok;
+  int fd;
+
+  snapshot = g_byte_array_new ();
+  g_byte_array_append
+    (snapshot, (const guint8 *) SNAPSHOT_MAGIC, strlen (SNAPSHOT_MAGIC));
+  g_hash_table_iter_init (&iter, store->entries);
+  while (g_hash_table_iter_next (&iter, &key, &value)) {
+    record_append (snapshot, key, value);
+  }
+
+  temp = g_build_filename (store->dir, SNAPSHOT_TEMP, NULL);
+  path = g_build_filename (store->dir, SNAPSHOT_NAME, NULL);
+
+  fd = open (temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  ok = -1 != fd
+    && write_all (fd, snapshot->data, snapshot->len)
+    && 0 == fsync (fd);
+  if (-1 != fd) {
+    ok = 0 == close (fd) && ok;
+  }
+  ok = ok && 0 == rename (temp, path);
+
+  if (!ok) {
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                 "Cannot write %s: %s", temp, g_strerror (errno));
+    unlink (temp);
+  }
+  else {
+    store->snapshot_bytes = snapshot->len;
+    if (0 != ftruncate (store->log_fd, 0)) {
+      /* Still consistent: the log only repeats the snapshot. */
+      g_warning ("Cannot truncate the kvstore log: %s", g_strerror (errno));
+    }
+    else {
+      store->log_bytes = 0;
+    }
+  }
+
+  g_byte_array_free (snapshot, TRUE);
+  g_free (path);
+  g_free (temp);
+  return ok;
+}
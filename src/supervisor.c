@@ -0,0 +1,471 @@
+/***
+ * supervisor.c
+ * Runs several valet workers side by side and keeps them alive.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+#include <glib-unix.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#include "supervisor.h"
+#include "scheduler.h"
+#include "outbox.h"
+#include "metrics.h"
+#include "reader.h"
+
+/* Workers inherit the write end of their heartbeat pipe as this fd. */
+#define HEARTBEAT_FD 3
+
+/* Heartbeats a worker may miss before it is presumed stuck. */
+#define HEARTBEAT_MISSES 3
+
+#define RESTART_MIN_MS 1000
+#define RESTART_MAX_MS 60000
+/* A worker that lasted this long gets restarted without delay. */
+#define RESTART_RESET_US (60 * G_USEC_PER_SEC)
+
+typedef struct _Supervisor Supervisor;
+
+typedef struct {
+  Supervisor *supervisor;
+  guint index;
+  GPid pid; /* 0 while not running */
+  LineReader *heartbeats;
+  gint64 started;
+  gint64 last_heartbeat;
+  guint backoff_ms;
+  guint restart;
+  /* As of the last heartbeat */
+  guint running;
+  guint queued;
+  guint outbox;
+} Worker;
+
+struct _Supervisor {
+  gchar *program; /* argv[0], for the workers' benefit */
+  gchar *config_path;
+  guint interval; /* Seconds between heartbeats */
+  Worker *workers;
+  guint n_workers;
+};
+
+static void
+worker_start (Worker *);
+
+/**
+ * Each heartbeat is a line of three numbers: commands running, commands
+ * queued and messages held in the outbox.
+ */
+static void
+worker_heartbeat (const gchar *line, gsize length, gpointer data) {
+  Worker *worker = data;
+  gchar buffer[64];
+
+  length = MIN (length, sizeof (buffer) - 1);
+  memcpy (buffer, line, length);
+  buffer[length] = '\0';
+
+  if (3 == sscanf (buffer, "%u %u %u",
+                   &worker->running, &worker->queued, &worker->outbox)) {
+    worker->last_heartbeat = g_get_monotonic_time ();
+  }
+}
+
+static void
+worker_heartbeat_eof (gpointer data G_GNUC_UNUSED) {
+  /* The worker is exiting; its child watch will take it from here. */
+}
+
+static gboolean
+worker_restart (gpointer data) {
+  Worker *worker = data;
+
+  worker->restart = 0;
+  worker_start (worker);
+  return FALSE;
+}
+
+static void
+worker_exited (GPid pid, gint status, gpointer data) {
+  Worker *worker = data;
+  GError *error = NULL;
+
+  g_spawn_close_pid (pid);
+  worker->pid = 0;
+  if (!g_spawn_check_exit_status (status, &error)) {
+    g_warning ("Worker %u (%d) died: %s", worker->index, pid, error->message);
+    g_error_free (error);
+  }
+  else {
+    g_warning ("Worker %u (%d) exited", worker->index, pid);
+  }
+  valet_metrics_count (VALET_COUNTER_WORKER_RESTARTS);
+
+  /* Only a worker that keeps dying is held back. */
+  if (g_get_monotonic_time () - worker->started > RESTART_RESET_US) {
+    worker->backoff_ms = RESTART_MIN_MS;
+  }
+  g_message ("Restarting worker %u in %ums",
+             worker->index, worker->backoff_ms);
+  worker->restart = g_timeout_add
+    (worker->backoff_ms, worker_restart, worker);
+  worker->backoff_ms = MIN (worker->backoff_ms * 2, RESTART_MAX_MS);
+}
+
+/**
+ * Runs in the worker between fork and exec: put the heartbeat pipe where
+ * the worker expects it, and have the worker die along with us.
+ */
+static void
+worker_child_setup (gpointer data) {
+  gint fd = GPOINTER_TO_INT (data);
+
+  if (HEARTBEAT_FD == fd) {
+    fcntl (fd, F_SETFD, 0);
+  }
+  else {
+    dup2 (fd, HEARTBEAT_FD);
+  }
+#ifdef __linux__
+  prctl (PR_SET_PDEATHSIG, SIGTERM);
+#endif
+}
+
+/**
+ * Start a fresh copy of valet as worker `worker->index`, from the binary
+ * on disk so that it does not inherit any of our main loop.
+ */
+static void
+worker_start (Worker *worker) {
+  Supervisor *supervisor = worker->supervisor;
+  gchar *argv[7], index[16];
+  GError *error = NULL;
+  gint fds[2];
+
+  if (!g_unix_open_pipe (fds, FD_CLOEXEC, &error)) {
+    g_warning ("Cannot start worker %u: %s", worker->index, error->message);
+    g_error_free (error);
+    worker->restart = g_timeout_add
+      (worker->backoff_ms, worker_restart, worker);
+    return;
+  }
+
+  g_snprintf (index, sizeof (index), "%u", worker->index);
+  argv[0] = "/proc/self/exe";
+  argv[1] = supervisor->program;
+  argv[2] = "--config";
+  argv[3] = supervisor->config_path;
+  argv[4] = "--worker";
+  argv[5] = index;
+  argv[6] = NULL;
+
+  if (!g_spawn_async
+      (NULL, argv, NULL,
+       G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_FILE_AND_ARGV_ZERO,
+       worker_child_setup, GINT_TO_POINTER (fds[1]),
+       &worker->pid, &error)) {
+    g_warning ("Cannot start worker %u: %s", worker->index, error->message);
+    g_error_free (error);
+    close (fds[0]);
+    close (fds[1]);
+    worker->pid = 0;
+    worker->restart = g_timeout_add
+      (worker->backoff_ms, worker_restart, worker);
+    return;
+  }
+  close (fds[1]);
+
+  g_message ("Started worker %u (%d)", worker->index, worker->pid);
+  worker->started = g_get_monotonic_time ();
+  worker->last_heartbeat = worker->started;
+  worker->running = worker->queued = worker->outbox = 0;
+  if (NULL != worker->heartbeats) {
+    valet_reader_free (worker->heartbeats);
+  }
+  worker->heartbeats = valet_reader_new
+    (fds[0], 64, worker_heartbeat, worker_heartbeat_eof, worker);
+  g_child_watch_add (worker->pid, worker_exited, worker);
+}
+
+/**
+ * Kill workers that have gone quiet; they are restarted once they exit.
+ */
+static gboolean
+supervisor_check (gpointer data) {
+  Supervisor *supervisor = data;
+  gint64 now, deadline;
+  Worker *worker;
+  guint i;
+
+  now = g_get_monotonic_time ();
+  deadline = (gint64) supervisor->interval * HEARTBEAT_MISSES
+    * G_USEC_PER_SEC;
+  for (i = 0; i < supervisor->n_workers; i++) {
+    worker = &supervisor->workers[i];
+    if (0 != worker->pid && now - worker->last_heartbeat > deadline) {
+      g_warning ("Worker %u (%d) missed its heartbeats; killing it",
+                 worker->index, worker->pid);
+      kill (worker->pid, SIGKILL);
+    }
+  }
+  return TRUE;
+}
+
+/**
+ * Workers read the configuration for themselves; a SIGHUP to the supervisor
+ * is passed on to each of them. Workers started later read it anyway.
+ */
+static gboolean
+supervisor_reload (gpointer data) {
+  Supervisor *supervisor = data;
+  guint i;
+
+  for (i = 0; i < supervisor->n_workers; i++) {
+    if (0 != supervisor->workers[i].pid) {
+      kill (supervisor->workers[i].pid, SIGHUP);
+    }
+  }
+  return TRUE;
+}
+
+static gdouble
+workers_alive_gauge (gpointer data) {
+  Supervisor *supervisor = data;
+  guint i, alive = 0;
+
+  for (i = 0; i < supervisor->n_workers; i++) {
+    alive += 0 != supervisor->workers[i].pid;
+  }
+  return alive;
+}
+
+static gdouble
+workers_running_gauge (gpointer data) {
+  Supervisor *supervisor = data;
+  guint i, total = 0;
+
+  for (i = 0; i < supervisor->n_workers; i++) {
+    total += supervisor->workers[i].running;
+  }
+  return total;
+}
+
+static gdouble
+workers_queued_gauge (gpointer data) {
+  Supervisor *supervisor = data;
+  guint i, total = 0;
+
+  for (i = 0; i < supervisor->n_workers; i++) {
+    total += supervisor->workers[i].queued;
+  }
+  return total;
+}
+
+static gdouble
+workers_outbox_gauge (gpointer data) {
+  Supervisor *supervisor = data;
+  guint i, total = 0;
+
+  for (i = 0; i < supervisor->n_workers; i++) {
+    total += supervisor->workers[i].outbox;
+  }
+  return total;
+}
+
+/**
+ * Whether every worker has a [worker.<index>] account of its own. Servers
+ * may deliver a message to just one resource of a shared account, so
+ * workers signed in to the same one could not split buddies between them.
+ */
+static gboolean
+workers_have_accounts (const gchar *config_path, guint n_workers) {
+  GKeyFile *keyfile;
+  gchar *group;
+  gboolean found = TRUE;
+  guint i;
+
+  keyfile = g_key_file_new ();
+  if (!g_key_file_load_from_file
+      (keyfile, config_path, G_KEY_FILE_NONE, NULL)) {
+    g_key_file_free (keyfile);
+    return FALSE;
+  }
+  for (i = 0; found && i < n_workers; i++) {
+    group = g_strdup_printf ("worker.%u", i);
+    if (!g_key_file_has_key (keyfile, group, "username", NULL)) {
+      g_critical ("[%s] names no account; every worker needs its own.",
+                  group);
+      found = FALSE;
+    }
+    g_free (group);
+  }
+  g_key_file_free (keyfile);
+  return found;
+}
+
+/**
+ * Run as the supervisor of `context->workers` workers until `loop` is
+ * quit, then stop them. Returns the exit code for main.
+ */
+int
+valet_supervise (Context *context,
+                 const gchar *program,
+                 const gchar *config_path,
+                 GMainLoop *loop) {
+  Supervisor *supervisor;
+  Worker *worker;
+  GError *error = NULL;
+  guint i;
+
+  if (!workers_have_accounts (config_path, context->workers)) {
+    return 1;
+  }
+
+  supervisor = g_new0 (Supervisor, 1);
+  supervisor->program = g_strdup (program);
+  supervisor->config_path = g_strdup (config_path);
+  supervisor->interval = context->heartbeat_interval;
+  supervisor->n_workers = context->workers;
+  supervisor->workers = g_new0 (Worker, context->workers);
+
+  valet_metrics_gauge
+    ("valet_workers_alive", "Worker processes currently running.",
+     workers_alive_gauge, supervisor);
+  valet_metrics_gauge
+    ("valet_workers_running_commands", "Commands running in all workers.",
+     workers_running_gauge, supervisor);
+  valet_metrics_gauge
+    ("valet_workers_queued_commands", "Commands queued in all workers.",
+     workers_queued_gauge, supervisor);
+  valet_metrics_gauge
+    ("valet_workers_outbox_queued", "Messages held back in all workers.",
+     workers_outbox_gauge, supervisor);
+  if (!valet_metrics_listen
+      (context->metrics_socket, context->metrics_port, &error)) {
+    g_warning ("Metrics unavailable: %s", error->message);
+    g_error_free (error);
+  }
+
+  for (i = 0; i < supervisor->n_workers; i++) {
+    worker = &supervisor->workers[i];
+    worker->supervisor = supervisor;
+    worker->index = i;
+    worker->backoff_ms = RESTART_MIN_MS;
+    worker_start (worker);
+  }
+  g_timeout_add_seconds (supervisor->interval, supervisor_check, supervisor);
+  g_unix_signal_add (SIGHUP, supervisor_reload, supervisor);
+
+  g_main_loop_run (loop);
+
+  for (i = 0; i < supervisor->n_workers; i++) {
+    if (0 != supervisor->workers[i].pid) {
+      kill (supervisor->workers[i].pid, SIGTERM);
+    }
+  }
+  return 0;
+}
+
+/**
+ * Make `context` that of worker `index`: its own account,
+ * libpurple directory and metrics endpoints. A [worker.<index>] group in
+ * the configuration names the worker's account; valet_supervise starts no
+ * workers without one each.
+ */
+void
+valet_worker_configure (Context *context,
+                        const gchar *config_path,
+                        guint index) {
+  GKeyFile *keyfile;
+  gchar *group, *username, *password, *path, *suffix;
+
+  context->worker = index;
+
+  keyfile = g_key_file_new ();
+  group = g_strdup_printf ("worker.%u", index);
+  if (g_key_file_load_from_file
+      (keyfile, config_path, G_KEY_FILE_NONE, NULL)) {
+    username = g_key_file_get_string (keyfile, group, "username", NULL);
+    if (NULL != username) {
+      password = g_key_file_get_string (keyfile, group, "password", NULL);
+      g_free (context->username);
+      context->username = username;
+      if (NULL != password) {
+        g_free (context->password);
+        context->password = password;
+      }
+    }
+  }
+  g_key_file_free (keyfile);
+  g_free (group);
+
+  suffix = g_strdup_printf ("worker-%u", index);
+  if (NULL != context->purple_data) {
+    path = g_build_filename (context->purple_data, suffix, NULL);
+    g_free (context->purple_data);
+    context->purple_data = path;
+    g_mkdir_with_parents (path, 0700);
+  }
+  if (NULL != context->store_path) {
+    if (0 == index) {
+      g_warning ("Workers share no kvstore without [redis]; "
+                 "each keeps its own.");
+    }
+    path = g_build_filename (context->store_path, suffix, NULL);
+    g_free (context->store_path);
+    context->store_path = path;
+  }
+  g_free (suffix);
+
+  if (NULL != context->metrics_socket) {
+    path = g_strdup_printf ("%s.%u", context->metrics_socket, index);
+    g_free (context->metrics_socket);
+    context->metrics_socket = path;
+  }
+  if (0 != context->metrics_port) {
+    context->metrics_port += 1 + index;
+  }
+
+  /* One bonjour presence is plenty. */
+  if (0 != index) {
+    context->bonjour_enabled = FALSE;
+  }
+}
+
+static gboolean
+worker_beat (gpointer data) {
+  Context *context = data;
+  gchar line[64];
+  gint length;
+
+  length = g_snprintf
+    (line, sizeof (line), "%u %u %u\n",
+     valet_scheduler_running (context->scheduler),
+     valet_scheduler_queued (context->scheduler),
+     valet_outbox_queued ());
+  if (write (HEARTBEAT_FD, line, length) < 0 && EAGAIN != errno) {
+    g_warning ("Lost the supervisor (%s); exiting.", g_strerror (errno));
+    exit (EXIT_FAILURE);
+  }
+  return TRUE;
+}
+
+/**
+ * Tell the supervisor that this worker is alive, and how busy it is, every
+ * `context->heartbeat_interval` seconds.
+ */
+void
+valet_worker_heartbeat (Context *context) {
+  fcntl (HEARTBEAT_FD, F_SETFL,
+         fcntl (HEARTBEAT_FD, F_GETFL) | O_NONBLOCK);
+  worker_beat (context);
+  g_timeout_add_seconds (context->heartbeat_interval, worker_beat, context);
+}
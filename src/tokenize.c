@@ -0,0 +1,262 @@
+/***
+ * tokenize.c
+ * Turns incoming messages into argument vectors and plain text.
+ */
+
+#include <string.h>
+
+#include "tokenize.h"
+
+/* Longest entity we decode, eg "&#x10FFFF;" */
+#define ENTITY_MAX 10
+
+static const struct {
+  const gchar *name;
+  gchar c;
+} entities[] = {
+  { "lt", '<' },
+  { "gt", '>' },
+  { "amp", '&' },
+  { "quot", '"' },
+  { "apos", '\'' },
+  { "nbsp", ' ' }
+};
+
+typedef struct {
+  const gchar *p;
+  const gchar *end;
+  gboolean markup;
+} Scanner;
+
+static gboolean
+is_space (gchar c) {
+  return ' ' == c || '\t' == c || '\n' == c || '\r' == c
+    || '\v' == c || '\f' == c;
+}
+
+/**
+ * Whether the tag starting at `tag` (just past its '<') breaks the line.
+ */
+static gboolean
+tag_breaks_line (const gchar *tag, const gchar *end) {
+  gboolean closing = FALSE;
+  gsize length;
+
+  if (tag < end && '/' == *tag) {
+    closing = TRUE;
+    tag++;
+  }
+  for (length = 0; tag + length < end && g_ascii_isalpha (tag[length]);
+       length++);
+
+  if (2 == length && 0 == g_ascii_strncasecmp (tag, "br", 2)) {
+    return TRUE;
+  }
+  return closing
+    && ((1 == length && 0 == g_ascii_strncasecmp (tag, "p", 1))
+        || (3 == length && 0 == g_ascii_strncasecmp (tag, "div", 3)));
+}
+
+/**
+ * Decode the entity starting at `s->p` (its '&') into `out`. Returns the
+ * number of bytes written, or 0 if it is not an entity we know.
+ */
+static gsize
+entity_decode (Scanner *s, gchar *out) {
+  const gchar *name, *semicolon, *digits;
+  gboolean hex;
+  gunichar c;
+  gchar *digits_end;
+  gsize length, i;
+
+  name = s->p + 1;
+  semicolon = memchr (name, ';', MIN (ENTITY_MAX, s->end - name));
+  if (NULL == semicolon) {
+    return 0;
+  }
+  length = semicolon - name;
+
+  if ('#' == name[0] && length > 1) {
+    hex = 'x' == name[1] || 'X' == name[1];
+    digits = name + (hex ? 2 : 1);
+    /* strtoull would also take signs and leading spaces. */
+    if (digits == semicolon || !g_ascii_isxdigit (*digits)) {
+      return 0;
+    }
+    c = g_ascii_strtoull (digits, &digits_end, hex ? 16 : 10);
+    if (digits_end != semicolon || 0 == c || !g_unichar_validate (c)) {
+      return 0;
+    }
+    s->p = semicolon + 1;
+    return g_unichar_to_utf8 (c, out);
+  }
+
+  for (i = 0; i < G_N_ELEMENTS (entities); i++) {
+    if (length == strlen (entities[i].name)
+        && 0 == memcmp (name, entities[i].name, length)) {
+      s->p = semicolon + 1;
+      *out = entities[i].c;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Read the next character of text into `out`. Returns its length in bytes
+ * (several for decoded entities), or 0 at the end. Markup tags produce
+ * nothing, except for line breaks which come out as '\n'. NUL bytes are
+ * dropped so that arguments stay C strings.
+ */
+static gsize
+scanner_next (Scanner *s, gchar *out) {
+  const gchar *close;
+  gboolean line_break;
+  gsize length;
+
+  while (s->p < s->end) {
+    if ('\0' == *s->p) {
+      s->p++;
+      continue;
+    }
+    if (s->markup && '<' == *s->p
+        && NULL != (close = memchr (s->p, '>', s->end - s->p))) {
+      line_break = tag_breaks_line (s->p + 1, close);
+      s->p = close + 1;
+      if (line_break) {
+        *out = '\n';
+        return 1;
+      }
+      continue;
+    }
+    if (s->markup && '&' == *s->p
+        && 0 != (length = entity_decode (s, out))) {
+      return length;
+    }
+    *out = *s->p++;
+    return 1;
+  }
+  return 0;
+}
+
+gchar **
+valet_tokenize (Arena *arena,
+                const gchar *text,
+                gsize length,
+                ValetTokenizeFlags flags,
+                const gchar **rest) {
+  Scanner s = { text, text + length, flags & VALET_TOKENIZE_MARKUP };
+  gchar *buffer, *out, **tokens, c[8], quote = 0;
+  gboolean in_token = FALSE;
+  guint count = 0, i;
+  gsize n;
+
+  if (NULL != rest) {
+    *rest = NULL;
+  }
+
+  /* Decoding never lengthens the text, and every argument but the last is
+   * followed by at least one separator, so the output fits in place of the
+   * input. */
+  buffer = out = valet_arena_alloc (arena, length + 1);
+
+  while (0 != (n = scanner_next (&s, c))) {
+    if (1 < n) {
+      /* Multibyte characters are never special. */
+      memcpy (out, c, n);
+      out += n;
+      in_token = TRUE;
+      continue;
+    }
+
+    if ('\'' == quote) {
+      if ('\'' == c[0]) {
+        quote = 0;
+      }
+      else {
+        *out++ = c[0];
+      }
+      continue;
+    }
+
+    if ('"' == quote) {
+      if ('"' == c[0]) {
+        quote = 0;
+        continue;
+      }
+      if ('\\' == c[0]) {
+        n = scanner_next (&s, c);
+        if (1 != n || ('"' != c[0] && '\\' != c[0])) {
+          *out++ = '\\';
+        }
+      }
+      memcpy (out, c, n);
+      out += n;
+      continue;
+    }
+
+    if (is_space (c[0])) {
+      if (in_token) {
+        *out++ = '\0';
+        count++;
+        in_token = FALSE;
+      }
+      if ('\n' == c[0] && (flags & VALET_TOKENIZE_FIRST_LINE)) {
+        if (NULL != rest) {
+          *rest = s.p;
+        }
+        break;
+      }
+      continue;
+    }
+
+    if ('\\' == c[0]) {
+      n = scanner_next (&s, c);
+      if (1 == n && '\n' == c[0]) {
+        /* An escaped line break just continues the line. */
+        continue;
+      }
+      if (0 == n) {
+        c[0] = '\\';
+        n = 1;
+      }
+    }
+    else if ('\'' == c[0] || '"' == c[0]) {
+      quote = c[0];
+      in_token = TRUE;
+      continue;
+    }
+    in_token = TRUE;
+    memcpy (out, c, n);
+    out += n;
+  }
+  if (in_token) {
+    *out++ = '\0';
+    count++;
+  }
+
+  tokens = valet_arena_alloc (arena, (count + 1) * sizeof (gchar *));
+  for (i = 0, out = buffer; i < count; i++) {
+    tokens[i] = out;
+    out += strlen (out) + 1;
+  }
+  tokens[count] = NULL;
+  return tokens;
+}
+
+/**
+ * Turn IM markup into plain text. Returns a newly allocated string.
+ */
+gchar *
+valet_markup_strip (const gchar *markup, gsize length) {
+  Scanner s = { markup, markup + length, TRUE };
+  gchar *text, *out;
+  gsize n;
+
+  text = out = g_malloc (length + 1);
+  while (0 != (n = scanner_next (&s, out))) {
+    out += n;
+  }
+  *out = '\0';
+  return text;
+}
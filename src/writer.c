@@ -0,0 +1,186 @@
+/***
+ * writer.c
+ * Non-blocking writer for command input.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "writer.h"
+
+/* Writes per wakeup, so that one large paste cannot hog the main loop. */
+#define WRITES_PER_WAKEUP 16
+
+struct _PipeWriter {
+  gint fd;
+  guint watch;
+  gchar *buffer;
+  gsize length;
+  gsize written;
+  gboolean closing; /* Close the pipe once the buffer is written */
+};
+
+static void
+writer_finish (PipeWriter *writer) {
+  close (writer->fd);
+  writer->fd = -1;
+  writer->watch = 0;
+  g_free (writer->buffer);
+  writer->buffer = NULL;
+  writer->length = writer->written = 0;
+}
+
+static gboolean
+writer_ready (GIOChannel *channel, GIOCondition cond, gpointer data) {
+  PipeWriter *writer = data;
+  ssize_t n;
+  guint i;
+
+  for (i = 0; i < WRITES_PER_WAKEUP && writer->written < writer->length;
+       i++) {
+    n = write (writer->fd, writer->buffer + writer->written,
+               writer->length - writer->written);
+    if (n < 0 && EINTR == errno) {
+      continue;
+    }
+    if (n < 0 && EAGAIN == errno) {
+      return TRUE;
+    }
+    if (n < 0) {
+      /* EPIPE just means the command did not want the rest. */
+      if (EPIPE != errno) {
+        g_warning ("Error writing command input: %s", g_strerror (errno));
+      }
+      writer_finish (writer);
+      return FALSE;
+    }
+    writer->written += n;
+  }
+
+  if (writer->written < writer->length) {
+    return TRUE;
+  }
+  if (writer->closing) {
+    writer_finish (writer);
+  }
+  else {
+    /* Nothing to write until more is appended; a writable pipe would only
+     * wake us up for nothing. */
+    writer->watch = 0;
+  }
+  return FALSE;
+}
+
+static void
+writer_watch (PipeWriter *writer) {
+  GIOChannel *channel;
+
+  if (0 != writer->watch) {
+    return;
+  }
+  channel = g_io_channel_unix_new (writer->fd);
+  writer->watch = g_io_add_watch
+    (channel, G_IO_OUT | G_IO_HUP | G_IO_ERR, writer_ready, writer);
+  g_io_channel_unref (channel);
+}
+
+static PipeWriter *
+writer_new (gint fd, gchar *buffer, gsize length, gboolean closing) {
+  PipeWriter *writer;
+
+  writer = g_new0 (PipeWriter, 1);
+  writer->fd = fd;
+  writer->buffer = buffer;
+  writer->length = length;
+  writer->closing = closing;
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+  return writer;
+}
+
+/**
+ * Write the `length` bytes at `buffer` to `fd`. The writer owns both from
+ * now on, and frees the buffer as soon as it is done with it.
+ */
+PipeWriter *
+valet_writer_new (gint fd, gchar *buffer, gsize length) {
+  PipeWriter *writer;
+
+  writer = writer_new (fd, buffer, length, TRUE);
+  writer_watch (writer);
+  return writer;
+}
+
+/**
+ * Take over `fd`, with nothing to write to it yet.
+ */
+PipeWriter *
+valet_writer_stream (gint fd) {
+  return writer_new (fd, NULL, 0, FALSE);
+}
+
+/**
+ * Queue a copy of `length` bytes at `data` behind whatever is still
+ * unwritten. Returns FALSE if the pipe is closed already.
+ */
+gboolean
+valet_writer_append (PipeWriter *writer, const gchar *data, gsize length) {
+  gsize pending;
+
+  if (-1 == writer->fd || writer->closing) {
+    return FALSE;
+  }
+
+  /* Drop what has been written before making room for more. */
+  pending = writer->length - writer->written;
+  if (0 != writer->written) {
+    memmove (writer->buffer, writer->buffer + writer->written, pending);
+    writer->written = 0;
+  }
+  writer->buffer = g_realloc (writer->buffer, pending + length);
+  memcpy (writer->buffer + pending, data, length);
+  writer->length = pending + length;
+  writer_watch (writer);
+  return TRUE;
+}
+
+/**
+ * Bytes appended and not yet written.
+ */
+gsize
+valet_writer_pending (PipeWriter *writer) {
+  return writer->length - writer->written;
+}
+
+/**
+ * Close the pipe once everything appended so far is written.
+ */
+void
+valet_writer_close (PipeWriter *writer) {
+  if (-1 == writer->fd) {
+    return;
+  }
+  writer->closing = TRUE;
+  if (writer->written == writer->length) {
+    if (0 != writer->watch) {
+      g_source_remove (writer->watch);
+    }
+    writer_finish (writer);
+  }
+  else {
+    writer_watch (writer);
+  }
+}
+
+void
+valet_writer_free (PipeWriter *writer) {
+  if (0 != writer->watch) {
+    g_source_remove (writer->watch);
+  }
+  if (-1 != writer->fd) {
+    close (writer->fd);
+  }
+  g_free (writer->buffer);
+  g_free (writer);
+}
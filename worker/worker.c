@@ -0,0 +1,678 @@
+/***
+ * worker.c
+ * valet-worker: takes the jobs valet queues in redis, runs them against a
+ * commands directory of its own and publishes what they print.
+ */
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib-unix.h>
+
+#include "defines.h"
+#include "executor.h"
+#include "index.h"
+#include "reader.h"
+#include "redis.h"
+#include "remote.h"
+#include "writer.h"
+
+/* Seconds a blocking pop waits for a job before it is sent again */
+#define POP_TIMEOUT "5"
+/* Heartbeats a worker may miss before its jobs are queued again */
+#define HEARTBEAT_MISSES 3
+/* Seconds before retrying after redis went away mid-request */
+#define RETRY_SECONDS 1
+
+/* Exit statuses for jobs that could not be run, as a shell would have */
+#define STATUS_CANNOT_RUN (126 << 8)
+#define STATUS_UNKNOWN    (127 << 8)
+
+/**
+ * Queue again every job held by a worker whose heartbeat has lapsed, oldest
+ * first, and forget the worker. It runs as one script so that two workers
+ * noticing at once cannot both do it.
+ * KEYS: the set of workers and the queue. ARGV: the key prefix.
+ */
+#define REQUEUE_SCRIPT                                                  \
+  "local moved = 0\n"                                                   \
+  "for _, id in ipairs(redis.call('SMEMBERS', KEYS[1])) do\n"           \
+  "  local worker = ARGV[1] .. ':worker:' .. id\n"                      \
+  "  if redis.call('EXISTS', worker .. ':alive') == 0 then\n"           \
+  "    local job = redis.call('LPOP', worker .. ':jobs')\n"             \
+  "    while job do\n"                                                  \
+  "      redis.call('RPUSH', KEYS[2], job)\n"                           \
+  "      moved = moved + 1\n"                                           \
+  "      job = redis.call('LPOP', worker .. ':jobs')\n"                 \
+  "    end\n"                                                           \
+  "    redis.call('SREM', KEYS[1], id)\n"                               \
+  "  end\n"                                                             \
+  "end\n"                                                               \
+  "return moved\n"
+
+typedef struct {
+  gchar *id;
+  gchar *commands_path;
+  ValetLimits limits; /* Defaults for every job */
+  gchar *cgroup_path;
+  gsize read_buffer_bytes;
+  guint concurrency; /* Jobs run at once */
+  guint heartbeat; /* Seconds between heartbeats */
+  gchar *prefix;
+  gchar *queue;
+  gchar *processing; /* Jobs taken and not yet over */
+  gchar *alive;
+  gchar *workers;
+  Redis *redis; /* Heartbeats, output and bookkeeping */
+  Redis *pop; /* Blocking pops, which would hold up everything else */
+  CommandIndex *index;
+  GHashTable *jobs; /* id -> Job */
+  gboolean popping; /* Whether a pop is waiting for a job */
+  gboolean recovering; /* Whether our list is being looked over */
+  guint retry;
+} Worker;
+
+/**
+ * One job, from the moment it is taken until it is over.
+ */
+typedef struct {
+  Worker *worker;
+  gchar *payload; /* As taken, to be removed from the processing list */
+  gsize length;
+  gchar *id;
+  gchar *name;
+  gchar *channel;
+  ValetLimits limits;
+  gchar *cgroup;
+  GPid pid;
+  LineReader *readers[2]; /* stdout and stderr */
+  PipeWriter *writer;
+  guint open_streams;
+  gboolean exited;
+  gint status;
+  guint deadline; /* Pending SIGTERM or SIGKILL */
+} Job;
+
+static gchar *config_path;
+static GMainLoop *loop;
+
+static void
+worker_take (Worker *);
+
+static void
+worker_recover (Worker *);
+
+/**
+ * Publish one message on the job's channel: `type` and then `length` bytes
+ * of `text`.
+ */
+static void
+job_publish (Job *job, gchar type, const gchar *text, gsize length) {
+  const gchar *argv[3];
+  gsize argvlen[3];
+  gchar *message;
+
+  message = g_malloc (length + 1);
+  message[0] = type;
+  memcpy (message + 1, text, length);
+
+  argv[0] = "PUBLISH";
+  argvlen[0] = strlen (argv[0]);
+  argv[1] = job->channel;
+  argvlen[1] = strlen (argv[1]);
+  argv[2] = message;
+  argvlen[2] = length + 1;
+  valet_redis_command_argv
+    (job->worker->redis, NULL, NULL, 3, argv, argvlen);
+  g_free (message);
+}
+
+static void
+job_notice (Job *job, const gchar *notice) {
+  job_publish (job, VALET_REMOTE_LINE, notice, strlen (notice));
+}
+
+/**
+ * Take the job off this worker's list and forget it.
+ */
+static void
+job_free (Job *job) {
+  Worker *worker = job->worker;
+  const gchar *argv[4];
+  gsize argvlen[4];
+
+  argv[0] = "LREM";
+  argvlen[0] = strlen (argv[0]);
+  argv[1] = worker->processing;
+  argvlen[1] = strlen (argv[1]);
+  argv[2] = "1";
+  argvlen[2] = 1;
+  argv[3] = job->payload;
+  argvlen[3] = job->length;
+  valet_redis_command_argv (worker->redis, NULL, NULL, 4, argv, argvlen);
+
+  if (NULL != job->id) {
+    g_hash_table_remove (worker->jobs, job->id);
+  }
+  if (0 != job->deadline) {
+    g_source_remove (job->deadline);
+  }
+  if (NULL != job->cgroup) {
+    valet_cgroup_free (job->cgroup);
+  }
+  if (NULL != job->readers[0]) {
+    valet_reader_free (job->readers[0]);
+  }
+  if (NULL != job->readers[1]) {
+    valet_reader_free (job->readers[1]);
+  }
+  if (NULL != job->writer) {
+    valet_writer_free (job->writer);
+  }
+  g_free (job->payload);
+  g_free (job->id);
+  g_free (job->name);
+  g_free (job->channel);
+  g_free (job);
+}
+
+/**
+ * Report how the job ended, and make room for the next one.
+ */
+static void
+job_finish (Job *job, gint status) {
+  Worker *worker = job->worker;
+  gchar *text;
+
+  text = g_strdup_printf ("%d", status);
+  job_publish (job, VALET_REMOTE_EXIT, text, strlen (text));
+  g_free (text);
+  job_free (job);
+  worker_take (worker);
+}
+
+/**
+ * A job is over once its process has exited and both of its output
+ * streams have been drained.
+ */
+static void
+job_maybe_finish (Job *job) {
+  if (job->exited && 0 == job->open_streams) {
+    job_finish (job, job->status);
+  }
+}
+
+static void
+job_line (const gchar *line, gsize length, gpointer data) {
+  job_publish (data, VALET_REMOTE_LINE, line, length);
+}
+
+static void
+job_stream_closed (gpointer data) {
+  Job *job = data;
+
+  job->open_streams--;
+  job_maybe_finish (job);
+}
+
+static void
+job_exited (GPid pid, gint status, gpointer data) {
+  Job *job = data;
+
+  g_spawn_close_pid (pid);
+  job->exited = TRUE;
+  job->status = status;
+  job_maybe_finish (job);
+}
+
+/**
+ * The grace period is over; kill what is left of the job and stop reading
+ * its output, which children left behind by an exited job may hold open.
+ */
+static gboolean
+job_kill (gpointer data) {
+  Job *job = data;
+  guint i;
+
+  job->deadline = 0;
+  valet_child_kill (job->pid, SIGKILL);
+  if (NULL != job->cgroup) {
+    valet_cgroup_kill (job->cgroup);
+  }
+
+  for (i = 0; i < G_N_ELEMENTS (job->readers); i++) {
+    if (NULL != job->readers[i]) {
+      valet_reader_close (job->readers[i]);
+    }
+  }
+  job->open_streams = 0;
+  job_maybe_finish (job);
+  return FALSE;
+}
+
+static gboolean
+job_timeout (gpointer data) {
+  Job *job = data;
+  gchar *notice;
+
+  notice = g_strdup_printf
+    ("[%s timed out after %" G_GUINT64_FORMAT "s and was stopped]",
+     job->name, job->limits.timeout);
+  job_notice (job, notice);
+  g_free (notice);
+
+  valet_child_kill (job->pid, SIGTERM);
+  job->deadline = g_timeout_add_seconds
+    (job->limits.kill_grace, job_kill, job);
+  return FALSE;
+}
+
+/**
+ * Run the job in `payload`, just taken off the queue. Jobs whose deadline
+ * has passed are dropped: whoever queued them has stopped waiting.
+ */
+static void
+job_start (Worker *worker, const gchar *payload, gsize length) {
+  const CommandEntry *entry;
+  GError *error = NULL;
+  gchar **argv, *input, *notice;
+  gint64 deadline, now;
+  gint child_stdin, child_stdout, child_stderr;
+  Job *job;
+
+  job = g_new0 (Job, 1);
+  job->worker = worker;
+  job->payload = g_malloc (length);
+  memcpy (job->payload, payload, length);
+  job->length = length;
+
+  argv = valet_remote_job_decode
+    (payload, length, &job->id, &deadline, &input);
+  if (NULL == argv) {
+    g_warning ("Dropping a malformed job.");
+    job_free (job);
+    return;
+  }
+  g_hash_table_insert (worker->jobs, job->id, job);
+  job->name = g_strdup (argv[0]);
+  job->channel = g_strdup_printf
+    (VALET_REMOTE_CHANNEL, worker->prefix, job->id);
+
+  now = g_get_real_time () / G_USEC_PER_SEC;
+  if (0 != deadline && now >= deadline) {
+    g_message ("Dropping job %s, which waited too long.", job->id);
+    job_free (job);
+    g_strfreev (argv);
+    g_free (input);
+    return;
+  }
+  job_publish (job, VALET_REMOTE_STARTED, worker->id, strlen (worker->id));
+
+  entry = valet_index_lookup (worker->index, argv[0]);
+  if (NULL == entry) {
+    notice = g_strdup_printf ("Unknown command: %s", argv[0]);
+    job_notice (job, notice);
+    g_free (notice);
+    job_finish (job, STATUS_UNKNOWN);
+    g_strfreev (argv);
+    g_free (input);
+    return;
+  }
+
+  /* Whoever queued the job gives up at its deadline, so stop by then. */
+  job->limits = worker->limits;
+  valet_limits_merge (&job->limits, &entry->limits);
+  if (0 != deadline
+      && (0 == job->limits.timeout
+          || (guint64) (deadline - now) < job->limits.timeout)) {
+    job->limits.timeout = deadline - now;
+  }
+
+  if (NULL != worker->cgroup_path) {
+    job->cgroup = valet_cgroup_new
+      (worker->cgroup_path, &job->limits, &error);
+    if (NULL == job->cgroup) {
+      g_warning ("Running %s outside a cgroup: %s",
+                 job->name, error->message);
+      g_clear_error (&error);
+    }
+  }
+
+  g_free (argv[0]);
+  argv[0] = g_strdup (entry->path);
+  if (!valet_executor_spawn
+      (worker->commands_path, argv, &job->limits, job->cgroup, &job->pid,
+       &child_stdin, &child_stdout, &child_stderr, &error)) {
+    notice = g_strdup_printf ("Cannot run %s: %s", job->name, error->message);
+    g_warning ("%s", notice);
+    job_notice (job, notice);
+    g_free (notice);
+    g_error_free (error);
+    job_finish (job, STATUS_CANNOT_RUN);
+    g_strfreev (argv);
+    g_free (input);
+    return;
+  }
+  g_strfreev (argv);
+
+  if (0 != job->limits.timeout) {
+    job->deadline = g_timeout_add_seconds
+      (job->limits.timeout, job_timeout, job);
+  }
+
+  if (NULL != input) {
+    job->writer = valet_writer_new (child_stdin, input, strlen (input));
+  }
+  else {
+    close (child_stdin);
+  }
+
+  job->open_streams = 2;
+  job->readers[0] = valet_reader_new
+    (child_stdout, worker->read_buffer_bytes,
+     job_line, job_stream_closed, job);
+  job->readers[1] = valet_reader_new
+    (child_stderr, worker->read_buffer_bytes,
+     job_line, job_stream_closed, job);
+  valet_child_watch (job->pid, job_exited, job);
+}
+
+static gboolean
+worker_retry (gpointer data) {
+  Worker *worker = data;
+
+  worker->retry = 0;
+  worker_recover (worker);
+  return FALSE;
+}
+
+static void
+worker_popped_cb (redisReply *reply, gpointer data) {
+  Worker *worker = data;
+
+  worker->popping = FALSE;
+  if (NULL == reply) {
+    /* The job may have been moved to our list without our hearing of it. */
+    if (0 == worker->retry) {
+      worker->retry = g_timeout_add_seconds
+        (RETRY_SECONDS, worker_retry, worker);
+    }
+    return;
+  }
+  if (REDIS_REPLY_STRING == reply->type) {
+    job_start (worker, reply->str, reply->len);
+  }
+  else if (REDIS_REPLY_ERROR == reply->type) {
+    g_warning ("Could not take a job: %s", reply->str);
+  }
+  worker_take (worker);
+}
+
+/**
+ * Wait for the next job if there is room for it. The job is moved onto
+ * this worker's list in the same step, so it is never only in our hands.
+ */
+static void
+worker_take (Worker *worker) {
+  if (worker->popping || worker->recovering || 0 != worker->retry
+      || g_hash_table_size (worker->jobs) >= worker->concurrency) {
+    return;
+  }
+  worker->popping = TRUE;
+  valet_redis_command
+    (worker->pop, worker_popped_cb, worker,
+     "BRPOPLPUSH", worker->queue, worker->processing, POP_TIMEOUT, NULL);
+}
+
+static void
+worker_recovered_cb (redisReply *reply, gpointer data) {
+  Worker *worker = data;
+  redisReply *element;
+  const gchar *argv[4];
+  gsize argvlen[4];
+  guint moved = 0;
+  gsize i;
+
+  worker->recovering = FALSE;
+  if (NULL == reply || REDIS_REPLY_ARRAY != reply->type) {
+    if (0 == worker->retry) {
+      worker->retry = g_timeout_add_seconds
+        (RETRY_SECONDS, worker_retry, worker);
+    }
+    return;
+  }
+
+  /* Every job starts with its id, so its str is just that. */
+  for (i = 0; i < reply->elements; i++) {
+    element = reply->element[i];
+    if (REDIS_REPLY_STRING != element->type
+        || g_hash_table_contains (worker->jobs, element->str)) {
+      continue;
+    }
+    argv[0] = "LREM";
+    argvlen[0] = strlen (argv[0]);
+    argv[1] = worker->processing;
+    argvlen[1] = strlen (argv[1]);
+    argv[2] = "1";
+    argvlen[2] = 1;
+    argv[3] = element->str;
+    argvlen[3] = element->len;
+    valet_redis_command_argv (worker->redis, NULL, NULL, 4, argv, argvlen);
+
+    argv[0] = "RPUSH";
+    argvlen[0] = strlen (argv[0]);
+    argv[1] = worker->queue;
+    argvlen[1] = strlen (argv[1]);
+    argv[2] = element->str;
+    argvlen[2] = element->len;
+    valet_redis_command_argv (worker->redis, NULL, NULL, 3, argv, argvlen);
+    moved++;
+  }
+  if (moved > 0) {
+    g_message ("Queued %u jobs of ours again.", moved);
+  }
+  worker_take (worker);
+}
+
+/**
+ * Put back anything on this worker's list that it is not running: jobs
+ * left by an earlier run under the same id, or taken while the connection
+ * went away. Jobs are only taken again once that is done, or a job taken
+ * meanwhile would be put back while it runs.
+ */
+static void
+worker_recover (Worker *worker) {
+  worker->recovering = TRUE;
+  valet_redis_command
+    (worker->redis, worker_recovered_cb, worker,
+     "LRANGE", worker->processing, "0", "-1", NULL);
+}
+
+static void
+worker_requeued_cb (redisReply *reply, gpointer data G_GNUC_UNUSED) {
+  if (NULL != reply && REDIS_REPLY_INTEGER == reply->type
+      && reply->integer > 0) {
+    g_message ("Queued %lld jobs of dead workers again.", reply->integer);
+  }
+  else if (NULL != reply && REDIS_REPLY_ERROR == reply->type) {
+    g_warning ("Could not look for dead workers: %s", reply->str);
+  }
+}
+
+/**
+ * Say that we are alive and how busy we are, then look for workers that
+ * are not.
+ */
+static gboolean
+worker_heartbeat (gpointer data) {
+  Worker *worker = data;
+  gchar *running, *ttl;
+
+  running = g_strdup_printf ("%u", g_hash_table_size (worker->jobs));
+  ttl = g_strdup_printf ("%u", worker->heartbeat * HEARTBEAT_MISSES);
+  valet_redis_command
+    (worker->redis, NULL, NULL,
+     "SET", worker->alive, running, "EX", ttl, NULL);
+  valet_redis_command
+    (worker->redis, NULL, NULL, "SADD", worker->workers, worker->id, NULL);
+  valet_redis_command
+    (worker->redis, worker_requeued_cb, worker,
+     "EVAL", REQUEUE_SCRIPT, "2", worker->workers, worker->queue,
+     worker->prefix, NULL);
+  g_free (ttl);
+  g_free (running);
+  return TRUE;
+}
+
+static gint
+get_positive_integer (GKeyFile *keyfile,
+                      const gchar *group,
+                      const gchar *key,
+                      gint fallback) {
+  gint value = g_key_file_get_integer (keyfile, group, key, NULL);
+  return value > 0 ? value : fallback;
+}
+
+/**
+ * Read the worker's settings from the same kind of file valet reads.
+ */
+static Worker *
+worker_new (const gchar *path, GError **error) {
+  GKeyFile *keyfile;
+  Worker *worker;
+  gchar *host;
+  gint port;
+
+  keyfile = g_key_file_new ();
+  if (!g_key_file_load_from_file (keyfile, path, G_KEY_FILE_NONE, error)) {
+    g_key_file_free (keyfile);
+    return NULL;
+  }
+
+  worker = g_new0 (Worker, 1);
+  worker->commands_path = g_key_file_get_string
+    (keyfile, "valet", "commands", error);
+  host = g_key_file_get_string (keyfile, "redis", "host", NULL);
+  if (NULL == worker->commands_path || NULL == host) {
+    if (NULL == *error) {
+      g_set_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND,
+                   "%s has no [redis] host", path);
+    }
+    g_free (worker->commands_path);
+    g_free (worker);
+    g_free (host);
+    g_key_file_free (keyfile);
+    return NULL;
+  }
+  port = get_positive_integer (keyfile, "redis", "port", 6379);
+
+  worker->limits.timeout = DEFAULT_COMMAND_TIMEOUT;
+  worker->limits.kill_grace = DEFAULT_KILL_GRACE;
+  valet_limits_load (&worker->limits, keyfile, "limits");
+  worker->cgroup_path = g_key_file_get_string
+    (keyfile, "limits", "cgroup", NULL);
+  worker->read_buffer_bytes = get_positive_integer
+    (keyfile, "valet", "read_buffer_bytes", DEFAULT_READ_BUFFER_BYTES);
+  worker->concurrency = get_positive_integer
+    (keyfile, "remote", "concurrency", DEFAULT_REMOTE_CONCURRENCY);
+  worker->heartbeat = get_positive_integer
+    (keyfile, "remote", "heartbeat", DEFAULT_REMOTE_HEARTBEAT);
+
+  worker->prefix = g_key_file_get_string (keyfile, "remote", "prefix", NULL);
+  if (NULL == worker->prefix) {
+    worker->prefix = g_strdup (DEFAULT_REMOTE_PREFIX);
+  }
+  worker->id = g_key_file_get_string (keyfile, "remote", "id", NULL);
+  if (NULL == worker->id) {
+    worker->id = g_strdup_printf
+      ("%s-%d", g_get_host_name (), (gint) getpid ());
+  }
+
+  worker->queue = g_strdup_printf (VALET_REMOTE_QUEUE, worker->prefix);
+  worker->workers = g_strdup_printf (VALET_REMOTE_WORKERS, worker->prefix);
+  worker->processing = g_strdup_printf
+    (VALET_REMOTE_PROCESSING, worker->prefix, worker->id);
+  worker->alive = g_strdup_printf
+    (VALET_REMOTE_ALIVE, worker->prefix, worker->id);
+
+  worker->redis = valet_redis_new
+    (host, port, get_positive_integer
+     (keyfile, "redis", "max_pending", DEFAULT_REDIS_MAX_PENDING));
+  worker->pop = valet_redis_new (host, port, 1);
+  worker->index = valet_index_new (worker->commands_path);
+  worker->jobs = g_hash_table_new (g_str_hash, g_str_equal);
+
+  g_free (host);
+  g_key_file_free (keyfile);
+  return worker;
+}
+
+/**
+ * Stop whatever is running and leave. Jobs stay on our list, to be queued
+ * again once our heartbeat lapses.
+ */
+static gboolean
+handle_term (gpointer data) {
+  Worker *worker = data;
+  GHashTableIter iter;
+  Job *job;
+
+  g_message ("Stopping; %u jobs will be queued again.",
+             g_hash_table_size (worker->jobs));
+  g_hash_table_iter_init (&iter, worker->jobs);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &job)) {
+    valet_child_kill (job->pid, SIGTERM);
+  }
+  g_main_loop_quit (loop);
+  return FALSE;
+}
+
+static GOptionEntry options[] = {
+    { "config", 'c', 0,
+      G_OPTION_ARG_STRING, &config_path,
+      "Location of configuration file", NULL },
+    { NULL }
+};
+
+int
+main (int argc, char *argv[]) {
+  GOptionContext *context;
+  GError *error = NULL;
+  Worker *worker;
+
+  /* Commands may exit before reading all of their input. */
+  signal (SIGPIPE, SIG_IGN);
+
+  context = g_option_context_new ("- run valet's commands from redis");
+  g_option_context_add_main_entries (context, options, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    g_printerr ("%s\n", error->message);
+    return 1;
+  }
+  g_option_context_free (context);
+
+  if (NULL == config_path) {
+    config_path = DEFAULT_CONFIG_PATH;
+  }
+
+  worker = worker_new (config_path, &error);
+  if (NULL == worker) {
+    g_printerr ("Cannot read %s: %s\n", config_path, error->message);
+    return 1;
+  }
+
+  loop = g_main_loop_new (NULL, FALSE);
+  valet_executor_start (VALET_EXECUTOR_SPAWN);
+  g_unix_signal_add (SIGTERM, handle_term, worker);
+  g_unix_signal_add (SIGINT, handle_term, worker);
+
+  g_message ("Worker %s running up to %u jobs from %s",
+             worker->id, worker->concurrency, worker->queue);
+  worker_heartbeat (worker);
+  g_timeout_add_seconds (worker->heartbeat, worker_heartbeat, worker);
+  worker_recover (worker);
+
+  g_main_loop_run (loop);
+  return 0;
+}